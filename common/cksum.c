@@ -0,0 +1,344 @@
+/* This file implements the Internet checksum (RFC 1071).
+ *
+ * The checksum is the one's complement of the one's complement sum of
+ * the 16-bit words of the data. The sum does not depend on the order of
+ * the additions, nor on how the words are grouped: adding 32-bit words
+ * into a 64-bit accumulator and folding the carries back in at the end
+ * gives the same result as adding 16-bit words with an end-around carry.
+ * A 64-bit accumulator takes 2^32 32-bit words before it can overflow,
+ * far more than any packet.
+ *
+ * Since the sum does not depend on the byte order either, as long as all
+ * words are taken the same way, the words are loaded as they lie in
+ * memory and the result is stored the same way.
+ *
+ * Besides the portable scalar kernel there are SSE2 and AVX2 kernels on
+ * x86-64 and a NEON kernel on AArch64. They widen 32-bit lanes into
+ * 64-bit accumulators. The fastest kernel the CPU supports is picked on
+ * the first call. Every kernel also comes as a fused copy and checksum,
+ * which reads the data only once.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CKSUM_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CKSUM_NEON 1
+#endif
+
+#include "cksum.h"
+
+/* Sums the last len (< 4) bytes, the odd byte taken as the first byte
+ * of a word padded with zero.
+ */
+static uint64_t add_tail(uint64_t sum, const unsigned char *p, size_t len)
+{
+        uint16_t word;
+
+        if (len >= 2)
+        {
+                memcpy(&word, p, sizeof(word));
+                sum += word;
+                p += 2;
+                len -= 2;
+        }
+        if (len == 1)
+        {
+                word = 0;
+                memcpy(&word, p, 1);
+                sum += word;
+        }
+
+        return sum;
+}
+
+static uint64_t add_scalar(uint64_t sum, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        uint32_t word;
+
+        while (len >= sizeof(word))
+        {
+                memcpy(&word, p, sizeof(word));
+                sum += word;
+                p += sizeof(word);
+                len -= sizeof(word);
+        }
+
+        return add_tail(sum, p, len);
+}
+
+static uint64_t copy_add_scalar(uint64_t sum, void *dst, const void *src,
+                                size_t len)
+{
+        memcpy(dst, src, len);
+
+        return add_scalar(sum, dst, len);
+}
+
+#ifdef CKSUM_X86
+/* 16 bytes: the four 32-bit lanes widened into two 64-bit lanes twice. */
+static __m128i add_m128(__m128i acc, __m128i v)
+{
+        const __m128i zero = _mm_setzero_si128();
+
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+
+        return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+}
+
+static uint64_t sum_m128(__m128i acc)
+{
+        uint64_t lanes[2];
+
+        _mm_storeu_si128((__m128i *)lanes, acc);
+
+        return lanes[0] + lanes[1];
+}
+
+static uint64_t add_sse2(uint64_t sum, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = _mm_setzero_si128();
+
+        /* Two accumulators to overlap the additions. */
+        while (len >= 32)
+        {
+                acc0 = add_m128(acc0, _mm_loadu_si128((const __m128i *)p));
+                acc1 = add_m128(acc1,
+                                _mm_loadu_si128((const __m128i *)(p + 16)));
+                p += 32;
+                len -= 32;
+        }
+        if (len >= 16)
+        {
+                acc0 = add_m128(acc0, _mm_loadu_si128((const __m128i *)p));
+                p += 16;
+                len -= 16;
+        }
+        acc0 = _mm_add_epi64(acc0, acc1);
+
+        return add_scalar(sum + sum_m128(acc0), p, len);
+}
+
+static uint64_t copy_add_sse2(uint64_t sum, void *dst, const void *src,
+                              size_t len)
+{
+        const unsigned char *s = src;
+        unsigned char *d = dst;
+        __m128i acc = _mm_setzero_si128();
+        __m128i v;
+
+        while (len >= 16)
+        {
+                v = _mm_loadu_si128((const __m128i *)s);
+                _mm_storeu_si128((__m128i *)d, v);
+                acc = add_m128(acc, v);
+                s += 16;
+                d += 16;
+                len -= 16;
+        }
+
+        return copy_add_scalar(sum + sum_m128(acc), d, s, len);
+}
+
+__attribute__((target("avx2")))
+static __m256i add_m256(__m256i acc, __m256i v)
+{
+        const __m256i zero = _mm256_setzero_si256();
+
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+
+        return _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_m256(__m256i acc)
+{
+        uint64_t lanes[4];
+
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+static uint64_t add_avx2(uint64_t sum, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+
+        while (len >= 64)
+        {
+                acc0 = add_m256(acc0,
+                                _mm256_loadu_si256((const __m256i *)p));
+                acc1 = add_m256(acc1,
+                                _mm256_loadu_si256((const __m256i *)(p + 32)));
+                p += 64;
+                len -= 64;
+        }
+        if (len >= 32)
+        {
+                acc0 = add_m256(acc0,
+                                _mm256_loadu_si256((const __m256i *)p));
+                p += 32;
+                len -= 32;
+        }
+        sum += sum_m256(_mm256_add_epi64(acc0, acc1));
+
+        /* Leave no dirty upper halves behind for the SSE code, or every
+         * SSE instruction pays for the transition.
+         */
+        _mm256_zeroupper();
+
+        return add_sse2(sum, p, len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t copy_add_avx2(uint64_t sum, void *dst, const void *src,
+                              size_t len)
+{
+        const unsigned char *s = src;
+        unsigned char *d = dst;
+        __m256i acc = _mm256_setzero_si256();
+        __m256i v;
+
+        while (len >= 32)
+        {
+                v = _mm256_loadu_si256((const __m256i *)s);
+                _mm256_storeu_si256((__m256i *)d, v);
+                acc = add_m256(acc, v);
+                s += 32;
+                d += 32;
+                len -= 32;
+        }
+
+        sum += sum_m256(acc);
+        _mm256_zeroupper();
+
+        return copy_add_sse2(sum, d, s, len);
+}
+#endif
+
+#ifdef CKSUM_NEON
+static uint64_t add_neon(uint64_t sum, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        uint64x2_t acc0 = vdupq_n_u64(0);
+        uint64x2_t acc1 = vdupq_n_u64(0);
+
+        /* Pairwise add of the 32-bit lanes into the 64-bit lanes. */
+        while (len >= 32)
+        {
+                acc0 = vpadalq_u32(acc0, vld1q_u32((const uint32_t *)p));
+                acc1 = vpadalq_u32(acc1,
+                                   vld1q_u32((const uint32_t *)(p + 16)));
+                p += 32;
+                len -= 32;
+        }
+        acc0 = vaddq_u64(acc0, acc1);
+
+        return add_scalar(sum + vgetq_lane_u64(acc0, 0) +
+                          vgetq_lane_u64(acc0, 1), p, len);
+}
+
+static uint64_t copy_add_neon(uint64_t sum, void *dst, const void *src,
+                              size_t len)
+{
+        const unsigned char *s = src;
+        unsigned char *d = dst;
+        uint64x2_t acc = vdupq_n_u64(0);
+        uint32x4_t v;
+
+        while (len >= 16)
+        {
+                v = vld1q_u32((const uint32_t *)s);
+                vst1q_u32((uint32_t *)d, v);
+                acc = vpadalq_u32(acc, v);
+                s += 16;
+                d += 16;
+                len -= 16;
+        }
+
+        return copy_add_scalar(sum + vgetq_lane_u64(acc, 0) +
+                               vgetq_lane_u64(acc, 1), d, s, len);
+}
+#endif
+
+static const struct cksum_impl impls[] = {
+        { "scalar", add_scalar, copy_add_scalar },
+#ifdef CKSUM_X86
+        { "sse2", add_sse2, copy_add_sse2 },
+        { "avx2", add_avx2, copy_add_avx2 },
+#endif
+#ifdef CKSUM_NEON
+        { "neon", add_neon, copy_add_neon },
+#endif
+};
+
+static const struct cksum_impl *selected;
+
+static int num_supported(void)
+{
+        int count = sizeof(impls) / sizeof(impls[0]);
+
+#ifdef CKSUM_X86
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2"))
+        {
+                count--;
+        }
+#endif
+
+        return count;
+}
+
+const struct cksum_impl *cksum_impls(int *count)
+{
+        *count = num_supported();
+
+        return impls;
+}
+
+const struct cksum_impl *cksum_selected(void)
+{
+        /* Racing threads all pick the same one. */
+        if (selected == NULL)
+        {
+                selected = &impls[num_supported() - 1];
+        }
+
+        return selected;
+}
+
+uint64_t cksum_add(uint64_t sum, const void *data, size_t len)
+{
+        return cksum_selected()->add(sum, data, len);
+}
+
+uint16_t cksum_finish(uint64_t sum)
+{
+        /* Fold the carries back in until the sum fits 16 bits. */
+        sum = (sum >> 32) + (sum & 0xffffffff);
+        sum = (sum >> 32) + (sum & 0xffffffff);
+        sum = (sum >> 16) + (sum & 0xffff);
+        sum = (sum >> 16) + (sum & 0xffff);
+        sum = (sum >> 16) + (sum & 0xffff);
+
+        return ~sum;
+}
+
+uint16_t cksum(const void *data, size_t len)
+{
+        return cksum_finish(cksum_add(0, data, len));
+}
+
+uint16_t cksum_copy(void *dst, const void *src, size_t len)
+{
+        return cksum_finish(cksum_selected()->copy_add(0, dst, src, len));
+}
@@ -0,0 +1,43 @@
+#ifndef __CKSUM_H_
+#define __CKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Returns the Internet checksum (RFC 1071) of data, ready to be stored
+ * in the packet. Summing data that includes a correct checksum field
+ * returns 0.
+ */
+extern uint16_t cksum(const void *data, size_t len);
+
+/* Copies len bytes from src to dst and returns the checksum of them, in
+ * one pass over the data.
+ */
+extern uint16_t cksum_copy(void *dst, const void *src, size_t len);
+
+/* The partial sums below let a checksum be taken over several pieces,
+ * like a pseudo header and a payload. Every piece but the last must be
+ * of even length. cksum_finish turns the sum into the checksum.
+ */
+extern uint64_t cksum_add(uint64_t sum, const void *data, size_t len);
+
+extern uint16_t cksum_finish(uint64_t sum);
+
+/* One implementation of the checksum kernels. */
+struct cksum_impl
+{
+        const char *name;
+        uint64_t (*add)(uint64_t sum, const void *data, size_t len);
+        uint64_t (*copy_add)(uint64_t sum, void *dst, const void *src,
+                             size_t len);
+};
+
+/* Returns the implementations this CPU can run, the fastest last, and
+ * their number in count. Meant for tests and benchmarks.
+ */
+extern const struct cksum_impl *cksum_impls(int *count);
+
+/* Returns the implementation picked for this CPU. */
+extern const struct cksum_impl *cksum_selected(void);
+
+#endif
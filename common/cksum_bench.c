@@ -0,0 +1,304 @@
+/* This is a micro-benchmark of the checksum kernels in cksum.c.
+ * Every kernel the CPU supports is timed on payloads from 64 bytes to
+ * 64 KB, checksum alone and fused with a copy, and the throughput is
+ * printed in GB/s. The results of every kernel are checked against the
+ * scalar one on the way. For comparison the 16 bits at a time loop the
+ * ping programs used before is timed too.
+ *
+ * The incremental updates of inccksum.c are checked first as well: the
+ * checksums of random echo requests are updated for the fields a reply
+ * or a resend changes, and compared with those of the changed packet
+ * summed in full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cksum.h"
+#include "inccksum.h"
+
+#define MIN_SIZE 64
+#define MAX_SIZE 65536
+#define BYTES_PER_RUN (256ULL << 20) /* Per kernel and size. */
+#define NS_PER_SEC 1000000000.0
+#define INCCKSUM_PACKETS 100000
+#define IP_HDR_LEN 20
+#define ICMP_HDR_LEN 8
+#define MAX_ICMP_DATA 301
+
+static unsigned char src[MAX_SIZE + 1];
+static unsigned char dst[MAX_SIZE + 1];
+
+/* The old in_cksum loop, with an unsigned accumulator. */
+static uint64_t add_legacy(uint64_t sum, const void *data, size_t len)
+{
+        const uint16_t *w = data;
+        uint32_t sum32 = 0;
+        uint16_t odd = 0;
+
+        while (len > 1)
+        {
+                sum32 += *w++;
+                len -= 2;
+        }
+        if (len == 1)
+        {
+                memcpy(&odd, w, 1);
+                sum32 += odd;
+        }
+
+        return sum + sum32;
+}
+
+static uint64_t copy_add_legacy(uint64_t sum, void *dst, const void *src,
+                                size_t len)
+{
+        memcpy(dst, src, len);
+
+        return add_legacy(sum, dst, len);
+}
+
+static const struct cksum_impl legacy = {
+        "legacy", add_legacy, copy_add_legacy
+};
+
+static double now_sec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / NS_PER_SEC;
+}
+
+/* Returns GB/s. The sums are kept in *sink so the work is not dropped. */
+static double time_add(const struct cksum_impl *impl, size_t size,
+                       uint64_t *sink)
+{
+        unsigned long long runs = BYTES_PER_RUN / size;
+        unsigned long long i;
+        double start = now_sec();
+
+        for (i = 0; i < runs; i++)
+        {
+                *sink += impl->add(0, src, size);
+        }
+
+        return runs * size / (now_sec() - start) / 1e9;
+}
+
+static double time_copy_add(const struct cksum_impl *impl, size_t size,
+                            uint64_t *sink)
+{
+        unsigned long long runs = BYTES_PER_RUN / size;
+        unsigned long long i;
+        double start = now_sec();
+
+        for (i = 0; i < runs; i++)
+        {
+                *sink += impl->copy_add(0, dst, src, size);
+        }
+
+        return runs * size / (now_sec() - start) / 1e9;
+}
+
+static int check(const struct cksum_impl *impl,
+                 const struct cksum_impl *ref)
+{
+        size_t len;
+        size_t offset;
+
+        for (offset = 0; offset < 2; offset++)
+        {
+                for (len = 0; len <= 300; len++)
+                {
+                        if (cksum_finish(impl->add(0, src + offset, len)) !=
+                            cksum_finish(ref->add(0, src + offset, len)) ||
+                            cksum_finish(impl->copy_add(0, dst, src + offset,
+                                                        len)) !=
+                            cksum_finish(ref->add(0, src + offset, len)) ||
+                            memcmp(dst, src + offset, len) != 0)
+                        {
+                                fprintf(stderr, "%s differs from %s at "
+                                        "length %zu.\n", impl->name,
+                                        ref->name, len);
+                                return __LINE__;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+        uint16_t v;
+
+        memcpy(&v, p, sizeof(v));
+
+        return v;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+
+        return v;
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+
+        return v;
+}
+
+/* Returns the checksum of len bytes at data, with the checksum field at
+ * data + sum_offset taken as 0.
+ */
+static uint16_t full_cksum(unsigned char *data, size_t len, size_t sum_offset)
+{
+        uint16_t saved = get16(data + sum_offset);
+        uint16_t sum;
+
+        memset(data + sum_offset, 0, sizeof(sum));
+        sum = cksum(data, len);
+        memcpy(data + sum_offset, &saved, sizeof(saved));
+
+        return sum;
+}
+
+/* Turns a random IPv4 echo request into a reply to another address, the
+ * way pingserver and pingclient do: a new TTL, no fragment offset, a new
+ * destination, type 0, a new sequence number and a new 64-bit timestamp
+ * in the data. The checksums are updated incrementally and must match
+ * those of the reply summed in full, for even and odd lengths.
+ */
+static int check_inccksum(void)
+{
+        unsigned char pkt[IP_HDR_LEN + ICMP_HDR_LEN + MAX_ICMP_DATA];
+        unsigned char *icmp = pkt + IP_HDR_LEN;
+        unsigned char *stamp = icmp + ICMP_HDR_LEN + 8;
+        unsigned char new[8];
+        uint16_t ip_sum;
+        uint16_t icmp_sum;
+        uint16_t old16;
+        uint32_t old32;
+        uint64_t old64;
+        size_t icmp_len;
+        size_t i;
+        int n;
+
+        for (n = 0; n < INCCKSUM_PACKETS; n++)
+        {
+                icmp_len = ICMP_HDR_LEN + rand() % (MAX_ICMP_DATA + 1);
+                for (i = 0; i < IP_HDR_LEN + icmp_len; i++)
+                {
+                        pkt[i] = rand();
+                }
+                for (i = 0; i < sizeof(new); i++)
+                {
+                        new[i] = rand();
+                }
+                ip_sum = full_cksum(pkt, IP_HDR_LEN, 10);
+                icmp_sum = full_cksum(icmp, icmp_len, 2);
+
+                /* The TTL and protocol word, and the fragment offset. */
+                old16 = get16(pkt + 8);
+                pkt[8] = new[0];
+                ip_sum = inccksum_update16(ip_sum, old16, get16(pkt + 8));
+                old16 = get16(pkt + 6);
+                memset(pkt + 6, 0, 2);
+                ip_sum = inccksum_update16(ip_sum, old16, 0);
+
+                old32 = get32(pkt + 16);
+                memcpy(pkt + 16, new, 4);
+                ip_sum = inccksum_update32(ip_sum, old32, get32(pkt + 16));
+
+                /* The type and code word, and the sequence number. */
+                old16 = get16(icmp);
+                memset(icmp, 0, 2);
+                icmp_sum = inccksum_update16(icmp_sum, old16, 0);
+                old16 = get16(icmp + 6);
+                memcpy(icmp + 6, new + 4, 2);
+                icmp_sum = inccksum_update16(icmp_sum, old16,
+                                             get16(icmp + 6));
+
+                if (icmp_len >= ICMP_HDR_LEN + 16)
+                {
+                        old64 = get64(stamp);
+                        for (i = 0; i < 8; i++)
+                        {
+                                stamp[i] ^= new[i] | 1;
+                        }
+                        icmp_sum = inccksum_update64(icmp_sum, old64,
+                                                     get64(stamp));
+                }
+
+                if (ip_sum != full_cksum(pkt, IP_HDR_LEN, 10) ||
+                    icmp_sum != full_cksum(icmp, icmp_len, 2))
+                {
+                        fprintf(stderr, "Incremental checksum differs for "
+                                "%zu bytes of ICMP.\n", icmp_len);
+                        return __LINE__;
+                }
+        }
+
+        return 0;
+}
+
+int main(void)
+{
+        const struct cksum_impl *impls;
+        uint64_t sink = 0;
+        size_t size;
+        int count;
+        int i;
+
+        srand(1);
+        for (size = 0; size < sizeof(src); size++)
+        {
+                src[size] = rand();
+        }
+
+        if (check_inccksum() != 0)
+        {
+                return 1;
+        }
+
+        impls = cksum_impls(&count);
+        for (i = 0; i < count; i++)
+        {
+                if (check(&impls[i], &impls[0]) != 0)
+                {
+                        return 1;
+                }
+        }
+
+        printf("Selected kernel: %s.\n\n", cksum_selected()->name);
+        printf("%-8s %8s %12s %12s\n", "kernel", "bytes", "sum GB/s",
+               "copy+sum GB/s");
+        for (size = MIN_SIZE; size <= MAX_SIZE; size *= 4)
+        {
+                printf("%-8s %8zu %12.2f %12.2f\n", legacy.name, size,
+                       time_add(&legacy, size, &sink),
+                       time_copy_add(&legacy, size, &sink));
+        }
+        for (i = 0; i < count; i++)
+        {
+                for (size = MIN_SIZE; size <= MAX_SIZE; size *= 4)
+                {
+                        printf("%-8s %8zu %12.2f %12.2f\n", impls[i].name,
+                               size, time_add(&impls[i], size, &sink),
+                               time_copy_add(&impls[i], size, &sink));
+                }
+        }
+
+        return (sink == 42) ? 2 : 0;
+}
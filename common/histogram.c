@@ -0,0 +1,260 @@
+/* This file implements a log-linear (HdrHistogram style) histogram.
+ *
+ * With precision p the values below 2^p have a bucket each. Above that
+ * every range [2^e, 2^(e+1)) is split into 2^p buckets of width 2^(e-p).
+ * The bucket of a value is found from its highest set bit and the p bits
+ * below it, without any search:
+ *
+ *   value < 2^p:  index = value
+ *   otherwise:    shift = msb(value) - p
+ *                 index = (shift << p) + (value >> shift)
+ *
+ * The buckets of consecutive ranges follow each other, so the index grows
+ * with the value and percentiles are found by adding up the counts.
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+
+#define NS_PER_US 1000.0
+
+static unsigned int num_counts(unsigned int precision)
+{
+        return (HISTOGRAM_VALUE_BITS - precision + 1) << precision;
+}
+
+static unsigned int bucket_index(const struct histogram *h, uint64_t value)
+{
+        unsigned int shift;
+
+        if (value >> HISTOGRAM_VALUE_BITS)
+        {
+                value = (1ULL << HISTOGRAM_VALUE_BITS) - 1;
+        }
+        if (value < (1ULL << h->precision))
+        {
+                return value;
+        }
+
+        shift = 63 - __builtin_clzll(value) - h->precision;
+
+        return (shift << h->precision) + (value >> shift);
+}
+
+static uint64_t bucket_bottom(const struct histogram *h, unsigned int index)
+{
+        unsigned int shift;
+
+        if (index < (1U << h->precision))
+        {
+                return index;
+        }
+
+        shift = (index >> h->precision) - 1;
+
+        return (uint64_t)(index - (shift << h->precision)) << shift;
+}
+
+static uint64_t bucket_top(const struct histogram *h, unsigned int index)
+{
+        return bucket_bottom(h, index + 1) - 1;
+}
+
+int histogram_init(struct histogram *h, unsigned int precision)
+{
+        if (precision < HISTOGRAM_MIN_PRECISION ||
+            precision > HISTOGRAM_MAX_PRECISION)
+        {
+                return __LINE__;
+        }
+
+        h->precision = precision;
+        h->num_counts = num_counts(precision);
+        histogram_reset(h);
+
+        return 0;
+}
+
+void histogram_reset(struct histogram *h)
+{
+        h->total = 0;
+        h->min = UINT64_MAX;
+        h->max = 0;
+        h->sum = 0;
+        memset(h->counts, 0, h->num_counts * sizeof(h->counts[0]));
+}
+
+static void add_totals(struct histogram *h, uint64_t min, uint64_t max,
+                       uint64_t sum, uint64_t n)
+{
+        if (min < h->min)
+        {
+                h->min = min;
+        }
+        if (max > h->max)
+        {
+                h->max = max;
+        }
+        h->sum += sum;
+        h->total += n;
+}
+
+void histogram_record_n(struct histogram *h, uint64_t value, uint64_t n)
+{
+        h->counts[bucket_index(h, value)] += n;
+        add_totals(h, value, value, value * n, n);
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+        histogram_record_n(h, value, 1);
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+        unsigned int i;
+
+        if (src->total == 0)
+        {
+                return;
+        }
+
+        if (dst->precision == src->precision)
+        {
+                for (i = 0; i < src->num_counts; i++)
+                {
+                        dst->counts[i] += src->counts[i];
+                }
+        }
+        else
+        {
+                for (i = 0; i < src->num_counts; i++)
+                {
+                        if (src->counts[i] != 0)
+                        {
+                                dst->counts[bucket_index(dst,
+                                        bucket_bottom(src, i))] +=
+                                        src->counts[i];
+                        }
+                }
+        }
+
+        add_totals(dst, src->min, src->max, src->sum, src->total);
+}
+
+void histogram_subtract(struct histogram *now, const struct histogram *then)
+{
+        unsigned int first = now->num_counts;
+        unsigned int last = 0;
+        unsigned int i;
+
+        for (i = 0; i < now->num_counts; i++)
+        {
+                now->counts[i] -= then->counts[i];
+                if (now->counts[i] != 0)
+                {
+                        if (first == now->num_counts)
+                        {
+                                first = i;
+                        }
+                        last = i;
+                }
+        }
+
+        now->total -= then->total;
+        now->sum -= then->sum;
+        if (first == now->num_counts)
+        {
+                now->min = UINT64_MAX;
+                now->max = 0;
+        }
+        else
+        {
+                now->min = bucket_bottom(now, first);
+                now->max = bucket_top(now, last);
+        }
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double percentile)
+{
+        uint64_t target;
+        uint64_t count = 0;
+        uint64_t value;
+        unsigned int i;
+
+        if (h->total == 0)
+        {
+                return 0;
+        }
+
+        target = percentile / 100.0 * h->total + 0.5;
+        if (target < 1)
+        {
+                target = 1;
+        }
+        if (target >= h->total)
+        {
+                return h->max;
+        }
+
+        for (i = 0; i < h->num_counts; i++)
+        {
+                count += h->counts[i];
+                if (count >= target)
+                {
+                        break;
+                }
+        }
+
+        /* The top of the bucket, but never beyond what was recorded. */
+        value = bucket_top(h, i);
+        if (value > h->max)
+        {
+                value = h->max;
+        }
+        if (value < h->min)
+        {
+                value = h->min;
+        }
+
+        return value;
+}
+
+double histogram_mean(const struct histogram *h)
+{
+        return (h->total == 0) ? 0.0 : (double)h->sum / h->total;
+}
+
+void histogram_print_summary(const struct histogram *h, const char *label,
+                             FILE *out)
+{
+        fprintf(out, "%s p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, "
+                "max %.1f us.\n", label,
+                histogram_percentile(h, 50.0) / NS_PER_US,
+                histogram_percentile(h, 90.0) / NS_PER_US,
+                histogram_percentile(h, 99.0) / NS_PER_US,
+                histogram_percentile(h, 99.9) / NS_PER_US,
+                h->max / NS_PER_US);
+}
+
+void histogram_dump(const struct histogram *h, FILE *out)
+{
+        unsigned int i;
+
+        fprintf(out, "# histogram precision %u count %llu min %llu "
+                "max %llu sum %llu\n", h->precision,
+                (unsigned long long)h->total,
+                (unsigned long long)((h->total == 0) ? 0 : h->min),
+                (unsigned long long)h->max, (unsigned long long)h->sum);
+
+        for (i = 0; i < h->num_counts; i++)
+        {
+                if (h->counts[i] != 0)
+                {
+                        fprintf(out, "%llu %llu\n",
+                                (unsigned long long)bucket_bottom(h, i),
+                                (unsigned long long)h->counts[i]);
+                }
+        }
+}
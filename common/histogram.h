@@ -0,0 +1,80 @@
+#ifndef __HISTOGRAM_H_
+#define __HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Values are tracked up to 2^HISTOGRAM_VALUE_BITS, about 1100 seconds in
+ * nanoseconds. Larger values are counted in the last bucket.
+ */
+#define HISTOGRAM_VALUE_BITS 40
+#define HISTOGRAM_MIN_PRECISION 1
+#define HISTOGRAM_MAX_PRECISION 10
+#define HISTOGRAM_DEFAULT_PRECISION 7
+#define HISTOGRAM_MAX_COUNTS \
+        ((HISTOGRAM_VALUE_BITS - HISTOGRAM_MAX_PRECISION + 1) << \
+         HISTOGRAM_MAX_PRECISION)
+
+/* A log-linear histogram. Every power of two range of values is split
+ * into 2^precision equally wide buckets, so a value is known to within
+ * 2^-precision of itself (precision 7 is better than 1%). The counts are
+ * part of the structure, recording never allocates and a histogram can be
+ * a static, part of another structure or live in shared memory.
+ */
+struct histogram
+{
+        unsigned int precision;
+        unsigned int num_counts;
+        uint64_t total;
+        uint64_t min;
+        uint64_t max;
+        uint64_t sum;
+        uint64_t counts[HISTOGRAM_MAX_COUNTS];
+};
+
+/* Returns 0, or __LINE__ when precision is out of range. */
+extern int histogram_init(struct histogram *h, unsigned int precision);
+
+extern void histogram_reset(struct histogram *h);
+
+/* Counts value, in constant time. */
+extern void histogram_record(struct histogram *h, uint64_t value);
+
+extern void histogram_record_n(struct histogram *h, uint64_t value,
+                               uint64_t n);
+
+/* Adds the counts of src to dst, for instance the histograms of several
+ * threads once they are done. Histograms of different precision are
+ * merged at the precision of dst.
+ */
+extern void histogram_merge(struct histogram *dst,
+                            const struct histogram *src);
+
+/* Takes the counts of then from now, two snapshots of one histogram, to
+ * leave in now the values recorded in between. The min and max become
+ * the bounds of the buckets that are left.
+ */
+extern void histogram_subtract(struct histogram *now,
+                               const struct histogram *then);
+
+/* Returns the smallest value that percentile percent of the recorded
+ * values are at or below, rounded up to the top of its bucket.
+ */
+extern uint64_t histogram_percentile(const struct histogram *h,
+                                     double percentile);
+
+extern double histogram_mean(const struct histogram *h);
+
+/* Prints "<label> p50 .. p90 .. p99 .. p99.9 .. max .. us", for values
+ * in nanoseconds.
+ */
+extern void histogram_print_summary(const struct histogram *h,
+                                    const char *label, FILE *out);
+
+/* Writes the histogram as a header line followed by a "value count" line
+ * for every bucket that is not empty, value being the bottom of the
+ * bucket. Compact enough to keep the histogram of every run.
+ */
+extern void histogram_dump(const struct histogram *h, FILE *out);
+
+#endif
@@ -0,0 +1,65 @@
+/* This file implements the incremental update of the Internet checksum
+ * from RFC 1624.
+ *
+ * The checksum is the one's complement of the one's complement sum of
+ * the data, so when a word m of the data changes to m' the new checksum
+ * follows from the old one alone:
+ *
+ *   HC' = ~(~HC + ~m + m')
+ *
+ * which costs the same whatever the size of the rest of the data. Unlike
+ * the older HC' = HC - ~m - m' of RFC 1141 this never produces 0x0000
+ * in place of 0xffff.
+ *
+ * One's complement addition does not depend on the byte order, as long
+ * as every word is taken in the same order. The words are therefore
+ * used as they lie in memory.
+ */
+
+#include "inccksum.h"
+
+static uint16_t fold(uint32_t sum)
+{
+        sum = (sum >> 16) + (sum & 0xffff);
+        sum += sum >> 16;
+
+        return sum;
+}
+
+/* Returns the sum of the four 16-bit words of n. */
+static uint32_t add_words64(uint64_t n)
+{
+        return (uint32_t)(uint16_t)(n >> 48) + (uint16_t)(n >> 32) +
+                (uint16_t)(n >> 16) + (uint16_t)n;
+}
+
+uint16_t inccksum_update16(uint16_t cksum, uint16_t old, uint16_t new)
+{
+        uint32_t sum;
+
+        sum = (uint16_t)~cksum + (uint32_t)(uint16_t)~old + new;
+
+        return ~fold(sum);
+}
+
+uint16_t inccksum_update32(uint16_t cksum, uint32_t old, uint32_t new)
+{
+        uint32_t sum;
+
+        sum = (uint16_t)~cksum;
+        sum += (uint16_t)~(old >> 16) + (uint32_t)(uint16_t)~old;
+        sum += (new >> 16) + (new & 0xffff);
+
+        return ~fold(sum);
+}
+
+uint16_t inccksum_update64(uint16_t cksum, uint64_t old, uint64_t new)
+{
+        uint32_t sum;
+
+        sum = (uint16_t)~cksum;
+        sum += add_words64(~old);
+        sum += add_words64(new);
+
+        return ~fold(sum);
+}
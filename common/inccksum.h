@@ -0,0 +1,22 @@
+#ifndef __INCCKSUM_H_
+#define __INCCKSUM_H_
+
+#include <stdint.h>
+
+/* Returns the Internet checksum cksum updated for one 16-bit word of the
+ * checksummed data changing from old to new (RFC 1624, eqn. 3). Words
+ * and checksum are taken as they lie in the packet, in network byte
+ * order.
+ */
+extern uint16_t inccksum_update16(uint16_t cksum, uint16_t old,
+                                  uint16_t new);
+
+/* The same for a 32-bit field, like an IPv4 address. */
+extern uint16_t inccksum_update32(uint16_t cksum, uint32_t old,
+                                  uint32_t new);
+
+/* The same for a 64-bit field, like a timestamp. */
+extern uint16_t inccksum_update64(uint16_t cksum, uint64_t old,
+                                  uint64_t new);
+
+#endif
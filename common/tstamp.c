@@ -0,0 +1,170 @@
+/* This file implements kernel and hardware timestamps of packets with
+ * SO_TIMESTAMPING.
+ *
+ * A round trip time taken with clock_gettime() around send and receive
+ * includes the system calls and, worse, the time from the packet coming
+ * in to the process being scheduled. The kernel can instead stamp a
+ * packet when it hands it to the device and when it comes in from it,
+ * and a NIC that can when it goes on and comes off the wire. The
+ * difference between the two round trip times is the time spent in the
+ * stack and the scheduler.
+ *
+ * A receive timestamp comes with the packet, as an SCM_TIMESTAMPING
+ * control message of three times: software, deprecated, and raw
+ * hardware. A transmit timestamp comes back on the error queue of the
+ * socket, in the same control message next to an extended error that
+ * carries the number of the send (SOF_TIMESTAMPING_OPT_ID). With
+ * SOF_TIMESTAMPING_OPT_TSONLY the error queue does not return the packet
+ * itself, which saves a copy and works without root.
+ */
+
+#include <errno.h>
+#include <time.h> /* Before <linux/errqueue.h>, which needs timespec. */
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "tstamp.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+        return ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
+
+/* Turns on timestamping of all packets in the NIC behind device. */
+static int enable_hardware(int sock, const char *device)
+{
+        struct hwtstamp_config config;
+        struct ifreq ifr;
+
+        memset(&config, 0, sizeof(config));
+        config.tx_type = HWTSTAMP_TX_ON;
+        config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, device, sizeof(ifr.ifr_name) - 1);
+        ifr.ifr_data = (void *)&config;
+        if (ioctl(sock, SIOCSHWTSTAMP, &ifr) != 0)
+        {
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+int tstamp_enable(int sock, const char *device)
+{
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE |
+                SOF_TIMESTAMPING_TX_SOFTWARE |
+                SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID |
+                SOF_TIMESTAMPING_OPT_TSONLY;
+
+        if (device != NULL)
+        {
+                if (enable_hardware(sock, device) == 0)
+                {
+                        flags |= SOF_TIMESTAMPING_RX_HARDWARE |
+                                SOF_TIMESTAMPING_TX_HARDWARE |
+                                SOF_TIMESTAMPING_RAW_HARDWARE;
+                }
+                else
+                {
+                        fprintf(stderr, "No hardware timestamps on %s (%s), "
+                                "software only.\n", device, strerror(errno));
+                }
+        }
+
+        if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                       sizeof(flags)) != 0)
+        {
+                perror("setsockopt SO_TIMESTAMPING");
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+void tstamp_parse(struct msghdr *msg, struct tstamp *ts)
+{
+        struct scm_timestamping stamps;
+        struct cmsghdr *cmsg;
+
+        ts->software = 0;
+        ts->hardware = 0;
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(msg, cmsg))
+        {
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_TIMESTAMPING)
+                {
+                        memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+                        ts->software = timespec_ns(&stamps.ts[0]);
+                        ts->hardware = timespec_ns(&stamps.ts[2]);
+                }
+        }
+}
+
+/* Returns the extended error of a timestamp in msg, or NULL. */
+static const struct sock_extended_err *find_timestamp_error(
+        struct msghdr *msg, struct sock_extended_err *err)
+{
+        struct cmsghdr *cmsg;
+
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(msg, cmsg))
+        {
+                if ((cmsg->cmsg_level == IPPROTO_IP &&
+                     cmsg->cmsg_type == IP_RECVERR) ||
+                    (cmsg->cmsg_level == IPPROTO_IPV6 &&
+                     cmsg->cmsg_type == IPV6_RECVERR))
+                {
+                        memcpy(err, CMSG_DATA(cmsg), sizeof(*err));
+                        if (err->ee_errno == ENOMSG &&
+                            err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                        {
+                                return err;
+                        }
+                }
+        }
+
+        return NULL;
+}
+
+int tstamp_read_tx(int sock, uint32_t *key, struct tstamp *ts)
+{
+        char control[TSTAMP_CONTROL_SIZE];
+        struct sock_extended_err err;
+        struct msghdr msg;
+
+        /* Other errors of the queue, like an ICMP unreachable, are
+         * passed over.
+         */
+        for (;;)
+        {
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                {
+                        return 0;
+                }
+                if (find_timestamp_error(&msg, &err) != NULL)
+                {
+                        break;
+                }
+        }
+
+        *key = err.ee_data;
+        tstamp_parse(&msg, ts);
+
+        return 1;
+}
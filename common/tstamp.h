@@ -0,0 +1,44 @@
+#ifndef __TSTAMP_H_
+#define __TSTAMP_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Room for the control messages of a timestamped receive, or of a
+ * transmit timestamp from the error queue.
+ */
+#define TSTAMP_CONTROL_SIZE 512
+
+/* The kernel timestamps of a packet, in nanoseconds, 0 when there is
+ * none. The software ones are in CLOCK_REALTIME, the hardware ones in
+ * the clock of the NIC, so only differences of the same kind mean
+ * anything.
+ */
+struct tstamp
+{
+        uint64_t software;
+        uint64_t hardware;
+};
+
+/* Has the kernel timestamp the packets sock receives, when they come in,
+ * and the ones it sends, when they leave for the device (SO_TIMESTAMPING).
+ * With device not NULL the NIC is asked to timestamp all packets as
+ * well, which needs root and a NIC that can; if it cannot, the software
+ * timestamps are used alone. Returns 0 on success.
+ */
+extern int tstamp_enable(int sock, const char *device);
+
+/* Fills in ts from the control messages of msg, received on a socket
+ * with timestamps enabled, with msg_control TSTAMP_CONTROL_SIZE bytes.
+ */
+extern void tstamp_parse(struct msghdr *msg, struct tstamp *ts);
+
+/* Takes a transmit timestamp from the error queue of sock, without
+ * blocking. Returns 1 with it in ts and the number of the send it
+ * belongs to in key, counted from 0 for the first send after
+ * tstamp_enable(), and 0 when there is none waiting. The software and
+ * the hardware timestamp of a send come one at a time.
+ */
+extern int tstamp_read_tx(int sock, uint32_t *key, struct tstamp *ts);
+
+#endif
@@ -0,0 +1,501 @@
+/* This is the flood mode of the ping client, to load a responder with as
+ * many echo requests a second as it takes.
+ *
+ * Building every request from scratch costs a pass of the checksum over
+ * all of it. Here a ring of templates, one for every request of a batch,
+ * is built once, checksum included. Only the sequence number and the
+ * timestamp at the start of the data change from one request to the
+ * next, and the ICMP checksum follows them by incremental updates from
+ * the values they replace (RFC 1624), whatever the size of the data. A
+ * batch goes out with one sendmmsg() and one read of the clock, which
+ * all of its requests share as their send time.
+ *
+ * The sending is paced by a token bucket in integer nanoseconds: the
+ * credit grows by rate for every nanosecond and a request costs one
+ * second of it, so there is no rounding at any rate. The bucket holds a
+ * batch at most, so a sender that fell behind catches up in full
+ * batches, and one that is ahead waits for the next token. The wait
+ * sleeps in ppoll() on the socket until SPIN_NS before the token is due
+ * and spins the rest, receiving replies all along, since a sleep wakes
+ * up tens of microseconds late. How late every wait ended is recorded
+ * in a histogram.
+ *
+ * There is no ring of requests in flight to match the replies against.
+ * A bitmap over the last WINDOW_BITS sequence numbers tells duplicates
+ * apart, and the requests not answered when the timeout has passed
+ * after the last one are lost.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cksum.h"
+#include "histogram.h"
+#include "inccksum.h"
+#include "pingclient.h"
+
+#define ICMP_TYPE_REPLY 0
+#define NS_PER_SEC 1000000000ULL
+#define SPIN_NS 50000ULL
+#define WINDOW_BITS (1 << 20)
+#define RECV_BUF_SIZE (8 << 20)
+/* Room for IP options in the replies. */
+#define MAX_IP_OPTIONS_LEN 40
+
+struct flood
+{
+        const struct pingclient_config *config;
+        struct pingclient_stats *stats;
+        int sock;
+        unsigned short id;
+        unsigned int batch;
+        uint64_t timeout_ns;
+
+        /* One template per request of a batch. */
+        unsigned char *templates;
+        unsigned int send_len;
+        unsigned int send_offset; /* Past the IP header, if not ours. */
+        struct iovec *send_iovs;
+        struct mmsghdr *send_msgs;
+
+        unsigned char *recv_bufs;
+        unsigned int recv_len;
+        struct iovec *recv_iovs;
+        struct mmsghdr *recv_msgs;
+
+        /* Answered requests of the window, by sequence number. */
+        uint64_t *answered;
+        uint64_t next_seq;
+        uint64_t highest_seq;
+
+        /* Token bucket, in tokens times nanoseconds. */
+        uint64_t rate;
+        uint64_t credit;
+        uint64_t max_credit;
+        uint64_t refill_ns;
+};
+
+/* Builds every template with its checksum, and points the messages of
+ * both directions at their buffers once for all.
+ */
+static void init_messages(struct flood *flood)
+{
+        unsigned char *template;
+        struct icmp *icmp_hdr;
+        unsigned int i;
+
+        for (i = 0; i < flood->batch; i++)
+        {
+                template = flood->templates + i * flood->send_len;
+                pingclient_build_request(template, flood->id,
+                                         flood->config->size);
+                icmp_hdr = (struct icmp *)(template + sizeof(struct ip));
+                icmp_hdr->icmp_cksum = cksum(icmp_hdr, flood->send_len -
+                                             sizeof(struct ip));
+
+                /* A datagram socket takes the ICMP message alone. */
+                flood->send_iovs[i].iov_base = template + flood->send_offset;
+                flood->send_iovs[i].iov_len = flood->send_len -
+                        flood->send_offset;
+                flood->send_msgs[i].msg_hdr.msg_iov = &flood->send_iovs[i];
+                flood->send_msgs[i].msg_hdr.msg_iovlen = 1;
+
+                flood->recv_iovs[i].iov_base = flood->recv_bufs +
+                        i * flood->recv_len;
+                flood->recv_iovs[i].iov_len = flood->recv_len;
+                flood->recv_msgs[i].msg_hdr.msg_iov = &flood->recv_iovs[i];
+                flood->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+}
+
+static int init_flood(struct flood *flood,
+                      const struct pingclient_config *config,
+                      struct pingclient_stats *stats)
+{
+        struct in_addr localhost;
+        int size = RECV_BUF_SIZE;
+
+        memset(flood, 0, sizeof(*flood));
+        flood->config = config;
+        flood->stats = stats;
+        flood->batch = config->batch;
+        flood->timeout_ns = config->timeout * NS_PER_SEC;
+        flood->next_seq = 1;
+        flood->rate = config->rate;
+        flood->max_credit = config->batch * NS_PER_SEC;
+
+        if (config->size < PINGCLIENT_MIN_SIZE ||
+            config->size > PINGCLIENT_MAX_SIZE)
+        {
+                fprintf(stderr, "The data size must be %d-%d bytes.\n",
+                        PINGCLIENT_MIN_SIZE, PINGCLIENT_MAX_SIZE);
+                return __LINE__;
+        }
+        if (config->batch < 1 || config->batch > PINGCLIENT_MAX_BATCH)
+        {
+                fprintf(stderr, "The batch must be 1-%d requests.\n",
+                        PINGCLIENT_MAX_BATCH);
+                return __LINE__;
+        }
+        if (config->rate > PINGCLIENT_MAX_RATE)
+        {
+                fprintf(stderr, "The rate must be at most %lu a second.\n",
+                        PINGCLIENT_MAX_RATE);
+                return __LINE__;
+        }
+
+        flood->send_len = sizeof(struct ip) + ICMP_MINLEN + config->size;
+        flood->send_offset = config->dgram ? sizeof(struct ip) : 0;
+        flood->recv_len = flood->send_len + MAX_IP_OPTIONS_LEN;
+        flood->templates = calloc(flood->batch, flood->send_len);
+        flood->send_iovs = calloc(flood->batch, sizeof(struct iovec));
+        flood->send_msgs = calloc(flood->batch, sizeof(struct mmsghdr));
+        flood->recv_bufs = calloc(flood->batch, flood->recv_len);
+        flood->recv_iovs = calloc(flood->batch, sizeof(struct iovec));
+        flood->recv_msgs = calloc(flood->batch, sizeof(struct mmsghdr));
+        flood->answered = calloc(WINDOW_BITS / 64, sizeof(uint64_t));
+        if (flood->templates == NULL || flood->send_iovs == NULL ||
+            flood->send_msgs == NULL || flood->recv_bufs == NULL ||
+            flood->recv_iovs == NULL || flood->recv_msgs == NULL ||
+            flood->answered == NULL)
+        {
+                fprintf(stderr, "Failed to allocate the flood.\n");
+                return __LINE__;
+        }
+
+        localhost.s_addr = htonl(INADDR_LOOPBACK);
+        flood->sock = pingclient_open_socket(&localhost, config->dgram,
+                                             &flood->id);
+        if (flood->sock < 0 || (!config->dgram &&
+                                pingclient_filter_replies(flood->sock) != 0))
+        {
+                return __LINE__;
+        }
+        init_messages(flood);
+
+        /* The replies come in as fast as the requests go out, but are
+         * only received between batches. Past rmem_max if allowed.
+         */
+        if (setsockopt(flood->sock, SOL_SOCKET, SO_RCVBUFFORCE, &size,
+                       sizeof(size)) != 0)
+        {
+                setsockopt(flood->sock, SOL_SOCKET, SO_RCVBUF, &size,
+                           sizeof(size));
+        }
+
+        return 0;
+}
+
+static void set_answered(struct flood *flood, uint64_t seq, int answered)
+{
+        uint64_t bit = seq % WINDOW_BITS;
+
+        if (answered)
+        {
+                flood->answered[bit / 64] |= 1ULL << (bit % 64);
+        }
+        else
+        {
+                flood->answered[bit / 64] &= ~(1ULL << (bit % 64));
+        }
+}
+
+static int is_answered(const struct flood *flood, uint64_t seq)
+{
+        uint64_t bit = seq % WINDOW_BITS;
+
+        return (flood->answered[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void handle_reply(struct flood *flood, const unsigned char *buf,
+                         unsigned int len, uint64_t now)
+{
+        struct pingclient_stats *stats = flood->stats;
+        const struct ip *ip_hdr = (const struct ip *)buf;
+        const struct icmp *icmp_hdr;
+        struct pingclient_payload hdr;
+        unsigned int ip_hdr_len = 0;
+        uint64_t rtt;
+
+        /* A datagram socket gives the ICMP message alone. */
+        if (!flood->config->dgram)
+        {
+                if (len < sizeof(struct ip))
+                {
+                        return;
+                }
+                ip_hdr_len = ip_hdr->ip_hl * 4;
+        }
+        if (len < ip_hdr_len + ICMP_MINLEN + sizeof(hdr))
+        {
+                return;
+        }
+
+        icmp_hdr = (const struct icmp *)(buf + ip_hdr_len);
+        if (icmp_hdr->icmp_type != ICMP_TYPE_REPLY ||
+            ntohs(icmp_hdr->icmp_id) != flood->id)
+        {
+                return;
+        }
+
+        memcpy(&hdr, icmp_hdr->icmp_data, sizeof(hdr));
+        if (len != ip_hdr_len + flood->send_len - sizeof(struct ip) ||
+            cksum(icmp_hdr, len - ip_hdr_len) != 0 ||
+            hdr.seq == 0 || hdr.seq >= flood->next_seq ||
+            (hdr.seq & 0xffff) != ntohs(icmp_hdr->icmp_seq) ||
+            hdr.send_ns > now)
+        {
+                stats->corrupt++;
+                return;
+        }
+        if (flood->next_seq - hdr.seq > WINDOW_BITS)
+        {
+                /* Its bit has been taken by a later request. */
+                stats->late++;
+                return;
+        }
+        if (is_answered(flood, hdr.seq))
+        {
+                stats->duplicates++;
+                return;
+        }
+        set_answered(flood, hdr.seq, 1);
+        stats->received++;
+
+        rtt = now - hdr.send_ns;
+        histogram_record(&stats->rtt, rtt);
+        stats->rtt_sum_squares += (double)rtt * rtt;
+        if (hdr.seq < flood->highest_seq)
+        {
+                stats->reordered++;
+                return;
+        }
+        flood->highest_seq = hdr.seq;
+}
+
+/* Receives every reply that is waiting, a batch at a time. */
+static void receive_replies(struct flood *flood)
+{
+        unsigned int i;
+        uint64_t now;
+        int n;
+
+        while ((n = recvmmsg(flood->sock, flood->recv_msgs, flood->batch,
+                             MSG_DONTWAIT, NULL)) > 0)
+        {
+                now = pingclient_now_ns();
+                for (i = 0; i < (unsigned int)n; i++)
+                {
+                        handle_reply(flood, flood->recv_iovs[i].iov_base,
+                                     flood->recv_msgs[i].msg_len, now);
+                }
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+                perror("recvmmsg");
+                exit(__LINE__);
+        }
+}
+
+static void refill(struct flood *flood, uint64_t now)
+{
+        uint64_t elapsed = now - flood->refill_ns;
+
+        /* More than a second fills any bucket, and would overflow. */
+        if (elapsed > NS_PER_SEC)
+        {
+                elapsed = NS_PER_SEC;
+        }
+        flood->credit += elapsed * flood->rate;
+        if (flood->credit > flood->max_credit)
+        {
+                flood->credit = flood->max_credit;
+        }
+        flood->refill_ns = now;
+}
+
+/* Waits for a token, receiving the replies meanwhile, and records how
+ * late the wait ended. Returns the time it ended.
+ */
+static uint64_t wait_for_token(struct flood *flood, uint64_t now)
+{
+        uint64_t wait_ns;
+        int waited = 0;
+
+        refill(flood, now);
+        while (flood->credit < NS_PER_SEC && !pingclient_stop)
+        {
+                wait_ns = (NS_PER_SEC - flood->credit + flood->rate - 1) /
+                        flood->rate;
+                if (wait_ns > SPIN_NS)
+                {
+                        pingclient_wait(flood->sock, wait_ns - SPIN_NS);
+                }
+                receive_replies(flood);
+                now = pingclient_now_ns();
+                refill(flood, now);
+                waited = 1;
+        }
+
+        /* The credit past the token is the time since it was due. */
+        if (waited && flood->credit >= NS_PER_SEC)
+        {
+                histogram_record(&flood->stats->pacing,
+                                 (flood->credit - NS_PER_SEC) / flood->rate);
+        }
+
+        return now;
+}
+
+/* Moves the template on to the next sequence number, the checksum
+ * updated for the fields that changed only.
+ */
+static void patch_request(struct flood *flood, unsigned char *template,
+                          uint64_t now)
+{
+        struct icmp *icmp_hdr = (struct icmp *)(template + sizeof(struct ip));
+        struct pingclient_payload old;
+        struct pingclient_payload new;
+        uint16_t cksum = icmp_hdr->icmp_cksum;
+        uint16_t seq = htons(flood->next_seq & 0xffff);
+
+        memcpy(&old, icmp_hdr->icmp_data, sizeof(old));
+        new.seq = flood->next_seq;
+        new.send_ns = now;
+        memcpy(icmp_hdr->icmp_data, &new, sizeof(new));
+
+        cksum = inccksum_update16(cksum, icmp_hdr->icmp_seq, seq);
+        cksum = inccksum_update64(cksum, old.seq, new.seq);
+        cksum = inccksum_update64(cksum, old.send_ns, new.send_ns);
+        icmp_hdr->icmp_seq = seq;
+        icmp_hdr->icmp_cksum = cksum;
+}
+
+/* Sends up to n requests in one system call, and returns how many went
+ * out.
+ */
+static unsigned int send_batch(struct flood *flood, unsigned int n,
+                               uint64_t now)
+{
+        uint64_t first_seq = flood->next_seq;
+        unsigned int i;
+        int sent;
+
+        for (i = 0; i < n; i++)
+        {
+                patch_request(flood, flood->templates + i * flood->send_len,
+                              now);
+                flood->next_seq++;
+        }
+
+        /* The requests not sent get their numbers again with the next
+         * batch.
+         */
+        sent = sendmmsg(flood->sock, flood->send_msgs, n, 0);
+        if (sent < 0)
+        {
+                if (errno != EINTR && errno != ENOBUFS)
+                {
+                        perror("sendmmsg");
+                        exit(__LINE__);
+                }
+                sent = 0;
+        }
+        flood->next_seq = first_seq + sent;
+
+        for (i = 0; i < (unsigned int)sent; i++)
+        {
+                set_answered(flood, first_seq + i, 0);
+        }
+        flood->stats->sent += sent;
+
+        return sent;
+}
+
+/* Receives the replies to the last requests, until they are all in or
+ * the timeout has passed.
+ */
+static void drain(struct flood *flood, uint64_t last_send_ns)
+{
+        uint64_t deadline = last_send_ns + flood->timeout_ns;
+        uint64_t now = pingclient_now_ns();
+
+        while (flood->stats->received < flood->stats->sent &&
+               now < deadline && !pingclient_stop)
+        {
+                pingclient_wait(flood->sock, deadline - now);
+                receive_replies(flood);
+                now = pingclient_now_ns();
+        }
+}
+
+int pingclient_flood(const struct pingclient_config *config,
+                     struct pingclient_stats *stats)
+{
+        static struct flood flood;
+        uint64_t first_send_ns;
+        uint64_t now;
+        unsigned int n;
+
+        if (init_flood(&flood, config, stats) != 0)
+        {
+                return __LINE__;
+        }
+        pingclient_install_stop_handler();
+
+        now = pingclient_now_ns();
+        first_send_ns = now;
+        flood.refill_ns = now;
+        flood.credit = NS_PER_SEC;
+        while (!pingclient_stop &&
+               (config->count == 0 || stats->sent < config->count))
+        {
+                n = flood.batch;
+                if (flood.rate > 0)
+                {
+                        now = wait_for_token(&flood, now);
+                        if (pingclient_stop)
+                        {
+                                break;
+                        }
+                        n = flood.credit / NS_PER_SEC;
+                }
+                if (config->count > 0 && config->count - stats->sent < n)
+                {
+                        n = config->count - stats->sent;
+                }
+
+                n = send_batch(&flood, n, now);
+                flood.credit -= (flood.rate > 0) ? n * NS_PER_SEC : 0;
+                stats->elapsed_ns = now - first_send_ns;
+
+                receive_replies(&flood);
+                now = pingclient_now_ns();
+        }
+        drain(&flood, first_send_ns + stats->elapsed_ns);
+
+        stats->lost = (stats->sent > stats->received) ?
+                stats->sent - stats->received : 0;
+
+        close(flood.sock);
+        free(flood.templates);
+        free(flood.send_iovs);
+        free(flood.send_msgs);
+        free(flood.recv_bufs);
+        free(flood.recv_iovs);
+        free(flood.recv_msgs);
+        free(flood.answered);
+
+        return 0;
+}
@@ -1,11 +1,256 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "histogram.h"
 #include "pingclient.h"
 
+/* Too large for the stack. */
+static struct pingclient_stats stats;
+
+static void print_syntax(void)
+{
+        printf("SYNTAX:  pingclient [-c count] [-i interval] [-s size] "
+               "[-W timeout] [-q] [-u]\n"
+               "                    [-T] [-H device]\n"
+               "                    [-P precision] [-o file] "
+               "[-f [-r rate] [-b batch]]\n"
+               "                    [-r rate] [-n in-flight] [-l file] "
+               "[target...]\n\n");
+        printf("  -c  Echo requests to send, to every target (default until "
+               "Ctrl-C).\n");
+        printf("  -i  Seconds between requests, to one target (default "
+               "%.0f).\n",
+               PINGCLIENT_DEFAULT_INTERVAL);
+        printf("  -s  Bytes of data per request (%d-%d, default %d).\n",
+               PINGCLIENT_MIN_SIZE, PINGCLIENT_MAX_SIZE,
+               PINGCLIENT_DEFAULT_SIZE);
+        printf("  -W  Seconds before a request is lost (default %.0f).\n",
+               PINGCLIENT_DEFAULT_TIMEOUT);
+        printf("  -q  Only print the summary.\n");
+        printf("  -u  Use an ICMP datagram socket, which needs no root but "
+               "our group\n      in net.ipv4.ping_group_range.\n");
+        printf("  -T  Kernel timestamps of requests and replies, for the "
+               "RTT without\n      the system calls and wakeups.\n");
+        printf("  -H  Hardware timestamps of the NIC behind device as well, "
+               "implies -T.\n");
+        printf("  -P  Bits of RTT histogram precision (%d-%d, default %d).\n",
+               HISTOGRAM_MIN_PRECISION, HISTOGRAM_MAX_PRECISION,
+               HISTOGRAM_DEFAULT_PRECISION);
+        printf("  -o  Dump the RTT histogram to file.\n");
+        printf("  -f  Flood, only the summary is printed.\n");
+        printf("  -r  Flood or target requests per second (default as fast "
+               "as possible).\n");
+        printf("  -b  Flood requests per send (1-%d, default %d).\n",
+               PINGCLIENT_MAX_BATCH, PINGCLIENT_DEFAULT_BATCH);
+        printf("  -n  Target requests in flight at most (1-%d, default %d).\n",
+               PINGCLIENT_MAX_IN_FLIGHT, PINGCLIENT_DEFAULT_IN_FLIGHT);
+        printf("  -l  Read targets from file, one a line.\n");
+        printf("  target  IPv4 address or CIDR range to ping in turn, "
+               "instead of\n          localhost.\n");
+}
+
+static int dump_histogram(const char *path)
+{
+        FILE *out;
+
+        out = fopen(path, "w");
+        if (out == NULL)
+        {
+                perror(path);
+                return 1;
+        }
+        histogram_dump(&stats.rtt, out);
+        fclose(out);
+
+        return 0;
+}
+
+static void print_flood_summary(const struct pingclient_config *config)
+{
+        double seconds = stats.elapsed_ns / 1e9;
+
+        printf("Flooded %llu requests in %.3f s, %.0f/s", stats.sent,
+               seconds, seconds > 0 ? stats.sent / seconds : 0.0);
+        if (config->rate > 0)
+        {
+                printf(" of %lu/s.\n", config->rate);
+                histogram_print_summary(&stats.pacing, "Pacing late",
+                                        stdout);
+        }
+        else
+        {
+                printf(".\n");
+        }
+}
+
+static void print_summary(void)
+{
+        double mean;
+        double variance;
+
+        printf("\n%llu requests, %llu replies, %.1f%% lost.\n", stats.sent,
+               stats.received,
+               stats.sent ? 100.0 * stats.lost / stats.sent : 0.0);
+        if (stats.targets > 0)
+        {
+                printf("%lu of %lu targets replied.\n", stats.alive,
+                       stats.targets);
+        }
+        if (stats.duplicates + stats.reordered + stats.late +
+            stats.corrupt > 0)
+        {
+                printf("%llu duplicates, %llu out of order, %llu late, "
+                       "%llu corrupt.\n", stats.duplicates, stats.reordered,
+                       stats.late, stats.corrupt);
+        }
+        if (stats.received == 0)
+        {
+                return;
+        }
+
+        mean = histogram_mean(&stats.rtt);
+        variance = stats.rtt_sum_squares / stats.received - mean * mean;
+        printf("RTT min/avg/max/mdev %.1f/%.1f/%.1f/%.1f us.\n",
+               stats.rtt.min / 1000.0, mean / 1000.0, stats.rtt.max / 1000.0,
+               (variance > 0 ? sqrt(variance) : 0) / 1000.0);
+        histogram_print_summary(&stats.rtt, "RTT", stdout);
+        if (stats.kernel_rtt.total > 0)
+        {
+                histogram_print_summary(&stats.kernel_rtt, "Kernel RTT",
+                                        stdout);
+        }
+        if (stats.hardware_rtt.total > 0)
+        {
+                histogram_print_summary(&stats.hardware_rtt, "Hardware RTT",
+                                        stdout);
+        }
+}
+
 int main(int argc, char **argv)
 {
-        (void)argc;
-        (void)argv;
-        
-        pingclient();
-        
+        struct pingclient_config config;
+        unsigned int precision = HISTOGRAM_DEFAULT_PRECISION;
+        const char *dump_path = NULL;
+        int flood = 0;
+        int targets;
+        int opt;
+
+        config.count = 0;
+        config.interval = PINGCLIENT_DEFAULT_INTERVAL;
+        config.size = PINGCLIENT_DEFAULT_SIZE;
+        config.timeout = PINGCLIENT_DEFAULT_TIMEOUT;
+        config.quiet = 0;
+        config.rate = 0;
+        config.batch = PINGCLIENT_DEFAULT_BATCH;
+        config.target_file = NULL;
+        config.in_flight = PINGCLIENT_DEFAULT_IN_FLIGHT;
+        config.dgram = 0;
+        config.timestamps = 0;
+        config.hw_device = NULL;
+
+        while ((opt = getopt(argc, argv, "c:i:s:W:quTH:P:o:fr:b:n:l:")) != -1)
+        {
+                switch (opt)
+                {
+                case 'c':
+                        config.count = strtoul(optarg, NULL, 0);
+                        break;
+                case 'i':
+                        config.interval = atof(optarg);
+                        break;
+                case 's':
+                        config.size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'W':
+                        config.timeout = atof(optarg);
+                        break;
+                case 'q':
+                        config.quiet = 1;
+                        break;
+                case 'u':
+                        config.dgram = 1;
+                        break;
+                case 'T':
+                        config.timestamps = 1;
+                        break;
+                case 'H':
+                        config.timestamps = 1;
+                        config.hw_device = optarg;
+                        break;
+                case 'P':
+                        precision = strtoul(optarg, NULL, 0);
+                        break;
+                case 'o':
+                        dump_path = optarg;
+                        break;
+                case 'f':
+                        flood = 1;
+                        break;
+                case 'r':
+                        config.rate = strtoul(optarg, NULL, 0);
+                        break;
+                case 'b':
+                        config.batch = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        config.in_flight = strtoul(optarg, NULL, 0);
+                        break;
+                case 'l':
+                        config.target_file = optarg;
+                        break;
+                default:
+                        print_syntax();
+                        return 1;
+                }
+        }
+
+        config.targets = argv + optind;
+        config.num_targets = argc - optind;
+        targets = config.num_targets > 0 || config.target_file != NULL;
+
+        /* Timestamps are taken for the requests to localhost only. */
+        if ((flood && targets) ||
+            (config.timestamps && (flood || targets)) ||
+            config.interval < 0 || config.timeout <= 0 ||
+            histogram_init(&stats.rtt, precision) != 0 ||
+            histogram_init(&stats.pacing, precision) != 0 ||
+            histogram_init(&stats.kernel_rtt, precision) != 0 ||
+            histogram_init(&stats.hardware_rtt, precision) != 0)
+        {
+                print_syntax();
+                return 1;
+        }
+
+        if (flood)
+        {
+                if (pingclient_flood(&config, &stats) != 0)
+                {
+                        return __LINE__;
+                }
+        }
+        else if (targets)
+        {
+                if (pingclient_targets(&config, &stats) != 0)
+                {
+                        return __LINE__;
+                }
+        }
+        else if (pingclient(&config, &stats) != 0)
+        {
+                return __LINE__;
+        }
+        print_summary();
+        if (flood)
+        {
+                print_flood_summary(&config);
+        }
+
+        if (dump_path != NULL)
+        {
+                return dump_histogram(dump_path);
+        }
+
         return 0;
 }
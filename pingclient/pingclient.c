@@ -1,130 +1,780 @@
 /* This is one half of an ICMP ping for localhost only.
- * Only q request is sent, the reply is not checked.
+ *
+ * Requests are sent at a steady interval, whether the replies come back
+ * or not, and the replies are received on the same socket as they come.
+ * Every request carries its sequence number and the time it was sent in
+ * its data, so the round trip time is computed from the reply alone.
+ *
+ * The requests in flight are kept in a ring of slots indexed by the
+ * ICMP sequence number, as in the load generator of udp_ping_pong. A
+ * reply finds its request without any search, and the oldest requests
+ * time out as lost in order. A slot remembers it was answered, so that
+ * a second reply to it is told apart as a duplicate, and a reply to a
+ * request older than the highest one answered as out of order.
+ *
+ * Every reply is checked against its request: the checksum, the length
+ * and the data. The round trip times go into a log-linear histogram,
+ * with their sum of squares for the deviation.
+ *
+ * With timestamps the kernel stamps every request as it leaves for the
+ * device and every reply as it comes in, and a second round trip time is
+ * taken between the two. The one from clock_gettime() is longer by the
+ * system calls and the wakeup of the process, so the difference is what
+ * the stack costs rather than the wire. The transmit timestamps come
+ * back on the error queue numbered from 0 in the order of the sends,
+ * that is request seq - 1, and may come before or after the reply; the
+ * slot keeps whichever comes first.
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <net/ethernet.h>
 #include <netinet/ether.h>
 #include <netinet/in.h>
 #include <netinet/in_systm.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cksum.h"
+#include "histogram.h"
 #include "pingclient.h"
 
 #define ICMP_TYPE_REPLY 0
 #define ICMP_TYPE_REQUEST 8
-#define MAX_MTU 1500
+#define MAX_PACKET_LEN 65535
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+#define MIN_FLIGHT_SLOTS 4096
+#define MAX_FLIGHT_SLOTS (1 << 16) /* The ICMP sequence number is 16 bits. */
+/* From <linux/icmp.h>, which clashes with <netinet/ip_icmp.h>. */
+#define ICMP_FILTER 1
 
-/* From Stevens, UNP2ev1 */
-unsigned short
-in_cksum(unsigned short *addr, int len)
+struct flight_slot
 {
-    int nleft = len;
-    int sum = 0;
-    unsigned short *w = addr;
-    unsigned short answer = 0;
+        uint64_t seq;
+        uint64_t send_ns;
+        int in_flight;
+        int answered;
+        struct tstamp tx;
+        struct tstamp rx;
+};
 
-    while (nleft > 1) {
-        sum += *w++;
-        nleft -= 2;
-    }
+struct pinger
+{
+        const struct pingclient_config *config;
+        struct pingclient_stats *stats;
+        int sock;
+        unsigned short id;
+        uint64_t interval_ns;
+        uint64_t timeout_ns;
+        unsigned char *send_buf;
+        unsigned int send_len;
+        unsigned char *recv_buf;
+
+        /* Requests in flight, indexed by sequence number. */
+        struct flight_slot *slots;
+        uint64_t slot_mask;
+        uint64_t next_seq;
+        uint64_t oldest_seq;
+        uint64_t highest_seq;
+        unsigned int in_flight;
+};
 
-    if (nleft == 1) {
-        *(unsigned char *)(&answer) = *(unsigned char *)w;
-        sum += answer;
-    }
+/* Opens a raw socket, on which the IP header is ours to write. */
+static int open_raw_socket(unsigned short *id)
+{
+        int error;
+        int one = 1;
+        int sock;
 
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    answer = ~sum;
-    return (answer);
+        sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+        if (sock < 0)
+        {
+                error = errno;
+                perror("socket");
+                if (error == EPERM)
+                {
+                        fprintf(stderr, "Raw sockets need root, try -u.\n");
+                }
+                return -1;
+        }
+        if (setsockopt(sock, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) != 0)
+        {
+                perror("setsockopt IP_HDRINCL");
+                close(sock);
+                return -1;
+        }
+        *id = getpid() & 0xffff;
+
+        return sock;
 }
 
-void pingclient(void)
+/* Opens an ICMP datagram socket and binds it, for the kernel to pick the
+ * identifier it demultiplexes the replies by.
+ */
+static int open_dgram_socket(unsigned short *id)
 {
+        struct sockaddr_in local;
+        socklen_t local_len = sizeof(local);
+        int error;
         int one = 1;
-        int sock_icmp;
-        int status;
-        struct ip *ip_hdr_out;
-        char buf_out[MAX_MTU];
-        struct icmp *icmp_hdr_out;
-        int ip_len;
-        int icmp_len;
-        struct sockaddr_in localhost;
-
-        sock_icmp = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-        if (sock_icmp < 0)
+        int sock;
+
+        sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+        if (sock < 0)
         {
+                error = errno;
                 perror("socket");
-                exit(__LINE__);
+                if (error == EACCES)
+                {
+                        fprintf(stderr, "Our group is not in "
+                                "net.ipv4.ping_group_range.\n");
+                }
+                return -1;
         }
-        
-        status = setsockopt(sock_icmp, IPPROTO_IP, IP_HDRINCL,
-                            (char *)&one, sizeof(one));
-        if (status < 0)
+
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        if (bind(sock, (const struct sockaddr *)&local, sizeof(local)) != 0 ||
+            getsockname(sock, (struct sockaddr *)&local, &local_len) != 0)
         {
-                perror("setsockopt");
-                exit(__LINE__);
+                perror("bind");
+                close(sock);
+                return -1;
         }
+        *id = ntohs(local.sin_port);
+
+        /* Without an IP header the TTL comes as a control message. */
+        if (setsockopt(sock, IPPROTO_IP, IP_RECVTTL, &one, sizeof(one)) != 0)
+        {
+                perror("setsockopt IP_RECVTTL");
+                close(sock);
+                return -1;
+        }
+
+        return sock;
+}
 
-        ip_hdr_out = (struct ip *)buf_out;
-        icmp_hdr_out = (struct icmp *)(buf_out + sizeof(struct ip));
+volatile sig_atomic_t pingclient_stop;
 
-        localhost.sin_family = AF_INET;
-        status = inet_pton(AF_INET, "127.0.0.1", &localhost.sin_addr);
-        if (status != 1)
+static void handle_stop_signal(int signum)
+{
+        (void)signum;
+        pingclient_stop = 1;
+}
+
+void pingclient_install_stop_handler(void)
+{
+        struct sigaction action;
+
+        /* Without SA_RESTART, so that the wait ends at once. */
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = handle_stop_signal;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+}
+
+uint64_t pingclient_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+uint64_t pingclient_round_up_pow2(uint64_t n)
+{
+        uint64_t pow2 = 1;
+
+        while (pow2 < n)
         {
-                perror("inet_pton");
+                pow2 <<= 1;
+        }
+
+        return pow2;
+}
+
+void pingclient_wait(int sock, uint64_t wait_ns)
+{
+        struct pollfd pfd;
+        struct timespec timeout;
+
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        timeout.tv_sec = wait_ns / NS_PER_SEC;
+        timeout.tv_nsec = wait_ns % NS_PER_SEC;
+        ppoll(&pfd, 1, &timeout, NULL);
+}
+
+void pingclient_receive_replies(int sock, int dgram, unsigned char *buf,
+                                unsigned int size, pingclient_reply_fn handle,
+                                void *arg)
+{
+        struct pingclient_reply reply;
+        ssize_t len;
+
+        while ((len = pingclient_receive(sock, dgram, buf, size, &reply)) > 0)
+        {
+                if (reply.icmp != NULL)
+                {
+                        handle(arg, &reply, pingclient_now_ns());
+                }
+        }
+        if (len < 0 && errno != EAGAIN && errno != EINTR)
+        {
+                perror("recv");
                 exit(__LINE__);
         }
+}
+
+int pingclient_open_socket(const struct in_addr *peer, int dgram,
+                           unsigned short *id)
+{
+        struct sockaddr_in peer_addr;
+        int sock;
+
+        sock = dgram ? open_dgram_socket(id) : open_raw_socket(id);
+        if (sock < 0 || peer == NULL)
+        {
+                return sock;
+        }
 
-        status = connect(sock_icmp, (const struct sockaddr*)&localhost,
-                         sizeof(localhost));
-        if (status != 0)
+        memset(&peer_addr, 0, sizeof(peer_addr));
+        peer_addr.sin_family = AF_INET;
+        peer_addr.sin_addr = *peer;
+        if (connect(sock, (const struct sockaddr *)&peer_addr,
+                    sizeof(peer_addr)) != 0)
         {
                 perror("connect");
-                exit(__LINE__);
+                close(sock);
+                return -1;
+        }
+
+        return sock;
+}
+
+ssize_t pingclient_receive(int sock, int dgram, unsigned char *buf,
+                           unsigned int size, struct pingclient_reply *reply)
+{
+        union
+        {
+                struct cmsghdr align;
+                char buf[TSTAMP_CONTROL_SIZE];
+        } control;
+        const struct ip *ip_hdr = (const struct ip *)buf;
+        struct sockaddr_in from;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        unsigned int ip_hdr_len = 0;
+        ssize_t len;
+
+        iov.iov_base = buf;
+        iov.iov_len = size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+
+        reply->icmp = NULL;
+        len = recvmsg(sock, &msg, MSG_DONTWAIT);
+        if (len <= 0)
+        {
+                return len;
+        }
+        reply->src = from.sin_addr;
+        reply->ttl = -1;
+        tstamp_parse(&msg, &reply->tstamp);
+
+        if (dgram)
+        {
+                for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                     cmsg = CMSG_NXTHDR(&msg, cmsg))
+                {
+                        if (cmsg->cmsg_level == IPPROTO_IP &&
+                            cmsg->cmsg_type == IP_TTL)
+                        {
+                                memcpy(&reply->ttl, CMSG_DATA(cmsg),
+                                       sizeof(reply->ttl));
+                        }
+                }
+        }
+        else
+        {
+                if (len < (ssize_t)sizeof(struct ip))
+                {
+                        return len;
+                }
+                ip_hdr_len = ip_hdr->ip_hl * 4;
+                reply->ttl = ip_hdr->ip_ttl;
+        }
+
+        if (len < ip_hdr_len + ICMP_MINLEN)
+        {
+                return len;
+        }
+        reply->icmp = (const struct icmp *)(buf + ip_hdr_len);
+        reply->len = len - ip_hdr_len;
+
+        return len;
+}
+
+int pingclient_filter_replies(int sock)
+{
+        uint32_t filter = ~(1U << ICMP_TYPE_REPLY);
+
+        if (setsockopt(sock, SOL_RAW, ICMP_FILTER, &filter,
+                       sizeof(filter)) != 0)
+        {
+                perror("setsockopt ICMP_FILTER");
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+unsigned int pingclient_build_request(unsigned char *buf, unsigned short id,
+                                      unsigned int size)
+{
+        struct ip *ip_hdr = (struct ip *)buf;
+        struct icmp *icmp_hdr = (struct icmp *)(ip_hdr + 1);
+        unsigned int len = sizeof(struct ip) + ICMP_MINLEN + size;
+        unsigned int i;
+
+        ip_hdr->ip_v = 4;
+        ip_hdr->ip_hl = sizeof(struct ip) / 4;
+        ip_hdr->ip_tos = 0;
+        ip_hdr->ip_len = htons(len);
+        ip_hdr->ip_id = 0;
+        ip_hdr->ip_off = 0;
+        ip_hdr->ip_ttl = 64;
+        ip_hdr->ip_p = IPPROTO_ICMP;
+        ip_hdr->ip_src.s_addr = htonl(INADDR_LOOPBACK);
+        ip_hdr->ip_dst.s_addr = htonl(INADDR_LOOPBACK);
+        ip_hdr->ip_sum = 0;
+        ip_hdr->ip_sum = cksum(ip_hdr, sizeof(struct ip));
+
+        icmp_hdr->icmp_type = ICMP_TYPE_REQUEST;
+        icmp_hdr->icmp_code = 0;
+        icmp_hdr->icmp_id = htons(id);
+        icmp_hdr->icmp_seq = 0;
+        icmp_hdr->icmp_cksum = 0;
+        memset(icmp_hdr->icmp_data, 0, sizeof(struct pingclient_payload));
+        for (i = sizeof(struct pingclient_payload); i < size; i++)
+        {
+                icmp_hdr->icmp_data[i] = i;
+        }
+
+        return len;
+}
+
+static int init_pinger(struct pinger *pinger,
+                       const struct pingclient_config *config,
+                       struct pingclient_stats *stats)
+{
+        uint64_t num_slots = MIN_FLIGHT_SLOTS;
+        struct in_addr localhost;
+
+        memset(pinger, 0, sizeof(*pinger));
+        pinger->config = config;
+        pinger->stats = stats;
+        pinger->interval_ns = config->interval * NS_PER_SEC;
+        pinger->timeout_ns = config->timeout * NS_PER_SEC;
+        pinger->next_seq = 1;
+        pinger->oldest_seq = 1;
+
+        if (config->size < PINGCLIENT_MIN_SIZE ||
+            config->size > PINGCLIENT_MAX_SIZE)
+        {
+                fprintf(stderr, "The data size must be %d-%d bytes.\n",
+                        PINGCLIENT_MIN_SIZE, PINGCLIENT_MAX_SIZE);
+                return __LINE__;
+        }
+
+        /* Room for every request that may be waiting for its reply. */
+        if (pinger->interval_ns > 0 &&
+            4 * pinger->timeout_ns / pinger->interval_ns > num_slots)
+        {
+                num_slots = 4 * pinger->timeout_ns / pinger->interval_ns;
+        }
+        if (pinger->interval_ns == 0 || num_slots > MAX_FLIGHT_SLOTS)
+        {
+                num_slots = MAX_FLIGHT_SLOTS;
+        }
+        num_slots = pingclient_round_up_pow2(num_slots);
+        pinger->slot_mask = num_slots - 1;
+
+        pinger->slots = calloc(num_slots, sizeof(*pinger->slots));
+        pinger->send_buf = calloc(1, MAX_PACKET_LEN);
+        pinger->recv_buf = malloc(MAX_PACKET_LEN);
+        if (pinger->slots == NULL || pinger->send_buf == NULL ||
+            pinger->recv_buf == NULL)
+        {
+                fprintf(stderr, "Failed to allocate the pinger.\n");
+                return __LINE__;
         }
 
-        /* Prepare outgoing IP header. */
-        ip_hdr_out->ip_v = 4;
-        ip_hdr_out->ip_hl = 5;
-        ip_hdr_out->ip_tos = 0;
-        ip_hdr_out->ip_len = 84;
-        ip_hdr_out->ip_id = 0;
-        ip_hdr_out->ip_off = 0;
-        ip_hdr_out->ip_ttl = 64;
-        ip_hdr_out->ip_p = IPPROTO_ICMP;
-        ip_hdr_out->ip_sum = 0;
-        ip_hdr_out->ip_src.s_addr = localhost.sin_addr.s_addr;
-        ip_hdr_out->ip_dst.s_addr = localhost.sin_addr.s_addr;
-        ip_hdr_out->ip_sum = in_cksum((unsigned short *)buf_out,
-                                      ip_hdr_out->ip_hl);
-
-        /* Prepare outgoing ICMP header. */
-        icmp_hdr_out->icmp_type = ICMP_TYPE_REQUEST;
-        icmp_hdr_out->icmp_code = 0;
-        icmp_hdr_out->icmp_cksum = 0;
-        icmp_hdr_out->icmp_id = 0x0C5B;
-        icmp_hdr_out->icmp_seq = 0x0001;
-        ip_len = ip_hdr_out->ip_len;
-        icmp_len = ip_len - sizeof(struct iphdr);
-        icmp_hdr_out->icmp_cksum = in_cksum((unsigned short *)icmp_hdr_out,
-                                            icmp_len);
-        
-        /* Send packet. */
-        status = send(sock_icmp, buf_out, 84, 0);
-        if (status != 0)
+        localhost.s_addr = htonl(INADDR_LOOPBACK);
+        pinger->sock = pingclient_open_socket(&localhost, config->dgram,
+                                              &pinger->id);
+        if (pinger->sock < 0)
+        {
+                return __LINE__;
+        }
+        if (config->timestamps &&
+            tstamp_enable(pinger->sock, config->hw_device) != 0)
+        {
+                return __LINE__;
+        }
+        pinger->send_len = pingclient_build_request(pinger->send_buf,
+                                                    pinger->id,
+                                                    config->size);
+
+        return 0;
+}
+
+static void expire_oldest(struct pinger *pinger)
+{
+        struct flight_slot *slot;
+
+        slot = &pinger->slots[pinger->oldest_seq & pinger->slot_mask];
+        if (slot->in_flight)
+        {
+                slot->in_flight = 0;
+                pinger->in_flight--;
+                pinger->stats->lost++;
+        }
+        pinger->oldest_seq++;
+}
+
+/* Moves past the answered requests, and counts the ones that have been
+ * waiting longer than the timeout as lost.
+ */
+static void expire(struct pinger *pinger, uint64_t now)
+{
+        struct flight_slot *slot;
+
+        while (pinger->oldest_seq != pinger->next_seq)
+        {
+                slot = &pinger->slots[pinger->oldest_seq & pinger->slot_mask];
+                if (slot->in_flight &&
+                    now - slot->send_ns < pinger->timeout_ns)
+                {
+                        break;
+                }
+                expire_oldest(pinger);
+        }
+}
+
+static void send_request(struct pinger *pinger, uint64_t now)
+{
+        struct icmp *icmp_hdr = (struct icmp *)(pinger->send_buf +
+                                                sizeof(struct ip));
+        unsigned int icmp_len = pinger->send_len - sizeof(struct ip);
+        const unsigned char *buf = pinger->send_buf;
+        unsigned int len = pinger->send_len;
+        struct pingclient_payload hdr;
+        struct flight_slot *slot;
+
+        /* A full ring makes room by giving up on the oldest request. */
+        if (pinger->next_seq - pinger->oldest_seq > pinger->slot_mask)
+        {
+                expire_oldest(pinger);
+        }
+
+        hdr.seq = pinger->next_seq;
+        hdr.send_ns = now;
+        memcpy(icmp_hdr->icmp_data, &hdr, sizeof(hdr));
+        icmp_hdr->icmp_seq = htons(pinger->next_seq & 0xffff);
+
+        /* A datagram socket takes the ICMP message alone, and fills in
+         * its checksum itself.
+         */
+        if (pinger->config->dgram)
+        {
+                buf = (const unsigned char *)icmp_hdr;
+                len = icmp_len;
+        }
+        else
+        {
+                icmp_hdr->icmp_cksum = 0;
+                icmp_hdr->icmp_cksum = cksum(icmp_hdr, icmp_len);
+        }
+
+        if (send(pinger->sock, buf, len, 0) != (ssize_t)len)
         {
                 perror("send");
                 exit(__LINE__);
         }
+
+        slot = &pinger->slots[pinger->next_seq & pinger->slot_mask];
+        slot->seq = pinger->next_seq;
+        slot->send_ns = now;
+        slot->in_flight = 1;
+        slot->answered = 0;
+        memset(&slot->tx, 0, sizeof(slot->tx));
+        memset(&slot->rx, 0, sizeof(slot->rx));
+        pinger->in_flight++;
+        pinger->stats->sent++;
+        pinger->next_seq++;
+}
+
+/* Returns 1 if the ICMP message is intact: the checksum, length and data
+ * are those of our requests.
+ */
+static int is_intact(const struct pinger *pinger, const struct icmp *icmp_hdr,
+                     unsigned int icmp_len)
+{
+        const struct icmp *request = (const struct icmp *)(pinger->send_buf +
+                                                           sizeof(struct ip));
+        unsigned int data_start = sizeof(struct pingclient_payload);
+
+        return icmp_len == pinger->send_len - sizeof(struct ip) &&
+                cksum(icmp_hdr, icmp_len) == 0 &&
+                memcmp(icmp_hdr->icmp_data + data_start,
+                       request->icmp_data + data_start,
+                       pinger->config->size - data_start) == 0;
+}
+
+static void print_reply(const struct pinger *pinger,
+                        const struct pingclient_reply *reply, uint64_t seq,
+                        uint64_t rtt, uint64_t kernel_rtt, const char *note)
+{
+        if (pinger->config->quiet)
+        {
+                return;
+        }
+        printf("%u bytes from 127.0.0.1: icmp_seq=%llu ttl=%d time=%.3f ms",
+               reply->len, (unsigned long long)seq, reply->ttl,
+               (double)rtt / NS_PER_MS);
+        if (kernel_rtt > 0)
+        {
+                printf(" kernel=%.3f ms", (double)kernel_rtt / NS_PER_MS);
+        }
+        printf("%s\n", note);
+}
+
+/* Counts the kernel round trip time of an answered request once both
+ * its timestamps are in, and returns it, or 0 while one is missing.
+ */
+static uint64_t record_kernel_rtt(struct pinger *pinger,
+                                  struct flight_slot *slot)
+{
+        struct pingclient_stats *stats = pinger->stats;
+        uint64_t rtt = 0;
+
+        if (slot->tx.software != 0 && slot->rx.software != 0)
+        {
+                rtt = slot->rx.software - slot->tx.software;
+                histogram_record(&stats->kernel_rtt, rtt);
+                slot->tx.software = 0;
+                slot->rx.software = 0;
+        }
+        if (slot->tx.hardware != 0 && slot->rx.hardware != 0)
+        {
+                histogram_record(&stats->hardware_rtt,
+                                 slot->rx.hardware - slot->tx.hardware);
+                slot->tx.hardware = 0;
+                slot->rx.hardware = 0;
+        }
+
+        return rtt;
 }
 
+static void handle_reply(void *arg, const struct pingclient_reply *reply,
+                         uint64_t now)
+{
+        struct pinger *pinger = arg;
+        struct pingclient_stats *stats = pinger->stats;
+        const struct icmp *icmp_hdr = reply->icmp;
+        unsigned int icmp_len = reply->len;
+        struct flight_slot *slot;
+        struct pingclient_payload hdr;
+        uint64_t kernel_rtt;
+        uint64_t rtt;
+
+        if (icmp_len < ICMP_MINLEN + sizeof(hdr))
+        {
+                return;
+        }
+
+        /* The raw socket sees every ICMP message from the peer, on
+         * loopback even our own requests.
+         */
+        if (icmp_hdr->icmp_type != ICMP_TYPE_REPLY ||
+            ntohs(icmp_hdr->icmp_id) != pinger->id)
+        {
+                return;
+        }
+        if (!is_intact(pinger, icmp_hdr, icmp_len))
+        {
+                stats->corrupt++;
+                return;
+        }
+
+        memcpy(&hdr, icmp_hdr->icmp_data, sizeof(hdr));
+        slot = &pinger->slots[ntohs(icmp_hdr->icmp_seq) & pinger->slot_mask];
+        if (slot->seq != hdr.seq || (hdr.seq & 0xffff) !=
+            ntohs(icmp_hdr->icmp_seq))
+        {
+                /* Its slot has been taken by a later request. */
+                stats->late++;
+                return;
+        }
+        if (slot->send_ns != hdr.send_ns)
+        {
+                stats->corrupt++;
+                return;
+        }
+
+        rtt = now - hdr.send_ns;
+        if (slot->answered)
+        {
+                stats->duplicates++;
+                print_reply(pinger, reply, hdr.seq, rtt, 0, " (DUP!)");
+                return;
+        }
+        if (!slot->in_flight)
+        {
+                stats->late++;
+                return;
+        }
+        slot->in_flight = 0;
+        slot->answered = 1;
+        pinger->in_flight--;
+        stats->received++;
+
+        histogram_record(&stats->rtt, rtt);
+        stats->rtt_sum_squares += (double)rtt * rtt;
+        slot->rx = reply->tstamp;
+        kernel_rtt = record_kernel_rtt(pinger, slot);
+        if (stats->received > 1 && hdr.seq < pinger->highest_seq)
+        {
+                stats->reordered++;
+                print_reply(pinger, reply, hdr.seq, rtt, kernel_rtt,
+                            " (out of order)");
+                return;
+        }
+        pinger->highest_seq = hdr.seq;
+        print_reply(pinger, reply, hdr.seq, rtt, kernel_rtt, "");
+}
+
+/* Takes the transmit timestamps off the error queue into the slots of
+ * their requests, those not taken over by later requests yet.
+ */
+static void receive_tx_timestamps(struct pinger *pinger)
+{
+        struct flight_slot *slot;
+        struct tstamp ts;
+        uint32_t key;
+
+        while (tstamp_read_tx(pinger->sock, &key, &ts))
+        {
+                slot = &pinger->slots[(key + 1) & pinger->slot_mask];
+                if ((uint32_t)(slot->seq - 1) != key)
+                {
+                        continue;
+                }
+                if (ts.software != 0)
+                {
+                        slot->tx.software = ts.software;
+                }
+                if (ts.hardware != 0)
+                {
+                        slot->tx.hardware = ts.hardware;
+                }
+                if (slot->answered)
+                {
+                        record_kernel_rtt(pinger, slot);
+                }
+        }
+}
+
+static void receive_replies(struct pinger *pinger)
+{
+        if (pinger->config->timestamps)
+        {
+                receive_tx_timestamps(pinger);
+        }
+        pingclient_receive_replies(pinger->sock, pinger->config->dgram,
+                                   pinger->recv_buf, MAX_PACKET_LEN,
+                                   handle_reply, pinger);
+}
+
+int pingclient(const struct pingclient_config *config,
+               struct pingclient_stats *stats)
+{
+        static struct pinger pinger;
+        struct flight_slot *oldest;
+        uint64_t next_send_ns;
+        uint64_t deadline;
+        uint64_t now;
+        int sending = 1;
+
+        if (init_pinger(&pinger, config, stats) != 0)
+        {
+                return __LINE__;
+        }
+        pingclient_install_stop_handler();
+
+        next_send_ns = pingclient_now_ns();
+        while (!pingclient_stop)
+        {
+                now = pingclient_now_ns();
+                if (sending && now >= next_send_ns)
+                {
+                        send_request(&pinger, now);
+                        next_send_ns += pinger.interval_ns;
+                        sending = config->count == 0 ||
+                                stats->sent < config->count;
+                }
+                expire(&pinger, now);
+                if (!sending && pinger.in_flight == 0)
+                {
+                        break;
+                }
+
+                /* Until the next request is due, or the oldest one in
+                 * flight is lost.
+                 */
+                deadline = sending ? next_send_ns : UINT64_MAX;
+                if (pinger.in_flight > 0)
+                {
+                        oldest = &pinger.slots[pinger.oldest_seq &
+                                               pinger.slot_mask];
+                        if (oldest->send_ns + pinger.timeout_ns < deadline)
+                        {
+                                deadline = oldest->send_ns +
+                                        pinger.timeout_ns;
+                        }
+                }
+                pingclient_wait(pinger.sock,
+                                (deadline > now) ? deadline - now : 0);
+                receive_replies(&pinger);
+        }
+
+        /* Stopped early, what is still in flight is lost. */
+        stats->lost += pinger.in_flight;
+
+        close(pinger.sock);
+        free(pinger.slots);
+        free(pinger.send_buf);
+        free(pinger.recv_buf);
+
+        return 0;
+}
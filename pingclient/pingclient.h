@@ -1,8 +1,178 @@
 #ifndef __PINGCLIENT_H_
 #define __PINGCLIENT_H_
 
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 
-extern void pingclient(void);
+#include "histogram.h"
+#include "tstamp.h"
+
+#define PINGCLIENT_DEFAULT_SIZE 56
+#define PINGCLIENT_DEFAULT_INTERVAL 1.0
+#define PINGCLIENT_DEFAULT_TIMEOUT 1.0
+/* Smallest ICMP data, room for the sequence number and send timestamp. */
+#define PINGCLIENT_MIN_SIZE 16
+#define PINGCLIENT_MAX_SIZE (65535 - 20 - 8)
+#define PINGCLIENT_DEFAULT_BATCH 64
+#define PINGCLIENT_MAX_BATCH 1024
+#define PINGCLIENT_MAX_RATE 100000000UL
+#define PINGCLIENT_DEFAULT_IN_FLIGHT 4096
+#define PINGCLIENT_MAX_IN_FLIGHT (1 << 16)
+
+/* The start of the data of every request. */
+struct pingclient_payload
+{
+        uint64_t seq;
+        uint64_t send_ns;
+};
+
+struct pingclient_config
+{
+        unsigned int count;       /* Requests to send, 0 until stopped. */
+        double interval;          /* Seconds between requests. */
+        unsigned int size;        /* Bytes of ICMP data. */
+        double timeout;           /* Seconds before a request is lost. */
+        int quiet;                /* No line for every reply. */
+        unsigned long rate;       /* Flood: requests per second, 0 for
+                                   * as fast as possible. */
+        unsigned int batch;       /* Flood: most requests per send. */
+        char **targets;           /* Addresses or CIDR ranges to ping
+                                   * instead of localhost. */
+        int num_targets;
+        const char *target_file;  /* More of them, one a line. */
+        unsigned int in_flight;   /* Targets: most requests waiting. */
+        int dgram;                /* On an ICMP datagram socket, which
+                                   * needs no root. */
+        int timestamps;           /* Kernel timestamps of the requests and
+                                   * replies too. */
+        const char *hw_device;    /* NIC to take hardware timestamps on,
+                                   * or NULL. */
+};
+
+struct pingclient_stats
+{
+        unsigned long long sent;
+        unsigned long long received;
+        unsigned long long lost;
+        unsigned long long duplicates;
+        unsigned long long reordered;
+        unsigned long long late;      /* After their request was lost. */
+        unsigned long long corrupt;   /* Bad checksum or data. */
+        double rtt_sum_squares;       /* For the deviation, in ns^2. */
+        struct histogram rtt;         /* Initialized by the caller. */
+        uint64_t elapsed_ns;          /* Flood: first to last request. */
+        struct histogram pacing;      /* Flood: ns each send was late,
+                                       * initialized by the caller. */
+        unsigned long targets;
+        unsigned long alive;          /* Targets that replied. */
+        struct histogram kernel_rtt;  /* From the kernel timestamps of
+                                       * request and reply, both
+                                       * initialized by the caller. */
+        struct histogram hardware_rtt;
+};
+
+/* Sends echo requests to localhost, one every interval, and receives the
+ * replies on the same socket as they come, until count requests have
+ * been answered or lost, or until SIGINT. Returns 0 on success.
+ */
+extern int pingclient(const struct pingclient_config *config,
+                      struct pingclient_stats *stats);
+
+/* Floods localhost with echo requests, config->rate a second, until
+ * count requests have been sent or until SIGINT, then waits the timeout
+ * for the last replies. Only the summary is printed. Returns 0 on
+ * success.
+ */
+extern int pingclient_flood(const struct pingclient_config *config,
+                            struct pingclient_stats *stats);
+
+/* Pings every one of the targets in turn, every interval, count times or
+ * until SIGINT, a request every 1/rate seconds and at most in_flight
+ * waiting for their replies. Prints a line per target at the end unless
+ * quiet. Returns 0 on success.
+ */
+extern int pingclient_targets(const struct pingclient_config *config,
+                              struct pingclient_stats *stats);
+
+/* A reply as received on either kind of socket. */
+struct pingclient_reply
+{
+        const struct icmp *icmp;  /* NULL if too short for one. */
+        unsigned int len;         /* Of the ICMP message. */
+        struct in_addr src;
+        int ttl;                  /* -1 if not known. */
+        struct tstamp tstamp;     /* 0 without timestamps. */
+};
+
+/* Opens an ICMP socket connected to peer, unless it is NULL, and gives
+ * the identifier for the requests in id. A raw socket, on which the IP
+ * header is written by us, needs root. A datagram socket (dgram) needs
+ * our group in net.ipv4.ping_group_range, and takes and gives the ICMP
+ * message alone: the kernel writes the IP header, the checksum and the
+ * identifier, and hands the socket the replies to its identifier only.
+ * Returns the socket, or -1 with the reason printed.
+ */
+extern int pingclient_open_socket(const struct in_addr *peer, int dgram,
+                                  unsigned short *id);
+
+/* Receives a message waiting on sock into buf of size bytes, without
+ * blocking, and finds the ICMP message and its timestamps in reply.
+ * Returns the result of recvmsg().
+ */
+extern ssize_t pingclient_receive(int sock, int dgram, unsigned char *buf,
+                                  unsigned int size,
+                                  struct pingclient_reply *reply);
+
+/* Lets only echo replies through to the raw socket, not every ICMP
+ * message of the host, our own requests on loopback among them. Returns
+ * 0 on success.
+ */
+extern int pingclient_filter_replies(int sock);
+
+/* Called with every reply found by pingclient_receive_replies() and the
+ * time it was taken in.
+ */
+typedef void (*pingclient_reply_fn)(void *arg,
+                                    const struct pingclient_reply *reply,
+                                    uint64_t now_ns);
+
+/* Receives every reply waiting on sock into buf of size bytes and hands
+ * each to handle with arg. Exits on an error other than EAGAIN or EINTR.
+ */
+extern void pingclient_receive_replies(int sock, int dgram,
+                                       unsigned char *buf, unsigned int size,
+                                       pingclient_reply_fn handle, void *arg);
+
+/* Set by the handler of SIGINT and SIGTERM. */
+extern volatile sig_atomic_t pingclient_stop;
+
+/* Sets pingclient_stop on SIGINT and SIGTERM, which also interrupt a
+ * pingclient_wait().
+ */
+extern void pingclient_install_stop_handler(void);
+
+/* Returns the monotonic time in ns. */
+extern uint64_t pingclient_now_ns(void);
+
+/* Returns the smallest power of two not below n. */
+extern uint64_t pingclient_round_up_pow2(uint64_t n);
+
+/* Waits at most wait_ns for something to read on sock. */
+extern void pingclient_wait(int sock, uint64_t wait_ns);
+
+/* Writes an echo request to localhost with size bytes of data into buf,
+ * after an IP header that a datagram socket goes without, and returns
+ * its length. The payload header, the sequence number and the
+ * ICMP checksum are left zero for the sender, the rest is final.
+ */
+extern unsigned int pingclient_build_request(unsigned char *buf,
+                                             unsigned short id,
+                                             unsigned int size);
 
 #endif
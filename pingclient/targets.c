@@ -0,0 +1,717 @@
+/* This is the many targets mode of the ping client, in the manner of
+ * fping: every target is pinged in turn, round after round, with many
+ * requests in flight at once.
+ *
+ * The targets are IPv4 addresses or CIDR ranges, given on the command
+ * line or one a line in a file, and take a fixed struct target each. A
+ * range leaves out its network and broadcast addresses, as fping does,
+ * unless it is a /31 or a /32.
+ *
+ * The requests in flight are kept in a flat table of probes allocated up
+ * front, indexed by the ICMP sequence number as in the single target
+ * mode. A new request waits for its slot to be free, which bounds the
+ * requests in flight by the size of the table. A reply finds its probe
+ * without a search, and is checked against it and its target.
+ *
+ * The timeouts are driven by a hashed timing wheel of WHEEL_SLOTS
+ * buckets of WHEEL_TICK_NS each. A probe is linked into the bucket of
+ * the tick it expires at, by table index, and unlinked in constant time
+ * when its reply comes. Every tick the due bucket is walked and the
+ * probes in it that have expired are lost. A timeout longer than the
+ * wheel wraps around it, the probes of later laps staying in the bucket
+ * until their own tick. No timer is kept per probe, and the cost of a
+ * tick does not depend on the requests in flight.
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cksum.h"
+#include "histogram.h"
+#include "inccksum.h"
+#include "pingclient.h"
+
+#define ICMP_TYPE_REPLY 0
+#define MAX_PACKET_LEN 65535
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+#define NS_PER_US 1000ULL
+#define MAX_TARGETS (1UL << 24)
+#define MAX_LINE_LEN 256
+#define WHEEL_TICK_NS NS_PER_MS
+#define WHEEL_SLOTS 1024
+#define NO_PROBE -1
+#define RECV_BUF_SIZE (8 << 20)
+
+/* 32 bytes, a /8 of them fits in 512 MB. */
+struct target
+{
+        struct in_addr addr;
+        uint32_t sent;
+        uint32_t received;
+        uint32_t min_rtt_us;
+        uint32_t max_rtt_us;
+        uint64_t rtt_sum_us;
+};
+
+struct probe
+{
+        uint64_t seq;
+        uint64_t send_ns;
+        uint32_t target;
+        uint32_t round;
+        uint32_t expire_tick;
+        int32_t next;             /* In the wheel bucket, or NO_PROBE. */
+        int32_t prev;
+        uint8_t in_flight;
+        uint8_t answered;
+};
+
+struct pinger
+{
+        const struct pingclient_config *config;
+        struct pingclient_stats *stats;
+        int sock;
+        unsigned short id;
+        uint64_t interval_ns;
+        uint64_t timeout_ns;
+        uint64_t request_ns;      /* Between two requests, 0 for none. */
+        unsigned char *send_buf;
+        unsigned int send_len;
+        unsigned int send_offset; /* Past the IP header, if not ours. */
+        unsigned char *recv_buf;
+
+        struct target *targets;
+        unsigned long num_targets;
+        unsigned long max_targets;
+
+        /* The next request, and its round over the targets. */
+        unsigned long next_target;
+        uint32_t round;
+
+        /* Requests in flight, indexed by sequence number. */
+        struct probe *probes;
+        uint64_t probe_mask;
+        uint64_t next_seq;
+        unsigned int in_flight;
+
+        /* Heads of the buckets of probes, by expiry tick. */
+        int32_t wheel[WHEEL_SLOTS];
+        uint64_t start_ns;
+        uint32_t tick;            /* The last one expired. */
+};
+
+static int add_targets(struct pinger *pinger, uint32_t first,
+                       unsigned long count)
+{
+        struct target *targets;
+        unsigned long i;
+
+        if (count > MAX_TARGETS - pinger->num_targets)
+        {
+                fprintf(stderr, "More than %lu targets.\n", MAX_TARGETS);
+                return __LINE__;
+        }
+        if (pinger->num_targets + count > pinger->max_targets)
+        {
+                pinger->max_targets =
+                        pingclient_round_up_pow2(pinger->num_targets + count);
+                targets = realloc(pinger->targets, pinger->max_targets *
+                                  sizeof(*targets));
+                if (targets == NULL)
+                {
+                        fprintf(stderr, "Failed to allocate the targets.\n");
+                        return __LINE__;
+                }
+                pinger->targets = targets;
+        }
+
+        for (i = 0; i < count; i++)
+        {
+                memset(&pinger->targets[pinger->num_targets], 0,
+                       sizeof(struct target));
+                pinger->targets[pinger->num_targets].addr.s_addr =
+                        htonl(first + i);
+                pinger->num_targets++;
+        }
+
+        return 0;
+}
+
+/* Adds the targets of an address, or of a range like 127.0.0.0/8. */
+static int add_spec(struct pinger *pinger, const char *spec)
+{
+        char address[INET_ADDRSTRLEN];
+        struct in_addr addr;
+        unsigned long prefix = 32;
+        unsigned long count;
+        const char *slash;
+        char *end;
+        uint32_t first;
+
+        slash = strchr(spec, '/');
+        if (slash == NULL)
+        {
+                slash = spec + strlen(spec);
+        }
+        else
+        {
+                prefix = strtoul(slash + 1, &end, 10);
+                if (slash[1] == '\0' || *end != '\0' || prefix > 32)
+                {
+                        slash = spec;
+                }
+        }
+        if (slash == spec || slash - spec >= INET_ADDRSTRLEN)
+        {
+                fprintf(stderr, "Not an IPv4 address or range: %s\n", spec);
+                return __LINE__;
+        }
+        memcpy(address, spec, slash - spec);
+        address[slash - spec] = '\0';
+        if (inet_pton(AF_INET, address, &addr) != 1)
+        {
+                fprintf(stderr, "Not an IPv4 address or range: %s\n", spec);
+                return __LINE__;
+        }
+
+        count = 1UL << (32 - prefix);
+        first = ntohl(addr.s_addr) & ~(uint32_t)(count - 1);
+        if (prefix < 31)
+        {
+                first++;
+                count -= 2;
+        }
+
+        return add_targets(pinger, first, count);
+}
+
+/* Adds the targets of a file, an address or range a line. Blank lines
+ * and what follows a '#' are left out.
+ */
+static int read_targets(struct pinger *pinger, const char *path)
+{
+        char line[MAX_LINE_LEN];
+        char *start;
+        char *end;
+        FILE *in;
+        int ret = 0;
+
+        in = fopen(path, "r");
+        if (in == NULL)
+        {
+                perror(path);
+                return __LINE__;
+        }
+        while (ret == 0 && fgets(line, sizeof(line), in) != NULL)
+        {
+                end = strchr(line, '#');
+                if (end == NULL)
+                {
+                        end = line + strlen(line);
+                }
+                while (end > line && isspace((unsigned char)end[-1]))
+                {
+                        end--;
+                }
+                *end = '\0';
+                for (start = line; isspace((unsigned char)*start); start++)
+                {
+                }
+                if (*start != '\0')
+                {
+                        ret = add_spec(pinger, start);
+                }
+        }
+        fclose(in);
+
+        return ret;
+}
+
+static int init_pinger(struct pinger *pinger,
+                       const struct pingclient_config *config,
+                       struct pingclient_stats *stats)
+{
+        struct ip *ip_hdr;
+        struct icmp *icmp_hdr;
+        uint64_t num_probes;
+        int size = RECV_BUF_SIZE;
+        int i;
+
+        memset(pinger, 0, sizeof(*pinger));
+        pinger->config = config;
+        pinger->stats = stats;
+        pinger->interval_ns = config->interval * NS_PER_SEC;
+        pinger->timeout_ns = config->timeout * NS_PER_SEC;
+        pinger->request_ns = (config->rate > 0) ? NS_PER_SEC / config->rate :
+                0;
+        pinger->next_seq = 1;
+
+        if (config->size < PINGCLIENT_MIN_SIZE ||
+            config->size > PINGCLIENT_MAX_SIZE)
+        {
+                fprintf(stderr, "The data size must be %d-%d bytes.\n",
+                        PINGCLIENT_MIN_SIZE, PINGCLIENT_MAX_SIZE);
+                return __LINE__;
+        }
+        if (config->in_flight < 1 ||
+            config->in_flight > PINGCLIENT_MAX_IN_FLIGHT)
+        {
+                fprintf(stderr, "The requests in flight must be 1-%d.\n",
+                        PINGCLIENT_MAX_IN_FLIGHT);
+                return __LINE__;
+        }
+
+        for (i = 0; i < config->num_targets; i++)
+        {
+                if (add_spec(pinger, config->targets[i]) != 0)
+                {
+                        return __LINE__;
+                }
+        }
+        if (config->target_file != NULL &&
+            read_targets(pinger, config->target_file) != 0)
+        {
+                return __LINE__;
+        }
+        if (pinger->num_targets == 0)
+        {
+                fprintf(stderr, "No targets.\n");
+                return __LINE__;
+        }
+        stats->targets = pinger->num_targets;
+
+        num_probes = pingclient_round_up_pow2(config->in_flight);
+        pinger->probe_mask = num_probes - 1;
+        pinger->probes = calloc(num_probes, sizeof(*pinger->probes));
+        pinger->send_buf = calloc(1, MAX_PACKET_LEN);
+        pinger->recv_buf = malloc(MAX_PACKET_LEN);
+        if (pinger->probes == NULL || pinger->send_buf == NULL ||
+            pinger->recv_buf == NULL)
+        {
+                fprintf(stderr, "Failed to allocate the pinger.\n");
+                return __LINE__;
+        }
+        for (i = 0; i < WHEEL_SLOTS; i++)
+        {
+                pinger->wheel[i] = NO_PROBE;
+        }
+
+        pinger->sock = pingclient_open_socket(NULL, config->dgram,
+                                              &pinger->id);
+        if (pinger->sock < 0 || (!config->dgram &&
+                                 pingclient_filter_replies(pinger->sock) != 0))
+        {
+                return __LINE__;
+        }
+        if (setsockopt(pinger->sock, SOL_SOCKET, SO_RCVBUFFORCE, &size,
+                       sizeof(size)) != 0)
+        {
+                setsockopt(pinger->sock, SOL_SOCKET, SO_RCVBUF, &size,
+                           sizeof(size));
+        }
+
+        /* The source address is left for the kernel to fill in, by the
+         * route to every target.
+         */
+        pinger->send_len = pingclient_build_request(pinger->send_buf,
+                                                    pinger->id,
+                                                    config->size);
+        ip_hdr = (struct ip *)pinger->send_buf;
+        ip_hdr->ip_src.s_addr = INADDR_ANY;
+        ip_hdr->ip_sum = 0;
+        ip_hdr->ip_sum = cksum(ip_hdr, sizeof(struct ip));
+        icmp_hdr = (struct icmp *)(ip_hdr + 1);
+        icmp_hdr->icmp_cksum = cksum(icmp_hdr, pinger->send_len -
+                                     sizeof(struct ip));
+        pinger->send_offset = config->dgram ? sizeof(struct ip) : 0;
+
+        return 0;
+}
+
+static uint32_t tick_of(const struct pinger *pinger, uint64_t ns)
+{
+        return (ns - pinger->start_ns) / WHEEL_TICK_NS;
+}
+
+static void wheel_insert(struct pinger *pinger, int32_t index)
+{
+        struct probe *probe = &pinger->probes[index];
+        int32_t *head = &pinger->wheel[probe->expire_tick % WHEEL_SLOTS];
+
+        probe->prev = NO_PROBE;
+        probe->next = *head;
+        if (*head != NO_PROBE)
+        {
+                pinger->probes[*head].prev = index;
+        }
+        *head = index;
+}
+
+static void wheel_remove(struct pinger *pinger, int32_t index)
+{
+        struct probe *probe = &pinger->probes[index];
+
+        if (probe->prev != NO_PROBE)
+        {
+                pinger->probes[probe->prev].next = probe->next;
+        }
+        else
+        {
+                pinger->wheel[probe->expire_tick % WHEEL_SLOTS] = probe->next;
+        }
+        if (probe->next != NO_PROBE)
+        {
+                pinger->probes[probe->next].prev = probe->prev;
+        }
+}
+
+/* Counts the probes in the bucket that have expired by tick as lost. */
+static void expire_bucket(struct pinger *pinger, uint32_t tick)
+{
+        struct probe *probe;
+        int32_t index;
+        int32_t next;
+
+        for (index = pinger->wheel[tick % WHEEL_SLOTS]; index != NO_PROBE;
+             index = next)
+        {
+                probe = &pinger->probes[index];
+                next = probe->next;
+                if (probe->expire_tick <= tick)
+                {
+                        wheel_remove(pinger, index);
+                        probe->in_flight = 0;
+                        pinger->in_flight--;
+                        pinger->stats->lost++;
+                }
+        }
+}
+
+/* Turns the wheel to the tick of now. After a long wait every bucket is
+ * walked once.
+ */
+static void expire(struct pinger *pinger, uint64_t now)
+{
+        uint32_t tick = tick_of(pinger, now);
+        uint32_t next;
+
+        if (tick - pinger->tick > WHEEL_SLOTS)
+        {
+                for (next = tick - WHEEL_SLOTS + 1; next != tick + 1; next++)
+                {
+                        expire_bucket(pinger, next);
+                }
+        }
+        else
+        {
+                for (next = pinger->tick + 1; next != tick + 1; next++)
+                {
+                        expire_bucket(pinger, next);
+                }
+        }
+        pinger->tick = tick;
+}
+
+/* Sends the next request, addressed to its target and numbered in the
+ * template, with the checksums updated for what changed. A datagram
+ * socket is given the ICMP message alone, and writes the IP header and
+ * the ICMP checksum itself.
+ */
+static void send_request(struct pinger *pinger, uint64_t now)
+{
+        struct ip *ip_hdr = (struct ip *)pinger->send_buf;
+        struct icmp *icmp_hdr = (struct icmp *)(ip_hdr + 1);
+        struct target *target = &pinger->targets[pinger->next_target];
+        int32_t index = pinger->next_seq & pinger->probe_mask;
+        struct probe *probe = &pinger->probes[index];
+        struct pingclient_payload old;
+        struct pingclient_payload new;
+        struct sockaddr_in dst;
+        uint16_t cksum = icmp_hdr->icmp_cksum;
+        uint16_t seq = htons(pinger->next_seq & 0xffff);
+
+        memcpy(&old, icmp_hdr->icmp_data, sizeof(old));
+        new.seq = pinger->next_seq;
+        new.send_ns = now;
+        memcpy(icmp_hdr->icmp_data, &new, sizeof(new));
+        if (!pinger->config->dgram)
+        {
+                ip_hdr->ip_sum = inccksum_update32(ip_hdr->ip_sum,
+                                                   ip_hdr->ip_dst.s_addr,
+                                                   target->addr.s_addr);
+                ip_hdr->ip_dst = target->addr;
+                cksum = inccksum_update16(cksum, icmp_hdr->icmp_seq, seq);
+                cksum = inccksum_update64(cksum, old.seq, new.seq);
+                cksum = inccksum_update64(cksum, old.send_ns, new.send_ns);
+                icmp_hdr->icmp_cksum = cksum;
+        }
+        icmp_hdr->icmp_seq = seq;
+
+        /* A target that cannot be reached loses its request. */
+        memset(&dst, 0, sizeof(dst));
+        dst.sin_family = AF_INET;
+        dst.sin_addr = target->addr;
+        if (sendto(pinger->sock, pinger->send_buf + pinger->send_offset,
+                   pinger->send_len - pinger->send_offset, 0,
+                   (const struct sockaddr *)&dst, sizeof(dst)) < 0 &&
+            errno != ENOBUFS && errno != EHOSTUNREACH &&
+            errno != ENETUNREACH && errno != EACCES && errno != EPERM)
+        {
+                perror("sendto");
+                exit(__LINE__);
+        }
+
+        probe->seq = pinger->next_seq;
+        probe->send_ns = now;
+        probe->target = pinger->next_target;
+        probe->round = pinger->round;
+        probe->expire_tick = tick_of(pinger, now + pinger->timeout_ns +
+                                     WHEEL_TICK_NS - 1);
+        probe->in_flight = 1;
+        probe->answered = 0;
+        wheel_insert(pinger, index);
+        pinger->in_flight++;
+        pinger->stats->sent++;
+        pinger->next_seq++;
+        target->sent++;
+
+        pinger->next_target++;
+        if (pinger->next_target == pinger->num_targets)
+        {
+                pinger->next_target = 0;
+                pinger->round++;
+        }
+}
+
+static void print_reply(const struct pinger *pinger,
+                        const struct pingclient_reply *reply,
+                        const struct probe *probe, uint64_t rtt)
+{
+        if (pinger->config->quiet)
+        {
+                return;
+        }
+        printf("%u bytes from %s: icmp_seq=%u ttl=%d time=%.3f ms\n",
+               reply->len, inet_ntoa(reply->src), probe->round, reply->ttl,
+               (double)rtt / NS_PER_MS);
+}
+
+static void record_rtt(struct pinger *pinger, struct target *target,
+                       uint64_t rtt)
+{
+        struct pingclient_stats *stats = pinger->stats;
+        uint32_t rtt_us = rtt / NS_PER_US;
+
+        stats->received++;
+        histogram_record(&stats->rtt, rtt);
+        stats->rtt_sum_squares += (double)rtt * rtt;
+
+        if (target->received == 0)
+        {
+                stats->alive++;
+                target->min_rtt_us = rtt_us;
+                target->max_rtt_us = rtt_us;
+        }
+        if (rtt_us < target->min_rtt_us)
+        {
+                target->min_rtt_us = rtt_us;
+        }
+        if (rtt_us > target->max_rtt_us)
+        {
+                target->max_rtt_us = rtt_us;
+        }
+        target->rtt_sum_us += rtt_us;
+        target->received++;
+}
+
+static void handle_reply(void *arg, const struct pingclient_reply *reply,
+                         uint64_t now)
+{
+        struct pinger *pinger = arg;
+        struct pingclient_stats *stats = pinger->stats;
+        const struct icmp *icmp_hdr = reply->icmp;
+        unsigned int icmp_len = reply->len;
+        struct pingclient_payload hdr;
+        struct probe *probe;
+        int32_t index;
+
+        if (icmp_len < ICMP_MINLEN + sizeof(hdr))
+        {
+                return;
+        }
+        if (icmp_hdr->icmp_type != ICMP_TYPE_REPLY ||
+            ntohs(icmp_hdr->icmp_id) != pinger->id)
+        {
+                return;
+        }
+        if (icmp_len != pinger->send_len - sizeof(struct ip) ||
+            cksum(icmp_hdr, icmp_len) != 0)
+        {
+                stats->corrupt++;
+                return;
+        }
+
+        memcpy(&hdr, icmp_hdr->icmp_data, sizeof(hdr));
+        index = ntohs(icmp_hdr->icmp_seq) & pinger->probe_mask;
+        probe = &pinger->probes[index];
+        if (probe->seq != hdr.seq || (hdr.seq & 0xffff) !=
+            ntohs(icmp_hdr->icmp_seq))
+        {
+                /* Its slot has been taken by a later request. */
+                stats->late++;
+                return;
+        }
+        if (probe->send_ns != hdr.send_ns ||
+            pinger->targets[probe->target].addr.s_addr !=
+            reply->src.s_addr)
+        {
+                stats->corrupt++;
+                return;
+        }
+        if (probe->answered)
+        {
+                stats->duplicates++;
+                return;
+        }
+        if (!probe->in_flight)
+        {
+                stats->late++;
+                return;
+        }
+
+        wheel_remove(pinger, index);
+        probe->in_flight = 0;
+        probe->answered = 1;
+        pinger->in_flight--;
+        record_rtt(pinger, &pinger->targets[probe->target],
+                   now - hdr.send_ns);
+        print_reply(pinger, reply, probe, now - hdr.send_ns);
+}
+
+static void print_targets(const struct pinger *pinger)
+{
+        const struct target *target;
+        unsigned long i;
+
+        for (i = 0; i < pinger->num_targets; i++)
+        {
+                target = &pinger->targets[i];
+                printf("%-15s : %u requests, %u replies, %.0f%% lost",
+                       inet_ntoa(target->addr), target->sent,
+                       target->received, target->sent ?
+                       100.0 * (target->sent - target->received) /
+                       target->sent : 0.0);
+                if (target->received > 0)
+                {
+                        printf(", RTT min/avg/max %u/%.0f/%u us",
+                               target->min_rtt_us, (double)target->rtt_sum_us /
+                               target->received, target->max_rtt_us);
+                }
+                printf("\n");
+        }
+}
+
+int pingclient_targets(const struct pingclient_config *config,
+                       struct pingclient_stats *stats)
+{
+        static struct pinger pinger;
+        uint64_t next_send_ns;
+        uint64_t round_ns;
+        uint64_t deadline;
+        uint64_t now;
+        int sending = 1;
+        int room;
+
+        if (init_pinger(&pinger, config, stats) != 0)
+        {
+                return __LINE__;
+        }
+        pingclient_install_stop_handler();
+
+        pinger.start_ns = pingclient_now_ns();
+        next_send_ns = pinger.start_ns;
+        while (!pingclient_stop)
+        {
+                /* As many requests as are due, the rate, the interval
+                 * of the round and the room in flight allowing.
+                 */
+                now = pingclient_now_ns();
+                expire(&pinger, now);
+                round_ns = pinger.start_ns + pinger.round *
+                        pinger.interval_ns;
+                room = !pinger.probes[pinger.next_seq &
+                                      pinger.probe_mask].in_flight;
+                while (sending && room && now >= next_send_ns &&
+                       now >= round_ns)
+                {
+                        send_request(&pinger, now);
+                        next_send_ns += pinger.request_ns;
+                        sending = config->count == 0 ||
+                                pinger.round < config->count;
+                        round_ns = pinger.start_ns + pinger.round *
+                                pinger.interval_ns;
+                        room = !pinger.probes[pinger.next_seq &
+                                              pinger.probe_mask].in_flight;
+                }
+                if (!sending && pinger.in_flight == 0)
+                {
+                        break;
+                }
+
+                /* A request held back for room does not make the next
+                 * ones go out faster.
+                 */
+                if (next_send_ns < now)
+                {
+                        next_send_ns = now;
+                }
+
+                /* Until the next request is due, or the next tick. */
+                deadline = UINT64_MAX;
+                if (sending && room)
+                {
+                        deadline = (round_ns > next_send_ns) ? round_ns :
+                                next_send_ns;
+                }
+                if (pinger.in_flight > 0 &&
+                    pinger.start_ns + (pinger.tick + 1) * WHEEL_TICK_NS <
+                    deadline)
+                {
+                        deadline = pinger.start_ns + (pinger.tick + 1) *
+                                WHEEL_TICK_NS;
+                }
+                pingclient_wait(pinger.sock,
+                                (deadline > now) ? deadline - now : 0);
+                pingclient_receive_replies(pinger.sock, config->dgram,
+                                           pinger.recv_buf, MAX_PACKET_LEN,
+                                           handle_reply, &pinger);
+        }
+
+        /* Stopped early, what is still in flight is lost. */
+        stats->lost += pinger.in_flight;
+        if (!config->quiet)
+        {
+                print_targets(&pinger);
+        }
+
+        close(pinger.sock);
+        free(pinger.targets);
+        free(pinger.probes);
+        free(pinger.send_buf);
+        free(pinger.recv_buf);
+
+        return 0;
+}
@@ -0,0 +1,501 @@
+/* This file implements the per-packet work of the ping server: finding
+ * an IPv4 or ICMPv6 echo request in a frame and building its reply. It
+ * is pure, a function from the input frame to the output frame that
+ * touches no socket, ring or global state, so that it can be run and
+ * timed offline on captured traffic (see echo_bench.c) as well as on
+ * the rings of the server.
+ *
+ * A reply differs from its request only in a few header words, so its
+ * checksums are derived from those of the request with an incremental
+ * update (see ../common/inccksum.c), whatever the payload size.
+ *
+ * Fragments are only recognized here and put back together elsewhere
+ * (see reasm.c). A reply too large for one frame is built whole and cut
+ * into fragments by echo_fragment, which only rewrites the IP headers:
+ * the ICMP checksum covers the whole message and is not touched.
+ */
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/icmp6.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cksum.h"
+#include "echo.h"
+#include "inccksum.h"
+
+#define ICMP_TYPE_REPLY 0
+
+static uint16_t get_word(const void *p)
+{
+        uint16_t word;
+
+        memcpy(&word, p, sizeof(word));
+
+        return word;
+}
+
+static int is_cksum_valid(const void *data, int len)
+{
+        return cksum(data, len) == 0;
+}
+
+/* Returns the sum of the ICMPv6 pseudo header (RFC 8200, section 8.1)
+ * for an ICMPv6 message of icmp_len bytes.
+ */
+static uint64_t add_pseudo_header6(const struct ip6_hdr *ip6_hdr,
+                                   unsigned int icmp_len)
+{
+        struct
+        {
+                uint32_t len;
+                uint8_t zero[3];
+                uint8_t next;
+        } pseudo;
+
+        pseudo.len = htonl(icmp_len);
+        memset(pseudo.zero, 0, sizeof(pseudo.zero));
+        pseudo.next = IPPROTO_ICMPV6;
+
+        return cksum_add(cksum_add(0, &ip6_hdr->ip6_src,
+                                   2 * sizeof(struct in6_addr)),
+                         &pseudo, sizeof(pseudo));
+}
+
+/* Returns the checksum of the ICMPv6 message following ip6_hdr, pseudo
+ * header included.
+ */
+static uint16_t icmp6_cksum(const struct ip6_hdr *ip6_hdr,
+                            unsigned int icmp_len)
+{
+        return cksum_finish(cksum_add(add_pseudo_header6(ip6_hdr, icmp_len),
+                                      ip6_hdr + 1, icmp_len));
+}
+
+/* Returns ECHO_REPLY if the IPv4 packet at net, captured bytes long, is
+ * an echo request, ECHO_FRAGMENT if it is a fragment of an ICMP message.
+ */
+static enum echo_status get_echo_request4(const unsigned char *net,
+                                          unsigned int captured,
+                                          struct echo_request *request)
+{
+        const struct ip *ip_hdr_in = (const struct ip *)net;
+        const struct icmp *icmp_hdr_in;
+        unsigned int ip_hdr_len;
+
+        if (captured < sizeof(struct ip) || ip_hdr_in->ip_v != 4 ||
+            ip_hdr_in->ip_p != IPPROTO_ICMP)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+
+        ip_hdr_len = ip_hdr_in->ip_hl * 4;
+        if (ip_hdr_len < sizeof(struct ip) ||
+            captured < ntohs(ip_hdr_in->ip_len) ||
+            ntohs(ip_hdr_in->ip_len) < ip_hdr_len)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+        request->ip_hdr_len = ip_hdr_len;
+        if (ip_hdr_in->ip_off & htons(IP_MF | IP_OFFMASK))
+        {
+                return ECHO_FRAGMENT;
+        }
+
+        /* The IP length, not the frame, which may be padded by the
+         * link, says whether there is an ICMP header.
+         */
+        if (ntohs(ip_hdr_in->ip_len) < ip_hdr_len + ICMP_MINLEN)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+        icmp_hdr_in = (const struct icmp *)(net + ip_hdr_len);
+        if (icmp_hdr_in->icmp_type != ICMP_ECHO)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+
+        request->icmp_len = ntohs(ip_hdr_in->ip_len) - ip_hdr_len;
+
+        return ECHO_REPLY;
+}
+
+/* The same for an IPv6 packet. The extension headers that may come
+ * before the ICMPv6 header are walked. A routing header with segments
+ * left means the packet is not ours to answer yet. A fragment header
+ * ends the walk, the rest is only known once reassembled.
+ */
+static enum echo_status get_echo_request6(const unsigned char *net,
+                                          unsigned int captured,
+                                          struct echo_request *request)
+{
+        const struct ip6_hdr *ip6_hdr_in = (const struct ip6_hdr *)net;
+        const struct ip6_ext *ext_hdr;
+        const struct icmp6_hdr *icmp6_hdr_in;
+        unsigned int end;
+        unsigned int offset = sizeof(struct ip6_hdr);
+        uint8_t next;
+
+        if (captured < sizeof(struct ip6_hdr) ||
+            (ip6_hdr_in->ip6_vfc & 0xf0) != 0x60 ||
+            IN6_IS_ADDR_MULTICAST(&ip6_hdr_in->ip6_dst))
+        {
+                return ECHO_NOT_REQUEST;
+        }
+
+        end = sizeof(struct ip6_hdr) + ntohs(ip6_hdr_in->ip6_plen);
+        if (captured < end)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+
+        /* Every extension header is at least 8 bytes, so the walk ends. */
+        next = ip6_hdr_in->ip6_nxt;
+        while (next != IPPROTO_ICMPV6)
+        {
+                if (offset + sizeof(struct ip6_frag) > end)
+                {
+                        return ECHO_NOT_REQUEST;
+                }
+                if (next == IPPROTO_FRAGMENT)
+                {
+                        request->ip_hdr_len = offset;
+                        return ECHO_FRAGMENT;
+                }
+                if (next != IPPROTO_HOPOPTS && next != IPPROTO_ROUTING &&
+                    next != IPPROTO_DSTOPTS)
+                {
+                        return ECHO_NOT_REQUEST;
+                }
+
+                ext_hdr = (const struct ip6_ext *)(net + offset);
+                if (next == IPPROTO_ROUTING &&
+                    ((const struct ip6_rthdr *)ext_hdr)->ip6r_segleft != 0)
+                {
+                        return ECHO_NOT_REQUEST;
+                }
+                next = ext_hdr->ip6e_nxt;
+                offset += (ext_hdr->ip6e_len + 1) * 8;
+        }
+
+        if (offset + sizeof(struct icmp6_hdr) > end)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+
+        icmp6_hdr_in = (const struct icmp6_hdr *)(net + offset);
+        if (icmp6_hdr_in->icmp6_type != ICMP6_ECHO_REQUEST)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+
+        request->ip_hdr_len = offset;
+        request->icmp_len = end - offset;
+
+        return ECHO_REPLY;
+}
+
+static void swap_macs(unsigned char *frame, unsigned int link_len)
+{
+        struct ether_header *eth_hdr = (struct ether_header *)frame;
+        unsigned char mac[ETH_ALEN];
+
+        if (link_len == ETH_HLEN)
+        {
+                memcpy(mac, eth_hdr->ether_dhost, ETH_ALEN);
+                memcpy(eth_hdr->ether_dhost, eth_hdr->ether_shost, ETH_ALEN);
+                memcpy(eth_hdr->ether_shost, mac, ETH_ALEN);
+        }
+}
+
+/* Turns the IPv4 echo request in frame, link_len bytes of link layer
+ * header followed by the IP packet, into its reply in place. The request
+ * was copied without its IP options, if it had any. The addresses are
+ * swapped and the checksums updated from those of the request.
+ */
+static void make_reply4(unsigned char *frame, unsigned int link_len,
+                        unsigned int icmp_len)
+{
+        struct ip *ip_hdr = (struct ip *)(frame + link_len);
+        struct icmp *icmp_hdr = (struct icmp *)(ip_hdr + 1);
+        struct in_addr addr;
+        uint16_t old_ttl_word;
+        uint16_t old_type_word;
+
+        swap_macs(frame, link_len);
+
+        /* Swapping the addresses leaves the sum as it is. */
+        addr = ip_hdr->ip_src;
+        ip_hdr->ip_src = ip_hdr->ip_dst;
+        ip_hdr->ip_dst = addr;
+
+        if (ip_hdr->ip_hl * 4 == sizeof(struct ip))
+        {
+                old_ttl_word = get_word(&ip_hdr->ip_ttl);
+                ip_hdr->ip_ttl = 255;
+                ip_hdr->ip_sum = inccksum_update16(ip_hdr->ip_sum,
+                                                   old_ttl_word,
+                                                   get_word(&ip_hdr->ip_ttl));
+                ip_hdr->ip_sum = inccksum_update16(ip_hdr->ip_sum,
+                                                   ip_hdr->ip_off, 0);
+                ip_hdr->ip_off = 0;
+        }
+        else
+        {
+                /* The reply goes out without the IP options of the
+                 * request. The header is short, so it is summed again.
+                 */
+                ip_hdr->ip_hl = sizeof(struct ip) / 4;
+                ip_hdr->ip_len = htons(sizeof(struct ip) + icmp_len);
+                ip_hdr->ip_ttl = 255;
+                ip_hdr->ip_off = 0;
+                ip_hdr->ip_sum = 0;
+                ip_hdr->ip_sum = cksum(ip_hdr, sizeof(struct ip));
+        }
+
+        old_type_word = get_word(icmp_hdr);
+        icmp_hdr->icmp_type = ICMP_TYPE_REPLY;
+        icmp_hdr->icmp_code = 0;
+        icmp_hdr->icmp_cksum = inccksum_update16(icmp_hdr->icmp_cksum,
+                                                 old_type_word,
+                                                 get_word(icmp_hdr));
+}
+
+/* The same for an IPv6 echo request, copied without its extension
+ * headers. The pseudo header holds the same addresses and length as
+ * that of the request, so only the type changes the ICMPv6 checksum.
+ */
+static void make_reply6(unsigned char *frame, unsigned int link_len,
+                        unsigned int icmp_len)
+{
+        struct ip6_hdr *ip6_hdr = (struct ip6_hdr *)(frame + link_len);
+        struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *)(ip6_hdr + 1);
+        struct in6_addr addr;
+        uint16_t old_type_word;
+
+        swap_macs(frame, link_len);
+
+        addr = ip6_hdr->ip6_src;
+        ip6_hdr->ip6_src = ip6_hdr->ip6_dst;
+        ip6_hdr->ip6_dst = addr;
+        ip6_hdr->ip6_plen = htons(icmp_len);
+        ip6_hdr->ip6_nxt = IPPROTO_ICMPV6;
+        ip6_hdr->ip6_hlim = 255;
+
+        old_type_word = get_word(icmp6_hdr);
+        icmp6_hdr->icmp6_type = ICMP6_ECHO_REPLY;
+        icmp6_hdr->icmp6_code = 0;
+        icmp6_hdr->icmp6_cksum = inccksum_update16(icmp6_hdr->icmp6_cksum,
+                                                   old_type_word,
+                                                   get_word(icmp6_hdr));
+}
+
+static int is_reply_cksum_valid(const unsigned char *net, int ipv6,
+                                unsigned int icmp_len)
+{
+        if (ipv6)
+        {
+                return icmp6_cksum((const struct ip6_hdr *)net,
+                                   icmp_len) == 0;
+        }
+
+        return is_cksum_valid(net, sizeof(struct ip)) &&
+                is_cksum_valid(net + sizeof(struct ip), icmp_len);
+}
+
+enum echo_status echo_parse(const unsigned char *frame, unsigned int len,
+                            unsigned int link_len, unsigned short protocol,
+                            int verify, struct echo_request *request)
+{
+        const unsigned char *net = frame + link_len;
+        unsigned int captured = len - link_len;
+        enum echo_status status;
+
+        if (len < link_len)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+
+        request->link_len = link_len;
+        if (protocol == ETHERTYPE_IP)
+        {
+                request->ipv6 = 0;
+                status = get_echo_request4(net, captured, request);
+                if (status == ECHO_NOT_REQUEST)
+                {
+                        return status;
+                }
+                if (verify && !is_cksum_valid(net, request->ip_hdr_len))
+                {
+                        return ECHO_BAD_CKSUM;
+                }
+        }
+        else if (protocol == ETHERTYPE_IPV6)
+        {
+                request->ipv6 = 1;
+                status = get_echo_request6(net, captured, request);
+        }
+        else
+        {
+                return ECHO_NOT_REQUEST;
+        }
+        if (status != ECHO_REPLY)
+        {
+                return status;
+        }
+
+        /* The reply has the fixed IP header only. */
+        request->reply_len = link_len + request->icmp_len +
+                (request->ipv6 ? sizeof(struct ip6_hdr) : sizeof(struct ip));
+
+        return ECHO_REPLY;
+}
+
+enum echo_status echo_build(const unsigned char *frame,
+                            const struct echo_request *request,
+                            unsigned char *out, int verify)
+{
+        const unsigned char *icmp_in = frame + request->link_len +
+                request->ip_hdr_len;
+        unsigned int hdr_len = request->reply_len - request->icmp_len;
+        uint64_t sum = 0;
+
+        /* The frame is copied once and turned into the reply in out. IP
+         * options and extension headers are left out on the way. When
+         * verifying, the ICMP checksum of the request is summed on the
+         * way too.
+         */
+        memcpy(out, frame, hdr_len);
+        if (!verify)
+        {
+                memcpy(out + hdr_len, icmp_in, request->icmp_len);
+        }
+        else
+        {
+                if (request->ipv6)
+                {
+                        sum = add_pseudo_header6(
+                                (const struct ip6_hdr *)(frame +
+                                                         request->link_len),
+                                request->icmp_len);
+                }
+                sum += (uint16_t)~cksum_copy(out + hdr_len, icmp_in,
+                                             request->icmp_len);
+                if (cksum_finish(sum) != 0)
+                {
+                        return ECHO_BAD_CKSUM;
+                }
+        }
+
+        if (request->ipv6)
+        {
+                make_reply6(out, request->link_len, request->icmp_len);
+        }
+        else
+        {
+                make_reply4(out, request->link_len, request->icmp_len);
+        }
+        if (verify && !is_reply_cksum_valid(out + request->link_len,
+                                            request->ipv6,
+                                            request->icmp_len))
+        {
+                return ECHO_REPLY_MISMATCH;
+        }
+
+        return ECHO_REPLY;
+}
+
+/* A fragment is the link layer and fixed IP header of the reply, a
+ * fragment header for IPv6, and a multiple of 8 bytes of the ICMP
+ * message, or what is left of it in the last fragment.
+ */
+unsigned int echo_fragment(const unsigned char *reply,
+                           const struct echo_request *request,
+                           unsigned int offset, uint32_t id,
+                           unsigned char *out, unsigned int max_len,
+                           unsigned int *out_len)
+{
+        unsigned int hdr_len = request->reply_len - request->icmp_len;
+        unsigned int frag_hdr_len = request->ipv6 ? sizeof(struct ip6_frag) :
+                0;
+        unsigned int data_len = request->icmp_len - offset;
+        unsigned int room;
+        struct ip *ip_hdr;
+        struct ip6_hdr *ip6_hdr;
+        struct ip6_frag *frag_hdr;
+        int more = 0;
+
+        if (max_len < hdr_len + frag_hdr_len + 8)
+        {
+                return 0;
+        }
+        room = (max_len - hdr_len - frag_hdr_len) & ~7U;
+        if (data_len > room)
+        {
+                data_len = room;
+                more = 1;
+        }
+
+        memcpy(out, reply, hdr_len);
+        memcpy(out + hdr_len + frag_hdr_len,
+               reply + hdr_len + offset, data_len);
+        if (request->ipv6)
+        {
+                ip6_hdr = (struct ip6_hdr *)(out + request->link_len);
+                frag_hdr = (struct ip6_frag *)(ip6_hdr + 1);
+                ip6_hdr->ip6_plen = htons(frag_hdr_len + data_len);
+                ip6_hdr->ip6_nxt = IPPROTO_FRAGMENT;
+                frag_hdr->ip6f_nxt = IPPROTO_ICMPV6;
+                frag_hdr->ip6f_reserved = 0;
+                frag_hdr->ip6f_offlg = htons(offset) |
+                        (more ? IP6F_MORE_FRAG : 0);
+                frag_hdr->ip6f_ident = htonl(id);
+        }
+        else
+        {
+                ip_hdr = (struct ip *)(out + request->link_len);
+                ip_hdr->ip_len = htons(sizeof(struct ip) + data_len);
+                ip_hdr->ip_id = htons(id);
+                ip_hdr->ip_off = htons((offset / 8) | (more ? IP_MF : 0));
+                ip_hdr->ip_sum = 0;
+                ip_hdr->ip_sum = cksum(ip_hdr, sizeof(struct ip));
+        }
+        *out_len = hdr_len + frag_hdr_len + data_len;
+
+        return data_len;
+}
+
+enum echo_status echo_reply(const unsigned char *frame, unsigned int len,
+                            unsigned char *out, unsigned int max_len,
+                            int verify, unsigned int *out_len)
+{
+        const struct ether_header *eth_hdr;
+        struct echo_request request;
+        enum echo_status status;
+
+        if (len < ETH_HLEN)
+        {
+                return ECHO_NOT_REQUEST;
+        }
+
+        eth_hdr = (const struct ether_header *)frame;
+        status = echo_parse(frame, len, ETH_HLEN, ntohs(eth_hdr->ether_type),
+                            verify, &request);
+        if (status != ECHO_REPLY)
+        {
+                return status;
+        }
+        if (request.reply_len > max_len)
+        {
+                return ECHO_TOO_LARGE;
+        }
+        *out_len = request.reply_len;
+
+        return echo_build(frame, &request, out, verify);
+}
@@ -0,0 +1,85 @@
+#ifndef __ECHO_H_
+#define __ECHO_H_
+
+#include <stdint.h>
+
+#define ECHO_MAX_LINK_LEN 32
+#define ECHO_MAX_PACKET_LEN 65535
+/* A reply to the largest request there can be, reassembled or not. */
+#define ECHO_MAX_REPLY_LEN (ECHO_MAX_LINK_LEN + 40 + ECHO_MAX_PACKET_LEN)
+/* Every IPv4 link carries 576 bytes, every IPv6 link 1280. */
+#define ECHO_MIN_MTU 576
+#define ECHO_MIN_MTU6 1280
+
+/* What became of a frame handed to the echo functions. */
+enum echo_status
+{
+        ECHO_REPLY,           /* The reply was written. */
+        ECHO_REPLY_MISMATCH,  /* The reply was written, but its incremental
+                               * checksum differs from a full one. */
+        ECHO_NOT_REQUEST,     /* No echo request, or one not to answer. */
+        ECHO_BAD_CKSUM,       /* A request with a bad checksum. */
+        ECHO_FRAGMENT,        /* A fragment, to be reassembled first. */
+        ECHO_TOO_LARGE        /* The reply does not fit the buffer. */
+};
+
+/* Where the ICMP message of an echo request lies in its frame. */
+struct echo_request
+{
+        int ipv6;
+        unsigned int link_len;    /* Link layer header. */
+        unsigned int ip_hdr_len;  /* Options or extension headers
+                                   * included. Of a fragment, up to its
+                                   * fragment header. */
+        unsigned int icmp_len;
+        unsigned int reply_len;   /* Link layer header included. */
+};
+
+/* Looks for an IPv4 or IPv6 echo request in frame, len bytes captured,
+ * with link_len bytes of link layer header before the packet of the
+ * given ethertype. Returns ECHO_REPLY and fills in request if it is one
+ * to answer, ECHO_NOT_REQUEST otherwise. An IPv4 or IPv6 fragment of an
+ * ICMP message is ECHO_FRAGMENT, with ipv6, link_len and ip_hdr_len
+ * filled in, and only known to be a request once reassembled. With
+ * verify the IPv4 header checksum is checked, ECHO_BAD_CKSUM if it is
+ * wrong. Touches nothing but request.
+ */
+extern enum echo_status echo_parse(const unsigned char *frame,
+                                   unsigned int len, unsigned int link_len,
+                                   unsigned short protocol, int verify,
+                                   struct echo_request *request);
+
+/* Writes the reply to the request parsed from frame into out, which
+ * must hold request->reply_len bytes. The addresses are swapped, IP
+ * options and extension headers left out, and the checksums updated
+ * from those of the request. With verify the ICMP checksum of the
+ * request is checked (ECHO_BAD_CKSUM) and the reply checksums are
+ * compared with a full computation (ECHO_REPLY_MISMATCH).
+ */
+extern enum echo_status echo_build(const unsigned char *frame,
+                                   const struct echo_request *request,
+                                   unsigned char *out, int verify);
+
+/* Writes the fragment of a reply built by echo_build into reply that
+ * starts offset bytes into its ICMP message into out, of up to max_len
+ * bytes, with id as the IP identification of all fragments of the
+ * reply. Returns the bytes of the ICMP message that went into it, 0 if
+ * max_len leaves no room, and stores the length of the fragment in
+ * out_len.
+ */
+extern unsigned int echo_fragment(const unsigned char *reply,
+                                  const struct echo_request *request,
+                                  unsigned int offset, uint32_t id,
+                                  unsigned char *out, unsigned int max_len,
+                                  unsigned int *out_len);
+
+/* Both of echo_parse and echo_build, from an Ethernet frame to its
+ * reply frame in out, of up to max_len bytes. The length of the reply is
+ * stored in out_len. Fragments are not reassembled here.
+ */
+extern enum echo_status echo_reply(const unsigned char *frame,
+                                   unsigned int len, unsigned char *out,
+                                   unsigned int max_len, int verify,
+                                   unsigned int *out_len);
+
+#endif
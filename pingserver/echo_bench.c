@@ -0,0 +1,642 @@
+/* This is an offline benchmark of the per-packet work of the ping
+ * server, the frame to frame function of echo.c, without root, sockets
+ * or live traffic.
+ *
+ * A pcap file of Ethernet frames is mapped into memory and every frame
+ * in it is run through echo_reply() in a tight loop, pass after pass,
+ * the way the server runs the frames of a ring block. The time per frame
+ * and the frames per second are printed, with how many frames were
+ * answered, not answered and why. With -o the replies of the first pass
+ * are written to a pcap file with the timestamps of their requests, to
+ * be checked with any pcap reader.
+ *
+ * With -g the program instead writes a small pcap of mixed traffic to
+ * benchmark with: echo requests of both families in several sizes, with
+ * IP options and extension headers, next to TCP, UDP, ARP, a request
+ * with a bad checksum and one cut short of its ICMP header, padded to
+ * the smallest Ethernet frame.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <net/ethernet.h>
+#include <netinet/icmp6.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cksum.h"
+#include "echo.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_SNAPLEN 65535
+#define MAX_FRAME_LEN 65536
+#define DEFAULT_PASSES 1000
+#define NS_PER_SEC 1000000000.0
+#define NUM_STATUSES (ECHO_TOO_LARGE + 1)
+
+struct pcap_file_header
+{
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t linktype;
+};
+
+struct pcap_record_header
+{
+        uint32_t ts_sec;
+        uint32_t ts_frac;  /* Microseconds, or nanoseconds. */
+        uint32_t caplen;
+        uint32_t len;
+};
+
+/* A frame of the mapped file. */
+struct frame
+{
+        const unsigned char *data;
+        unsigned int len;
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+};
+
+static const char *status_names[NUM_STATUSES] = {
+        "answered",
+        "answered, checksum mismatch",
+        "not an echo request",
+        "bad checksum",
+        "fragment, not reassembled",
+        "too large"
+};
+
+static unsigned char out[MAX_FRAME_LEN];
+
+static void print_syntax(void)
+{
+        printf("SYNTAX:  echo_bench [-n passes] [-o replies.pcap] [-V] "
+               "file.pcap\n");
+        printf("         echo_bench -g file.pcap\n\n");
+        printf("  -n  Times every frame is run through (default %d).\n",
+               DEFAULT_PASSES);
+        printf("  -o  Write the replies to this pcap file.\n");
+        printf("  -V  Verify the checksums of requests and replies.\n");
+        printf("  -g  Write a pcap file of mixed traffic and exit.\n");
+}
+
+static double now_sec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / NS_PER_SEC;
+}
+
+static uint32_t swap32(uint32_t x)
+{
+        return __builtin_bswap32(x);
+}
+
+static int write_file_header(FILE *file)
+{
+        struct pcap_file_header header;
+
+        memset(&header, 0, sizeof(header));
+        header.magic = PCAP_MAGIC;
+        header.version_major = 2;
+        header.version_minor = 4;
+        header.snaplen = PCAP_SNAPLEN;
+        header.linktype = PCAP_LINKTYPE_ETHERNET;
+
+        return fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : __LINE__;
+}
+
+static int write_record(FILE *file, uint32_t ts_sec, uint32_t ts_usec,
+                        const unsigned char *data, unsigned int len)
+{
+        struct pcap_record_header record;
+
+        record.ts_sec = ts_sec;
+        record.ts_frac = ts_usec;
+        record.caplen = len;
+        record.len = len;
+        if (fwrite(&record, sizeof(record), 1, file) != 1 ||
+            fwrite(data, len, 1, file) != 1)
+        {
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+/* Maps the pcap file at path and indexes its frames, with their
+ * timestamps in microseconds. The byte order of the file is taken from
+ * its magic number.
+ */
+static struct frame *map_pcap(const char *path, unsigned int *num_frames)
+{
+        const struct pcap_file_header *header;
+        const struct pcap_record_header *record;
+        const unsigned char *map;
+        struct frame *frames = NULL;
+        struct stat st;
+        size_t offset;
+        unsigned int count = 0;
+        unsigned int capacity = 0;
+        uint32_t caplen;
+        int ns_timestamps;
+        int swapped;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+                perror(path);
+                return NULL;
+        }
+        if ((size_t)st.st_size < sizeof(*header))
+        {
+                fprintf(stderr, "%s: not a pcap file.\n", path);
+                return NULL;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                   fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+        {
+                perror("mmap");
+                return NULL;
+        }
+
+        header = (const struct pcap_file_header *)map;
+        swapped = header->magic == swap32(PCAP_MAGIC) ||
+                header->magic == swap32(PCAP_MAGIC_NS);
+        ns_timestamps = header->magic == PCAP_MAGIC_NS ||
+                header->magic == swap32(PCAP_MAGIC_NS);
+        if (!swapped && header->magic != PCAP_MAGIC &&
+            header->magic != PCAP_MAGIC_NS)
+        {
+                fprintf(stderr, "%s: not a pcap file.\n", path);
+                return NULL;
+        }
+        if ((swapped ? swap32(header->linktype) : header->linktype) !=
+            PCAP_LINKTYPE_ETHERNET)
+        {
+                fprintf(stderr, "%s: only Ethernet captures are "
+                        "supported.\n", path);
+                return NULL;
+        }
+
+        offset = sizeof(*header);
+        while (offset + sizeof(*record) <= (size_t)st.st_size)
+        {
+                record = (const struct pcap_record_header *)(map + offset);
+                caplen = swapped ? swap32(record->caplen) : record->caplen;
+                offset += sizeof(*record);
+                if (caplen > MAX_FRAME_LEN ||
+                    offset + caplen > (size_t)st.st_size)
+                {
+                        fprintf(stderr, "%s: truncated at frame %u.\n",
+                                path, count);
+                        break;
+                }
+
+                if (count == capacity)
+                {
+                        capacity = capacity ? 2 * capacity : 1024;
+                        frames = realloc(frames, capacity * sizeof(*frames));
+                        if (frames == NULL)
+                        {
+                                perror("realloc");
+                                return NULL;
+                        }
+                }
+                frames[count].data = map + offset;
+                frames[count].len = caplen;
+                frames[count].ts_sec = swapped ? swap32(record->ts_sec) :
+                        record->ts_sec;
+                frames[count].ts_usec = swapped ? swap32(record->ts_frac) :
+                        record->ts_frac;
+                if (ns_timestamps)
+                {
+                        frames[count].ts_usec /= 1000;
+                }
+                count++;
+                offset += caplen;
+        }
+
+        *num_frames = count;
+
+        return frames;
+}
+
+/* Writes the reply of every frame, once, to path. */
+static int write_replies(const char *path, const struct frame *frames,
+                         unsigned int num_frames, int verify)
+{
+        unsigned int out_len;
+        unsigned int i;
+        FILE *file;
+
+        file = fopen(path, "w");
+        if (file == NULL)
+        {
+                perror(path);
+                return __LINE__;
+        }
+        if (write_file_header(file) != 0)
+        {
+                perror(path);
+                fclose(file);
+                return __LINE__;
+        }
+
+        for (i = 0; i < num_frames; i++)
+        {
+                if (echo_reply(frames[i].data, frames[i].len, out,
+                               sizeof(out), verify, &out_len) != ECHO_REPLY)
+                {
+                        continue;
+                }
+                if (write_record(file, frames[i].ts_sec, frames[i].ts_usec,
+                                 out, out_len) != 0)
+                {
+                        perror(path);
+                        fclose(file);
+                        return __LINE__;
+                }
+        }
+
+        return fclose(file) == 0 ? 0 : __LINE__;
+}
+
+static int run(const char *path, unsigned int passes, const char *out_path,
+               int verify)
+{
+        unsigned long long counts[NUM_STATUSES];
+        unsigned long long total;
+        unsigned long long sink = 0;
+        struct frame *frames;
+        unsigned int num_frames;
+        unsigned int out_len = 0;
+        unsigned int pass;
+        unsigned int i;
+        double elapsed;
+        double start;
+
+        frames = map_pcap(path, &num_frames);
+        if (frames == NULL)
+        {
+                return __LINE__;
+        }
+        if (num_frames == 0)
+        {
+                fprintf(stderr, "%s: no frames.\n", path);
+                return __LINE__;
+        }
+
+        memset(counts, 0, sizeof(counts));
+        start = now_sec();
+        for (pass = 0; pass < passes; pass++)
+        {
+                for (i = 0; i < num_frames; i++)
+                {
+                        counts[echo_reply(frames[i].data, frames[i].len, out,
+                                          sizeof(out), verify,
+                                          &out_len)]++;
+                        sink += out_len;
+                }
+        }
+        elapsed = now_sec() - start;
+        total = (unsigned long long)passes * num_frames;
+
+        printf("%u frames, %u passes, %s.\n", num_frames, passes,
+               verify ? "verifying checksums" : "incremental checksums");
+        for (i = 0; i < NUM_STATUSES; i++)
+        {
+                if (counts[i] > 0)
+                {
+                        printf("  %-28s %llu\n", status_names[i],
+                               counts[i] / passes);
+                }
+        }
+        printf("%.1f ns/frame, %.2f Mframes/s.\n", elapsed * 1e9 / total,
+               total / elapsed / 1e6);
+
+        if (out_path != NULL &&
+            write_replies(out_path, frames, num_frames, verify) != 0)
+        {
+                return __LINE__;
+        }
+
+        return (sink == 42) ? __LINE__ : 0;
+}
+
+/* Builders of the frames of the generated mix. */
+
+static const unsigned char client_mac[ETH_ALEN] = {
+        0x02, 0x00, 0x00, 0x00, 0x00, 0x01
+};
+static const unsigned char server_mac[ETH_ALEN] = {
+        0x02, 0x00, 0x00, 0x00, 0x00, 0x02
+};
+
+static unsigned int put_eth(unsigned char *frame, unsigned short type)
+{
+        struct ether_header *eth_hdr = (struct ether_header *)frame;
+
+        memcpy(eth_hdr->ether_dhost, server_mac, ETH_ALEN);
+        memcpy(eth_hdr->ether_shost, client_mac, ETH_ALEN);
+        eth_hdr->ether_type = htons(type);
+
+        return ETH_HLEN;
+}
+
+/* An IPv4 packet of protocol with num_options words of NOP options and
+ * payload_len bytes of payload, of which the first header_len are
+ * copied from header. Returns the frame length.
+ */
+static unsigned int put_ipv4(unsigned char *frame, int protocol,
+                             unsigned int num_options, const void *header,
+                             unsigned int header_len,
+                             unsigned int payload_len)
+{
+        struct ip *ip_hdr;
+        unsigned int ip_hdr_len = sizeof(struct ip) + 4 * num_options;
+        unsigned int link_len = put_eth(frame, ETHERTYPE_IP);
+        unsigned int i;
+
+        ip_hdr = (struct ip *)(frame + link_len);
+        memset(ip_hdr, 0, sizeof(*ip_hdr));
+        ip_hdr->ip_v = 4;
+        ip_hdr->ip_hl = ip_hdr_len / 4;
+        ip_hdr->ip_len = htons(ip_hdr_len + payload_len);
+        ip_hdr->ip_id = htons(0x1234);
+        ip_hdr->ip_ttl = 64;
+        ip_hdr->ip_p = protocol;
+        inet_pton(AF_INET, "192.0.2.1", &ip_hdr->ip_src);
+        inet_pton(AF_INET, "192.0.2.2", &ip_hdr->ip_dst);
+        memset(ip_hdr + 1, IPOPT_NOP, 4 * num_options);
+        ip_hdr->ip_sum = cksum(ip_hdr, ip_hdr_len);
+
+        memcpy((unsigned char *)ip_hdr + ip_hdr_len, header, header_len);
+        for (i = header_len; i < payload_len; i++)
+        {
+                frame[link_len + ip_hdr_len + i] = i;
+        }
+
+        return link_len + ip_hdr_len + payload_len;
+}
+
+static unsigned int put_echo4(unsigned char *frame, unsigned int num_options,
+                              unsigned int icmp_len, int bad_cksum)
+{
+        struct icmp *icmp_hdr;
+        struct icmp header;
+        unsigned int len;
+
+        memset(&header, 0, sizeof(header));
+        header.icmp_type = ICMP_ECHO;
+        header.icmp_id = htons(0x4242);
+        header.icmp_seq = htons(1);
+        len = put_ipv4(frame, IPPROTO_ICMP, num_options, &header,
+                       ICMP_MINLEN, icmp_len);
+
+        icmp_hdr = (struct icmp *)(frame + len - icmp_len);
+        icmp_hdr->icmp_cksum = cksum(icmp_hdr, icmp_len) ^ bad_cksum;
+
+        return len;
+}
+
+/* An ICMPv6 echo request of icmp_len bytes, behind a hop-by-hop options
+ * header if with_hop_by_hop.
+ */
+static unsigned int put_echo6(unsigned char *frame, int with_hop_by_hop,
+                              unsigned int icmp_len)
+{
+        static const unsigned char hop_by_hop[8] = {
+                IPPROTO_ICMPV6, 0, 1, 4, 0, 0, 0, 0  /* PadN. */
+        };
+        struct ip6_hdr *ip6_hdr;
+        struct icmp6_hdr *icmp6_hdr;
+        unsigned int ext_len = with_hop_by_hop ? sizeof(hop_by_hop) : 0;
+        unsigned int link_len = put_eth(frame, ETHERTYPE_IPV6);
+        struct
+        {
+                struct in6_addr src;
+                struct in6_addr dst;
+                uint32_t len;
+                uint8_t zero[3];
+                uint8_t next;
+        } pseudo;
+        uint64_t sum;
+        unsigned int i;
+
+        ip6_hdr = (struct ip6_hdr *)(frame + link_len);
+        memset(ip6_hdr, 0, sizeof(*ip6_hdr));
+        ip6_hdr->ip6_flow = htonl(6 << 28);
+        ip6_hdr->ip6_plen = htons(ext_len + icmp_len);
+        ip6_hdr->ip6_nxt = with_hop_by_hop ? IPPROTO_HOPOPTS : IPPROTO_ICMPV6;
+        ip6_hdr->ip6_hlim = 64;
+        inet_pton(AF_INET6, "2001:db8::1", &ip6_hdr->ip6_src);
+        inet_pton(AF_INET6, "2001:db8::2", &ip6_hdr->ip6_dst);
+        memcpy(ip6_hdr + 1, hop_by_hop, ext_len);
+
+        icmp6_hdr = (struct icmp6_hdr *)((unsigned char *)(ip6_hdr + 1) +
+                                         ext_len);
+        memset(icmp6_hdr, 0, sizeof(*icmp6_hdr));
+        icmp6_hdr->icmp6_type = ICMP6_ECHO_REQUEST;
+        icmp6_hdr->icmp6_id = htons(0x4242);
+        icmp6_hdr->icmp6_seq = htons(1);
+        for (i = sizeof(*icmp6_hdr); i < icmp_len; i++)
+        {
+                ((unsigned char *)icmp6_hdr)[i] = i;
+        }
+
+        memset(&pseudo, 0, sizeof(pseudo));
+        pseudo.src = ip6_hdr->ip6_src;
+        pseudo.dst = ip6_hdr->ip6_dst;
+        pseudo.len = htonl(icmp_len);
+        pseudo.next = IPPROTO_ICMPV6;
+        sum = cksum_add(cksum_add(0, &pseudo, sizeof(pseudo)), icmp6_hdr,
+                        icmp_len);
+        icmp6_hdr->icmp6_cksum = cksum_finish(sum);
+
+        return link_len + sizeof(*ip6_hdr) + ext_len + icmp_len;
+}
+
+/* An echo request whose IP length ends 4 bytes into the ICMP header,
+ * padded by the link to the smallest Ethernet frame.
+ */
+static unsigned int put_runt4(unsigned char *frame)
+{
+        struct icmp header;
+        unsigned int len;
+
+        memset(&header, 0, sizeof(header));
+        header.icmp_type = ICMP_ECHO;
+        len = put_ipv4(frame, IPPROTO_ICMP, 0, &header, 4, 4);
+        memset(frame + len, 0, ETH_ZLEN - len);
+
+        return ETH_ZLEN;
+}
+
+static unsigned int put_arp(unsigned char *frame)
+{
+        unsigned int len = put_eth(frame, ETHERTYPE_ARP);
+
+        memset(frame + len, 0, 28);
+
+        return len + 28;
+}
+
+static int generate(const char *path)
+{
+        static const unsigned char tcp_syn[20] = {
+                0xc0, 0x00, 0x00, 0x50, 0, 0, 0, 1, 0, 0, 0, 0, 0x50, 0x02
+        };
+        static const unsigned char udp_dns[8] = {
+                0xc0, 0x00, 0x00, 0x35, 0x00, 0x28
+        };
+        unsigned char frame[2048];
+        unsigned int len;
+        unsigned int i;
+        FILE *file;
+        int status = 0;
+
+        file = fopen(path, "w");
+        if (file == NULL)
+        {
+                perror(path);
+                return __LINE__;
+        }
+        status = write_file_header(file);
+
+        /* Mostly plain echo requests of the common sizes, as after the
+         * filter of the server, with the odd frame it has to skip.
+         */
+        for (i = 0; i < 64 && status == 0; i++)
+        {
+                switch (i % 16)
+                {
+                case 0:
+                case 1:
+                case 2:
+                case 3:
+                        len = put_echo4(frame, 0, 64, 0);
+                        break;
+                case 4:
+                case 5:
+                        len = put_echo4(frame, 0, 1008, 0);
+                        break;
+                case 6:
+                        len = put_echo4(frame, 0, 1472, 0);
+                        break;
+                case 7:
+                        len = put_echo4(frame, 3, 64, 0);
+                        break;
+                case 8:
+                case 9:
+                case 10:
+                        len = put_echo6(frame, 0, 64);
+                        break;
+                case 11:
+                        len = put_echo6(frame, 0, 1232);
+                        break;
+                case 12:
+                        len = put_echo6(frame, 1, 64);
+                        break;
+                case 13:
+                        len = put_ipv4(frame, IPPROTO_TCP, 0, tcp_syn,
+                                       sizeof(tcp_syn), sizeof(tcp_syn));
+                        break;
+                case 14:
+                        len = (i % 32 == 14) ?
+                                put_ipv4(frame, IPPROTO_UDP, 0, udp_dns,
+                                         sizeof(udp_dns), 40) :
+                                put_arp(frame);
+                        break;
+                default:
+                        len = (i % 32 == 15) ? put_echo4(frame, 0, 64, 1) :
+                                put_runt4(frame);
+                        break;
+                }
+                status = write_record(file, 1, i * 1000, frame, len);
+        }
+
+        if (status != 0)
+        {
+                perror(path);
+        }
+        if (fclose(file) != 0 && status == 0)
+        {
+                perror(path);
+                status = __LINE__;
+        }
+
+        return status;
+}
+
+int main(int argc, char **argv)
+{
+        unsigned int passes = DEFAULT_PASSES;
+        const char *out_path = NULL;
+        int do_generate = 0;
+        int verify = 0;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:o:Vg")) != -1)
+        {
+                switch (opt)
+                {
+                case 'n':
+                        passes = strtoul(optarg, NULL, 0);
+                        if (passes == 0)
+                        {
+                                print_syntax();
+                                return 1;
+                        }
+                        break;
+                case 'o':
+                        out_path = optarg;
+                        break;
+                case 'V':
+                        verify = 1;
+                        break;
+                case 'g':
+                        do_generate = 1;
+                        break;
+                default:
+                        print_syntax();
+                        return 1;
+                }
+        }
+
+        if (optind != argc - 1)
+        {
+                print_syntax();
+                return 1;
+        }
+
+        if (do_generate)
+        {
+                return generate(argv[optind]);
+        }
+
+        return run(argv[optind], passes, out_path, verify);
+}
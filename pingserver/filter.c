@@ -0,0 +1,218 @@
+/* This file implements the in-kernel packet filter of the ping server.
+ *
+ * The AF_PACKET socket sees all traffic of the host. A classic BPF
+ * program attached with SO_ATTACH_FILTER runs on every frame in the
+ * kernel, before the frame is copied into the ring, and lets through
+ * only incoming IPv4 ICMP echo requests and ICMPv6 echo requests, and
+ * the fragments that may be part of one:
+ *
+ *         ld   pkttype              ; Not our own frames going out.
+ *         jeq  #PACKET_OUTGOING, drop
+ *         ldh  [12]                 ; Ethertype.
+ *         jne  #ETHERTYPE_IP, ipv6
+ *         ldb  [14]                 ; Version.
+ *         and  #0xf0
+ *         jne  #0x40, drop
+ *         ldb  [23]                 ; Protocol.
+ *         jne  #IPPROTO_ICMP, drop
+ *         ld   [30]                 ; Destination, when asked for.
+ *         jne  #dst, drop
+ *         ldh  [20]                 ; Only the first fragment has the
+ *         jset #0x1fff, accept4     ; ICMP header, the rest are
+ *         ldxb 4*([14]&0xf)         ; reassembled in user space.
+ *         ldb  [x+14]               ; ICMP type, after the options.
+ *         jne  #ICMP_ECHO, drop
+ *accept4: ret  #0xffffffff
+ *   ipv6: jne  #ETHERTYPE_IPV6, drop
+ *         ldb  [14]                 ; Version.
+ *         and  #0xf0
+ *         jne  #0x60, drop
+ *         ld   [38] ... ld [50]     ; Destination, when asked for.
+ *         jne  #dst6[0..3], drop
+ *         ldb  [20]                 ; Next header. Extension headers
+ *         jeq  #IPPROTO_HOPOPTS, accept ; are walked, and fragments
+ *         jeq  #IPPROTO_ROUTING, accept ; reassembled, in user space.
+ *         jeq  #IPPROTO_DSTOPTS, accept
+ *         jeq  #IPPROTO_FRAGMENT, accept
+ *         jne  #IPPROTO_ICMPV6, drop
+ *         ldb  [54]                 ; ICMPv6 type.
+ *         jne  #ICMP6_ECHO_REQUEST, drop
+ * accept: ret  #0xffffffff
+ *   drop: ret  #0
+ *
+ * When only an address of one family is given, the other family is
+ * dropped altogether.
+ */
+
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "filter.h"
+
+#define ETH_HDR_LEN 14
+#define IP_OFF(field) (ETH_HDR_LEN + (field))
+#define IP6_OFF(field) (ETH_HDR_LEN + (field))
+#define ICMP6_TYPE_OFF (ETH_HDR_LEN + sizeof(struct ip6_hdr))
+
+/* Jump targets patched once the target is in place. */
+#define JUMP_TO_DROP 0xff
+#define JUMP_TO_ACCEPT 0xfe
+#define JUMP_TO_IPV6 0xfd
+
+static void emit(struct filter *filter, unsigned short code,
+                 unsigned char jt, unsigned char jf, unsigned int k)
+{
+        struct sock_filter *insn = &filter->insns[filter->prog.len++];
+
+        insn->code = code;
+        insn->jt = jt;
+        insn->jf = jf;
+        insn->k = k;
+}
+
+/* Continues when A == k, otherwise drops. */
+static void emit_drop_unless(struct filter *filter, unsigned int k)
+{
+        emit(filter, BPF_JMP | BPF_JEQ | BPF_K, 0, JUMP_TO_DROP, k);
+}
+
+/* Points the jumps to label, before target, at target. */
+static void patch_jumps(struct filter *filter, unsigned char label,
+                        unsigned int target)
+{
+        struct sock_filter *insn;
+        unsigned int i;
+
+        for (i = 0; i < target; i++)
+        {
+                insn = &filter->insns[i];
+                if (BPF_CLASS(insn->code) != BPF_JMP)
+                {
+                        continue;
+                }
+                if (insn->jt == label)
+                {
+                        insn->jt = target - i - 1;
+                }
+                if (insn->jf == label)
+                {
+                        insn->jf = target - i - 1;
+                }
+        }
+}
+
+static void emit_ipv4(struct filter *filter, const struct in_addr *dst)
+{
+        emit(filter, BPF_LD | BPF_B | BPF_ABS, 0, 0, IP_OFF(0));
+        emit(filter, BPF_ALU | BPF_AND | BPF_K, 0, 0, 0xf0);
+        emit_drop_unless(filter, 0x40);
+
+        emit(filter, BPF_LD | BPF_B | BPF_ABS, 0, 0,
+             IP_OFF(offsetof(struct ip, ip_p)));
+        emit_drop_unless(filter, IPPROTO_ICMP);
+
+        if (dst != NULL)
+        {
+                emit(filter, BPF_LD | BPF_W | BPF_ABS, 0, 0,
+                     IP_OFF(offsetof(struct ip, ip_dst)));
+                emit_drop_unless(filter, ntohl(dst->s_addr));
+        }
+
+        emit(filter, BPF_LD | BPF_H | BPF_ABS, 0, 0,
+             IP_OFF(offsetof(struct ip, ip_off)));
+        emit(filter, BPF_JMP | BPF_JSET | BPF_K, JUMP_TO_ACCEPT, 0,
+             IP_OFFMASK);
+
+        /* X = the IP header length, so that options are skipped. */
+        emit(filter, BPF_LDX | BPF_B | BPF_MSH, 0, 0, IP_OFF(0));
+        emit(filter, BPF_LD | BPF_B | BPF_IND, 0, 0,
+             IP_OFF(offsetof(struct icmp, icmp_type)));
+        emit_drop_unless(filter, ICMP_ECHO);
+
+        patch_jumps(filter, JUMP_TO_ACCEPT, filter->prog.len);
+        emit(filter, BPF_RET | BPF_K, 0, 0, 0xffffffff);
+}
+
+static void emit_ipv6(struct filter *filter, const struct in6_addr *dst6)
+{
+        uint32_t word;
+        unsigned int i;
+
+        emit(filter, BPF_LD | BPF_B | BPF_ABS, 0, 0, IP6_OFF(0));
+        emit(filter, BPF_ALU | BPF_AND | BPF_K, 0, 0, 0xf0);
+        emit_drop_unless(filter, 0x60);
+
+        if (dst6 != NULL)
+        {
+                for (i = 0; i < 4; i++)
+                {
+                        memcpy(&word, &dst6->s6_addr[4 * i], sizeof(word));
+                        emit(filter, BPF_LD | BPF_W | BPF_ABS, 0, 0,
+                             IP6_OFF(offsetof(struct ip6_hdr, ip6_dst)) +
+                             4 * i);
+                        emit_drop_unless(filter, ntohl(word));
+                }
+        }
+
+        emit(filter, BPF_LD | BPF_B | BPF_ABS, 0, 0,
+             IP6_OFF(offsetof(struct ip6_hdr, ip6_nxt)));
+        emit(filter, BPF_JMP | BPF_JEQ | BPF_K, JUMP_TO_ACCEPT, 0,
+             IPPROTO_HOPOPTS);
+        emit(filter, BPF_JMP | BPF_JEQ | BPF_K, JUMP_TO_ACCEPT, 0,
+             IPPROTO_ROUTING);
+        emit(filter, BPF_JMP | BPF_JEQ | BPF_K, JUMP_TO_ACCEPT, 0,
+             IPPROTO_DSTOPTS);
+        emit(filter, BPF_JMP | BPF_JEQ | BPF_K, JUMP_TO_ACCEPT, 0,
+             IPPROTO_FRAGMENT);
+        emit_drop_unless(filter, IPPROTO_ICMPV6);
+
+        emit(filter, BPF_LD | BPF_B | BPF_ABS, 0, 0, ICMP6_TYPE_OFF);
+        emit_drop_unless(filter, ICMP6_ECHO_REQUEST);
+
+        patch_jumps(filter, JUMP_TO_ACCEPT, filter->prog.len);
+        emit(filter, BPF_RET | BPF_K, 0, 0, 0xffffffff);
+}
+
+void filter_icmp_echo(struct filter *filter, const struct in_addr *dst,
+                      const struct in6_addr *dst6)
+{
+        int any_dst = dst != NULL || dst6 != NULL;
+
+        memset(filter, 0, sizeof(*filter));
+        filter->prog.filter = filter->insns;
+
+        emit(filter, BPF_LD | BPF_W | BPF_ABS, 0, 0,
+             SKF_AD_OFF + SKF_AD_PKTTYPE);
+        emit(filter, BPF_JMP | BPF_JEQ | BPF_K, JUMP_TO_DROP, 0,
+             PACKET_OUTGOING);
+
+        emit(filter, BPF_LD | BPF_H | BPF_ABS, 0, 0, 12);
+        emit(filter, BPF_JMP | BPF_JEQ | BPF_K, 0, JUMP_TO_IPV6,
+             ETHERTYPE_IP);
+        if (!any_dst || dst != NULL)
+        {
+                emit_ipv4(filter, dst);
+        }
+        else
+        {
+                emit(filter, BPF_RET | BPF_K, 0, 0, 0);
+        }
+
+        /* A still holds the ethertype. */
+        patch_jumps(filter, JUMP_TO_IPV6, filter->prog.len);
+        emit_drop_unless(filter, ETHERTYPE_IPV6);
+        if (!any_dst || dst6 != NULL)
+        {
+                emit_ipv6(filter, dst6);
+        }
+
+        patch_jumps(filter, JUMP_TO_DROP, filter->prog.len);
+        emit(filter, BPF_RET | BPF_K, 0, 0, 0);
+}
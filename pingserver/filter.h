@@ -0,0 +1,24 @@
+#ifndef __FILTER_H_
+#define __FILTER_H_
+
+#include <linux/filter.h>
+#include <netinet/in.h>
+
+#define FILTER_MAX_INSNS 64
+
+/* A classic BPF program together with the descriptor that attaches it. */
+struct filter
+{
+        struct sock_filter insns[FILTER_MAX_INSNS];
+        struct sock_fprog prog;
+};
+
+/* Builds a filter for AF_PACKET sockets on Ethernet (and loopback) that
+ * accepts only incoming IPv4 ICMP echo requests and ICMPv6 echo requests,
+ * the latter also behind extension headers. With dst or dst6 not NULL
+ * only requests sent to those addresses are accepted.
+ */
+extern void filter_icmp_echo(struct filter *filter, const struct in_addr *dst,
+                             const struct in6_addr *dst6);
+
+#endif
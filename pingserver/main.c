@@ -1,11 +1,196 @@
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "pingserver.h"
+#include "stats.h"
+
+static void print_syntax(void)
+{
+        printf("SYNTAX:  pingserver [-B block-size] [-N block-count] "
+               "[-T timeout-ms] [-d address] [-V]\n"
+               "                    [-j workers] [-F hash|cpu|rollover] "
+               "[-a first-cpu]\n"
+               "                    [-S stats-path] [-r rate] [-b burst] "
+               "[-R cap]\n"
+               "                    [-M reassembly-bytes] "
+               "[-W reassembly-timeout-ms]\n\n");
+        printf("  -B  Bytes per receive ring block, a power of two of "
+               "pages (default %d).\n", PKTRING_DEFAULT_BLOCK_SIZE);
+        printf("  -N  Blocks in the receive ring (default %d).\n",
+               PKTRING_DEFAULT_BLOCK_COUNT);
+        printf("  -T  Milliseconds before a block that is not full is "
+               "handed over (default %d).\n", PKTRING_DEFAULT_TIMEOUT_MS);
+        printf("  -d  Only answer requests to this IPv4 or IPv6 address, "
+               "give one of each\n"
+               "      to answer both families.\n");
+        printf("  -V  Verify request checksums, and check every "
+               "incremental reply checksum.\n");
+        printf("  -j  Worker threads, each with a socket of its own in one "
+               "fanout group (default 1).\n");
+        printf("  -F  How the kernel spreads the frames over the sockets: "
+               "by flow hash,\n"
+               "      by receiving CPU, or to the first one that is not "
+               "full (default hash).\n");
+        printf("  -a  Pin worker i to CPU first-cpu + i (default not "
+               "pinned).\n");
+        printf("  -r  Replies a second to one source address, IPv6 by "
+               "/64 (default no limit).\n"
+               "      The buckets are per worker, so with -j only -F hash "
+               "keeps a source\n"
+               "      on one of them. The addresses of a /64 may still be "
+               "spread.\n");
+        printf("  -b  Replies a source may get at once (default the "
+               "rate).\n");
+        printf("  -R  Replies a second to all sources together (default "
+               "no limit).\n");
+        printf("  -M  Bytes for reassembling fragmented requests, all "
+               "workers together,\n"
+               "      0 for none (default %d). Every worker reassembles "
+               "its own, so\n"
+               "      with -j only -F hash, or 0.\n", REASM_DEFAULT_MEMORY);
+        printf("  -W  Milliseconds a fragmented request may take to "
+               "arrive (default %d).\n", REASM_DEFAULT_TIMEOUT_MS);
+        printf("  -S  Where to keep the statistics segment for pingstat "
+               "(default\n      %s).\n", STATS_DEFAULT_PATH);
+}
+
+static int parse_fanout_mode(const char *name)
+{
+        if (strcmp(name, "hash") == 0)
+        {
+                return PACKET_FANOUT_HASH;
+        }
+        if (strcmp(name, "cpu") == 0)
+        {
+                return PACKET_FANOUT_CPU;
+        }
+        if (strcmp(name, "rollover") == 0)
+        {
+                return PACKET_FANOUT_ROLLOVER;
+        }
+
+        return -1;
+}
 
 int main(int argc, char **argv)
 {
-        (void)argc;
-        (void)argv;
-        
-        pingserver();
-        
-        return 0;
+        struct pingserver_config config;
+        int opt;
+
+        memset(&config, 0, sizeof(config));
+        config.ring.block_size = PKTRING_DEFAULT_BLOCK_SIZE;
+        config.ring.block_count = PKTRING_DEFAULT_BLOCK_COUNT;
+        config.ring.timeout_ms = PKTRING_DEFAULT_TIMEOUT_MS;
+        config.ring.tx_frames = PKTRING_DEFAULT_TX_FRAMES;
+        config.num_workers = 1;
+        config.first_cpu = -1;
+        config.fanout_mode = PACKET_FANOUT_HASH;
+        config.stats_path = STATS_DEFAULT_PATH;
+        config.limit.entries = RATELIMIT_DEFAULT_ENTRIES;
+        config.reasm.memory = REASM_DEFAULT_MEMORY;
+        config.reasm.timeout_ms = REASM_DEFAULT_TIMEOUT_MS;
+
+        while ((opt = getopt(argc, argv, "B:N:T:d:Vj:F:a:S:r:b:R:M:W:")) != -1)
+        {
+                switch (opt)
+                {
+                case 'B':
+                        config.ring.block_size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'N':
+                        config.ring.block_count = strtoul(optarg, NULL, 0);
+                        break;
+                case 'T':
+                        config.ring.timeout_ms = strtoul(optarg, NULL, 0);
+                        break;
+                case 'd':
+                        if (inet_pton(AF_INET, optarg, &config.dst) == 1)
+                        {
+                                config.filter_dst = 1;
+                        }
+                        else if (inet_pton(AF_INET6, optarg,
+                                           &config.dst6) == 1)
+                        {
+                                config.filter_dst6 = 1;
+                        }
+                        else
+                        {
+                                print_syntax();
+                                return 1;
+                        }
+                        break;
+                case 'V':
+                        config.verify = 1;
+                        break;
+                case 'j':
+                        config.num_workers = strtoul(optarg, NULL, 0);
+                        if (config.num_workers < 1 ||
+                            config.num_workers > PINGSERVER_MAX_WORKERS)
+                        {
+                                print_syntax();
+                                return 1;
+                        }
+                        break;
+                case 'F':
+                        config.fanout_mode = parse_fanout_mode(optarg);
+                        if (config.fanout_mode < 0)
+                        {
+                                print_syntax();
+                                return 1;
+                        }
+                        break;
+                case 'a':
+                        config.first_cpu = atoi(optarg);
+                        if (config.first_cpu < 0)
+                        {
+                                print_syntax();
+                                return 1;
+                        }
+                        break;
+                case 'S':
+                        config.stats_path = optarg;
+                        break;
+                case 'r':
+                        config.limit.rate = strtoul(optarg, NULL, 0);
+                        break;
+                case 'b':
+                        config.limit.burst = strtoul(optarg, NULL, 0);
+                        break;
+                case 'R':
+                        config.limit.cap = strtoul(optarg, NULL, 0);
+                        break;
+                case 'M':
+                        config.reasm.memory = strtoul(optarg, NULL, 0);
+                        break;
+                case 'W':
+                        config.reasm.timeout_ms = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        print_syntax();
+                        return 1;
+                }
+        }
+
+        /* Every worker limits the sources it sees and reassembles the
+         * fragments it sees, so a source must not be spread over
+         * several of them.
+         */
+        if (optind != argc ||
+            ((config.limit.rate > 0 || config.reasm.memory > 0) &&
+             config.num_workers > 1 &&
+             config.fanout_mode != PACKET_FANOUT_HASH))
+        {
+                print_syntax();
+                return 1;
+        }
+        if (config.limit.burst == 0)
+        {
+                config.limit.burst = config.limit.rate;
+        }
+
+        return pingserver(&config);
 }
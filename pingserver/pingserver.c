@@ -1,164 +1,589 @@
-/* This file implements an ICMP server.
- * This is one by opening two sockets, one for listening and nother
- * one for sending the ICMP reply. The in_cksum function has been copied.
- * The two sockets:
- *   - Receiving on sock_eth with type SOCK_PACKETS which listens to
- *     all network traffic (ETH_P_ALL).
- *   - Sending on sock_icmp which is a SOCK_RAW socket with ICMP as
- *     protocol. setsockopt() is used to allow the socket access to
- *     the headers.
- *   - 
+/* This file implements an ICMP server, answering both IPv4 echo
+ * requests and ICMPv6 echo requests (type 128).
+ * This is done with a single AF_PACKET socket, which listens to all
+ * network traffic (ETH_P_ALL) and sends the replies, through memory
+ * mapped TPACKET_V3 rings (see pktring.c):
+ *   - The frames are received a block at a time and walked in place,
+ *     without a system call or a copy per frame. A BPF filter in the
+ *     kernel (see filter.c) keeps everything but ICMP echo requests out
+ *     of the receive ring.
+ *   - Every request is copied once, link layer header and all, into a
+ *     slot of the transmit ring. There the MAC and IP addresses are
+ *     swapped and the ICMP type rewritten in place. The replies of all
+ *     the frames of a poll go out with one sendto().
+ *   - Both families come through the same ring and loop. The extension
+ *     headers of an IPv6 request are walked to find its ICMPv6 header.
+ *     IPv4 options and IPv6 extension headers are left out of the reply
+ *     while copying.
+ *
+ * Fragmented requests are put back together in a table of fixed size
+ * (see reasm.c), and replies too large for a transmit frame, or for the
+ * link the request came over, go out in fragments.
+ *
+ * Parsing a request and building its reply is left to echo.c, which
+ * knows nothing of rings or sockets. With -V the checksums of every
+ * request are verified in full there, and every reply checksum is
+ * checked against a full computation.
+ *
+ * With -j N there are N such sockets in one PACKET_FANOUT group, each
+ * served by a worker thread, with -a pinned to a CPU of its own. The
+ * kernel hands every frame to one socket only, so a worker shares no
+ * ring, buffer or counter with another and takes no lock.
+ *
+ * The counters of every worker, with a histogram of the time spent on
+ * each frame, live in a memory mapped statistics segment (see stats.c)
+ * that pingstat reads while the server runs. On SIGINT or SIGTERM the
+ * server prints them, among them the frames the kernel dropped on a full
+ * ring, and removes the segment.
  */
 
-#include <arpa/inet.h>
-#include <net/ethernet.h>
-#include <netinet/ether.h>
-#include <netinet/in.h>
-#include <netinet/in_systm.h>
-#include <netinet/ip.h>
-#include <netinet/ip_icmp.h>
+#include <linux/if_packet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "echo.h"
+#include "filter.h"
 #include "pingserver.h"
+#include "pktring.h"
+#include "ratelimit.h"
+#include "reasm.h"
+#include "stats.h"
 
-#define ICMP_TYPE_REPLY 0
-#define MAX_MTU 1500
+#define CACHE_LINE_SIZE 64
+#define RING_STATS_INTERVAL_NS 100000000ULL
 
-/* From Stevens, UNP2ev1 */
-unsigned short
-in_cksum(unsigned short *addr, int len)
+/* Each worker sits on its own cache lines, and its counters on their own
+ * in the statistics segment, so that no line is shared between workers.
+ */
+struct worker
 {
-    int nleft = len;
-    int sum = 0;
-    unsigned short *w = addr;
-    unsigned short answer = 0;
-
-    while (nleft > 1) {
-        sum += *w++;
-        nleft -= 2;
-    }
-
-    if (nleft == 1) {
-        *(unsigned char *)(&answer) = *(unsigned char *)w;
-        sum += answer;
-    }
-
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    answer = ~sum;
-    return (answer);
+        pthread_t thread;
+        int id;
+        int cpu;
+        int wake_fd;
+        int verify;
+        struct pktring *ring;
+        struct stats_worker *stats;
+        struct ratelimit *limiter; /* NULL without limits. */
+        struct reasm *reasm;      /* NULL without reassembly. */
+        unsigned char *reply;     /* A reply to be sent in fragments. */
+        uint32_t next_id;         /* Of the next reply in fragments. */
+        uint64_t last_ns;         /* When the last frame was done, or 0. */
+        uint64_t ring_stats_ns;   /* When the ring counters were read. */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static volatile sig_atomic_t stop;
+
+static void wait_for_stop_signal(void)
+{
+        sigset_t signals;
+        int signum;
+
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigwait(&signals, &signum);
 }
 
-void pingserver(void)
+static void block_stop_signals(void)
 {
-        int one = 1;
-        int sock_eth;
-        int sock_icmp;
-        int status;
-        struct sockaddr_in dst;
-        struct ip *ip_hdr_in;
-        struct ip *ip_hdr_out;
-        char buf_in[MAX_MTU];
-        char buf_out[MAX_MTU];
-        struct icmp *icmp_hdr_in;
-        struct icmp *icmp_hdr_out;
-        int ip_len;
-        int icmp_len;
-        int icmp_data_len;
+        sigset_t signals;
+
+        /* Only the main thread takes the stop signals, the workers
+         * inherit this mask and are woken up through their wake_fd.
+         */
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+/* Puts the packet of a fragment back together. Returns 1 with the
+ * packet in packet once the fragment completes it.
+ */
+static int reassemble(struct worker *worker, struct pktring_frame *frame,
+                      const struct echo_request *request,
+                      struct reasm_packet *packet)
+{
+        if (worker->reasm == NULL)
+        {
+                return 0;
+        }
+
+        return reasm_add(worker->reasm, frame->mac, request->link_len,
+                         request->ipv6, request->ip_hdr_len, worker->last_ns,
+                         &worker->stats->reasm, packet);
+}
+
+/* Returns the largest fragment of the reply to a request that came in
+ * fragments of up to max_fragment bytes. Those made it here, so the
+ * reply fragments are no larger, unless they are smaller than any link
+ * carries.
+ */
+static unsigned int get_mtu(const struct echo_request *request,
+                            unsigned int max_fragment)
+{
+        unsigned int min_mtu = request->link_len +
+                (request->ipv6 ? ECHO_MIN_MTU6 : ECHO_MIN_MTU);
+
+        return (max_fragment > min_mtu) ? max_fragment : min_mtu;
+}
+
+/* Sends a reply too large for one transmit frame, or larger than the
+ * fragments of its request, in fragments of up to max_len bytes. It is
+ * built aside first, and the first fragment goes into out.
+ */
+static void send_fragments(struct worker *worker, const unsigned char *in,
+                           const struct echo_request *request,
+                           unsigned char *out, unsigned int max_len,
+                           unsigned int mtu, int ifindex)
+{
+        struct stats_worker *stats = worker->stats;
+        enum echo_status status;
+        unsigned int offset = 0;
+        unsigned int data_len;
+        unsigned int len;
+        uint32_t id;
+
+        status = echo_build(in, request, worker->reply, worker->verify);
+        if (status == ECHO_BAD_CKSUM)
+        {
+                stats->bad_cksums++;
+                return;
+        }
+        if (status == ECHO_REPLY_MISMATCH)
+        {
+                stats->cksum_mismatches++;
+        }
+
+        /* The low bits are the worker, so that no two workers send
+         * fragments with the same identification.
+         */
+        id = worker->next_id++ * PINGSERVER_MAX_WORKERS + worker->id;
+        for (;;)
+        {
+                data_len = echo_fragment(worker->reply, request, offset, id,
+                                         out, (max_len < mtu) ? max_len : mtu,
+                                         &len);
+                if (data_len == 0)
+                {
+                        stats->too_large++;
+                        return;
+                }
+                pktring_tx_push(worker->ring, len);
+                offset += data_len;
+                if (offset == request->icmp_len)
+                {
+                        break;
+                }
+
+                out = pktring_tx_get(worker->ring, ifindex, &max_len);
+                if (out == NULL)
+                {
+                        return; /* Counted by the ring. */
+                }
+        }
+        stats->replies++;
+        stats->fragmented_replies++;
+}
+
+static void answer_frame(struct worker *worker, struct pktring_frame *frame)
+{
+        struct stats_worker *stats = worker->stats;
+        struct echo_request request;
+        struct reasm_packet packet;
+        enum echo_status status;
+        const unsigned char *in = frame->mac;
+        unsigned char *out;
+        unsigned int max_len;
+        unsigned int mtu = ECHO_MAX_REPLY_LEN;
+
+        stats->frames++;
+
+        /* On loopback every frame is seen going out and coming in. */
+        if (frame->pkttype == PACKET_OUTGOING)
+        {
+                return;
+        }
+        status = echo_parse(frame->mac, frame->len, frame->net - frame->mac,
+                            frame->protocol, worker->verify, &request);
+        if (status == ECHO_FRAGMENT)
+        {
+                if (!reassemble(worker, frame, &request, &packet))
+                {
+                        return;
+                }
+                in = packet.frame;
+                mtu = get_mtu(&request, packet.max_fragment);
+                status = echo_parse(packet.frame, packet.len,
+                                    request.link_len, frame->protocol,
+                                    worker->verify, &request);
+        }
+        if (status == ECHO_NOT_REQUEST || status == ECHO_FRAGMENT)
+        {
+                return;
+        }
+        stats->requests++;
+        if (in != frame->mac)
+        {
+                stats->fragmented_requests++;
+        }
+        if (status == ECHO_BAD_CKSUM)
+        {
+                stats->bad_cksums++;
+                return;
+        }
+
+        /* Over the limit, before any work on the reply. */
+        if (worker->limiter != NULL &&
+            ratelimit_check(worker->limiter, in + request.link_len,
+                            request.ipv6, worker->last_ns, &stats->limits) !=
+            RATELIMIT_PASS)
+        {
+                return;
+        }
+
+        out = pktring_tx_get(worker->ring, frame->ifindex, &max_len);
+        if (out == NULL)
+        {
+                return; /* Counted by the ring. */
+        }
+        if (request.reply_len > max_len || request.reply_len > mtu)
+        {
+                send_fragments(worker, in, &request, out, max_len, mtu,
+                               frame->ifindex);
+                return;
+        }
+
+        /* The request is copied once, into the transmit ring, and turned
+         * into the reply there.
+         */
+        status = echo_build(in, &request, out, worker->verify);
+        if (status == ECHO_BAD_CKSUM)
+        {
+                stats->bad_cksums++;
+                return;
+        }
+        if (status == ECHO_REPLY_MISMATCH)
+        {
+                stats->cksum_mismatches++;
+        }
+
+        pktring_tx_push(worker->ring, request.reply_len);
+        stats->replies++;
+}
+
+/* Times the work on every frame with one clock read per frame: a frame
+ * takes from the end of the one before it in the same poll to its own
+ * end, ring bookkeeping in between included.
+ */
+static void handle_frame(void *arg, struct pktring_frame *frame)
+{
+        struct worker *worker = arg;
+        uint64_t now;
 
-        sock_eth = socket(AF_INET, SOCK_PACKET, htons(ETH_P_ALL));
-        if (sock_eth < 0)
+        if (worker->last_ns == 0)
         {
-                perror("socket");
-                exit(__LINE__);
+                worker->last_ns = stats_now_ns();
         }
-        
-        sock_icmp = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-        if (sock_eth < 0)
+        answer_frame(worker, frame);
+        now = stats_now_ns();
+        histogram_record(&worker->stats->processing, now - worker->last_ns);
+        worker->last_ns = now;
+}
+
+static void add_stats(struct stats_worker *total,
+                      const struct stats_worker *stats)
+{
+        total->frames += stats->frames;
+        total->requests += stats->requests;
+        total->replies += stats->replies;
+        total->too_large += stats->too_large;
+        total->bad_cksums += stats->bad_cksums;
+        total->cksum_mismatches += stats->cksum_mismatches;
+        total->ring.packets += stats->ring.packets;
+        total->ring.drops += stats->ring.drops;
+        total->ring.freezes += stats->ring.freezes;
+        total->ring.tx_frames += stats->ring.tx_frames;
+        total->ring.tx_flushes += stats->ring.tx_flushes;
+        total->ring.tx_full += stats->ring.tx_full;
+        total->ring.tx_errors += stats->ring.tx_errors;
+        total->limits.source_drops += stats->limits.source_drops;
+        total->limits.cap_drops += stats->limits.cap_drops;
+        total->limits.evictions += stats->limits.evictions;
+        total->fragmented_requests += stats->fragmented_requests;
+        total->fragmented_replies += stats->fragmented_replies;
+        total->reasm.fragments += stats->reasm.fragments;
+        total->reasm.reassembled += stats->reasm.reassembled;
+        total->reasm.timeouts += stats->reasm.timeouts;
+        total->reasm.evictions += stats->reasm.evictions;
+        total->reasm.invalid += stats->reasm.invalid;
+        histogram_merge(&total->processing, &stats->processing);
+}
+
+static void print_stats(const struct stats_worker *stats, int verify)
+{
+        printf("Received %llu frames, %llu echo requests, sent %llu "
+               "replies.\n", stats->frames, stats->requests,
+               stats->replies);
+        if (stats->too_large > 0)
+        {
+                printf("  %llu requests too large to answer.\n",
+                       stats->too_large);
+        }
+        if (stats->limits.source_drops + stats->limits.cap_drops > 0)
+        {
+                printf("  %llu requests over the rate of their source, "
+                       "%llu over the cap, %llu sources evicted.\n",
+                       stats->limits.source_drops, stats->limits.cap_drops,
+                       stats->limits.evictions);
+        }
+        if (stats->reasm.fragments + stats->fragmented_replies > 0)
         {
-                perror("socket");
-                exit(__LINE__);
+                printf("  %llu fragments made %llu packets, %llu of them "
+                       "requests. %llu packets timed out, %llu evicted, "
+                       "%llu invalid.\n", stats->reasm.fragments,
+                       stats->reasm.reassembled, stats->fragmented_requests,
+                       stats->reasm.timeouts, stats->reasm.evictions,
+                       stats->reasm.invalid);
+                printf("  %llu replies sent in fragments.\n",
+                       stats->fragmented_replies);
         }
-        
-        status = setsockopt(sock_icmp, IPPROTO_IP, IP_HDRINCL,
-                            (char *)&one, sizeof(one));
-        if (status < 0)
+        if (verify)
         {
-                perror("setsockopt");
-                exit(__LINE__);
+                printf("  %llu requests with a bad checksum, %llu replies "
+                       "with a wrong incremental checksum.\n",
+                       stats->bad_cksums, stats->cksum_mismatches);
         }
+        printf("  Ring: %llu packets, %llu dropped, %llu times full.\n",
+               stats->ring.packets, stats->ring.drops, stats->ring.freezes);
+        printf("  Transmit ring: %llu frames in %llu sendto calls, %llu "
+               "dropped on a full ring, %llu rejected.\n",
+               stats->ring.tx_frames, stats->ring.tx_flushes,
+               stats->ring.tx_full, stats->ring.tx_errors);
+        printf("  Processing time per frame: p50 %llu, p99 %llu, "
+               "p99.9 %llu, max %llu ns.\n",
+               (unsigned long long)histogram_percentile(&stats->processing,
+                                                        50.0),
+               (unsigned long long)histogram_percentile(&stats->processing,
+                                                        99.0),
+               (unsigned long long)histogram_percentile(&stats->processing,
+                                                        99.9),
+               (unsigned long long)stats->processing.max);
+}
 
-        ip_hdr_in = (struct ip *)(buf_in + sizeof(struct ether_header));
-        icmp_hdr_in = (struct icmp *)((unsigned char *)ip_hdr_in +
-                                      sizeof(struct ip));
-        ip_hdr_out = (struct ip *)buf_out;
-        icmp_hdr_out = (struct icmp *)(buf_out + sizeof(struct ip));
+static void pin_worker(struct worker *worker)
+{
+        cpu_set_t cpus;
+        int status;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        status = pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+        if (status != 0)
+        {
+                fprintf(stderr, "Worker %d: failed to pin to CPU %d: %s.\n",
+                        worker->id, worker->cpu, strerror(status));
+        }
+}
+
+static void *worker_main(void *arg)
+{
+        struct worker *worker = arg;
+        uint64_t now;
 
-        while (1)
+        if (worker->cpu >= 0)
         {
-                status = recv(sock_eth, buf_in, sizeof(buf_in), 0);
-                if (status < 0)
+                pin_worker(worker);
+        }
+        while (!stop)
+        {
+                worker->last_ns = 0;
+                if (pktring_poll(worker->ring, -1, handle_frame, worker) < 0)
                 {
-                        perror("recv");
+                        perror("poll");
                         exit(__LINE__);
                 }
+                pktring_tx_flush(worker->ring);
+
+                /* The kernel counters of the ring take a system call, so
+                 * they are only brought into the segment now and then.
+                 */
+                now = worker->last_ns ? worker->last_ns : stats_now_ns();
+                if (now - worker->ring_stats_ns >= RING_STATS_INTERVAL_NS)
+                {
+                        pktring_stats(worker->ring, &worker->stats->ring);
+                        worker->ring_stats_ns = now;
+                }
+        }
+
+        return NULL;
+}
+
+static int open_workers(struct worker *workers,
+                        struct stats_segment *segment,
+                        const struct pingserver_config *config)
+{
+        struct pktring_config ring_config = config->ring;
+        struct reasm_config reasm_config = config->reasm;
+        static struct filter filter;
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned int i;
 
-                if (!(ip_hdr_in->ip_p == IPPROTO_ICMP &&
-                      icmp_hdr_in->icmp_type == ICMP_ECHO))
+        filter_icmp_echo(&filter, config->filter_dst ? &config->dst : NULL,
+                         config->filter_dst6 ? &config->dst6 : NULL);
+        ring_config.filter = &filter.prog;
+        ring_config.fanout_mode = (config->num_workers > 1) ?
+                config->fanout_mode : PKTRING_NO_FANOUT;
+        ring_config.fanout_id = getpid() & 0xffff;
+        if (num_cpus < 1)
+        {
+                num_cpus = 1;
+        }
+
+        for (i = 0; i < config->num_workers; i++)
+        {
+                struct worker *worker = &workers[i];
+
+                worker->id = i;
+                worker->cpu = (config->first_cpu < 0) ? -1 :
+                        (config->first_cpu + (int)i) % num_cpus;
+                worker->verify = config->verify;
+                worker->stats = &segment->workers[i];
+                worker->stats->cpu = worker->cpu;
+                worker->wake_fd = eventfd(0, 0);
+                if (worker->wake_fd == -1)
                 {
-                        continue;
+                        perror("eventfd");
+                        return __LINE__;
                 }
 
-                /* Prepare outgoing IP header. */
-                ip_hdr_out->ip_v = ip_hdr_in->ip_v;
-                ip_hdr_out->ip_hl = ip_hdr_in->ip_hl;
-                ip_hdr_out->ip_tos = ip_hdr_in->ip_tos;
-                ip_hdr_out->ip_len = ip_hdr_in->ip_len;
-                ip_hdr_out->ip_id = ip_hdr_in->ip_id;
-                ip_hdr_out->ip_off = 0;
-                ip_hdr_out->ip_ttl = 255;
-                ip_hdr_out->ip_p = IPPROTO_ICMP;
-                ip_hdr_out->ip_sum = 0;
-                ip_hdr_out->ip_src.s_addr = ip_hdr_in->ip_dst.s_addr;
-                ip_hdr_out->ip_dst.s_addr = ip_hdr_in->ip_src.s_addr;
-                ip_hdr_out->ip_sum = in_cksum((unsigned short *)buf_out,
-                                               ip_hdr_out->ip_hl);
-
-                /* Prepare outgoing ICMP header. */
-                icmp_hdr_out->icmp_type = ICMP_TYPE_REPLY;
-                icmp_hdr_out->icmp_code = 0;
-                icmp_hdr_out->icmp_cksum = 0;
-                icmp_hdr_out->icmp_id = icmp_hdr_in->icmp_id;
-                icmp_hdr_out->icmp_seq = icmp_hdr_in->icmp_seq;
-
-                ip_len = ntohs(ip_hdr_out->ip_len);
-                icmp_len = ip_len - sizeof(struct iphdr);
-                icmp_data_len = icmp_len - sizeof(struct icmphdr);
-
-                printf("ICMP_ECHO request.\n");
-
-                /* Copy ICMP data from request to the reply packet. */
-                memcpy(icmp_hdr_out->icmp_data, icmp_hdr_in->icmp_data,
-                       icmp_data_len);
-
-                icmp_hdr_out->icmp_cksum = in_cksum((unsigned short *) \
-                                                    icmp_hdr_out, icmp_len);
-                bzero(&dst, sizeof(dst));
-                dst.sin_family = AF_INET;
-                dst.sin_addr.s_addr = ip_hdr_out->ip_dst.s_addr;
-
-                status = sendto(sock_icmp, buf_out, ip_len, 0,
-                                (struct sockaddr *)&dst, sizeof(dst));
-                if (status != ip_len)
+                if (config->limit.rate > 0 || config->limit.cap > 0)
                 {
-                        perror("sendto");
-                        exit(__LINE__);
+                        worker->limiter = ratelimit_create(&config->limit,
+                                                           config->num_workers);
+                        if (worker->limiter == NULL)
+                        {
+                                return __LINE__;
+                        }
+                }
+
+                /* The reassembly memory is shared out like the cap. */
+                if (config->reasm.memory > 0)
+                {
+                        reasm_config.memory = config->reasm.memory /
+                                config->num_workers;
+                        worker->reasm = reasm_create(&reasm_config);
+                        if (worker->reasm == NULL)
+                        {
+                                return __LINE__;
+                        }
+                }
+                worker->reply = malloc(ECHO_MAX_REPLY_LEN);
+                if (worker->reply == NULL)
+                {
+                        perror("malloc");
+                        return __LINE__;
+                }
+                worker->next_id = stats_now_ns();
+
+                ring_config.wake_fd = worker->wake_fd;
+                worker->ring = pktring_open(&ring_config);
+                if (worker->ring == NULL)
+                {
+                        return __LINE__;
                 }
         }
+
+        return 0;
 }
 
+int pingserver(const struct pingserver_config *config)
+{
+        static struct worker workers[PINGSERVER_MAX_WORKERS];
+        static struct stats_worker total;
+        struct stats_segment *segment;
+        unsigned int i;
+        int status;
+
+        if (config->num_workers < 1 ||
+            config->num_workers > PINGSERVER_MAX_WORKERS)
+        {
+                fprintf(stderr, "From 1 to %d workers.\n",
+                        PINGSERVER_MAX_WORKERS);
+                return __LINE__;
+        }
+        segment = stats_create(config->stats_path, config->num_workers);
+        if (segment == NULL)
+        {
+                return __LINE__;
+        }
+        segment->verify = config->verify;
+        if (open_workers(workers, segment, config) != 0)
+        {
+                /* Or pingstat would attach to a server that is gone. */
+                stats_close(segment, config->stats_path);
+                return __LINE__;
+        }
+
+        block_stop_signals();
+        for (i = 0; i < config->num_workers; i++)
+        {
+                status = pthread_create(&workers[i].thread, NULL, worker_main,
+                                        &workers[i]);
+                if (status != 0)
+                {
+                        fprintf(stderr, "pthread_create: %s.\n",
+                                strerror(status));
+                        exit(__LINE__);
+                }
+        }
+
+        wait_for_stop_signal();
+        stop = 1;
+        for (i = 0; i < config->num_workers; i++)
+        {
+                eventfd_write(workers[i].wake_fd, 1);
+        }
+
+        histogram_init(&total.processing, STATS_HISTOGRAM_PRECISION);
+        for (i = 0; i < config->num_workers; i++)
+        {
+                pthread_join(workers[i].thread, NULL);
+                pktring_stats(workers[i].ring, &workers[i].stats->ring);
+                if (config->num_workers > 1)
+                {
+                        printf("Worker %u", i);
+                        if (workers[i].cpu >= 0)
+                        {
+                                printf(" on CPU %d", workers[i].cpu);
+                        }
+                        printf(": ");
+                        print_stats(workers[i].stats, config->verify);
+                }
+                add_stats(&total, workers[i].stats);
+                pktring_close(workers[i].ring);
+                if (workers[i].limiter != NULL)
+                {
+                        ratelimit_destroy(workers[i].limiter);
+                }
+                if (workers[i].reasm != NULL)
+                {
+                        reasm_destroy(workers[i].reasm);
+                }
+                free(workers[i].reply);
+                close(workers[i].wake_fd);
+        }
+        print_stats(&total, config->verify);
+        stats_close(segment, config->stats_path);
+
+        return 0;
+}
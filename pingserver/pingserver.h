@@ -1,8 +1,36 @@
 #ifndef __PINGSERVER_H_
 #define __PINGSERVER_H_
 
+#include <netinet/in.h>
 #include <sys/socket.h>
 
-extern void pingserver(void);
+#include "pktring.h"
+#include "ratelimit.h"
+#include "reasm.h"
+
+struct pingserver_config
+{
+        struct pktring_config ring;
+        int filter_dst;           /* Only answer requests to dst. */
+        struct in_addr dst;
+        int filter_dst6;          /* Only answer requests to dst6. */
+        struct in6_addr dst6;
+        int verify;               /* Check all checksums in full. */
+        unsigned int num_workers; /* Threads, one ring each. */
+        int fanout_mode;          /* How the rings share the traffic. */
+        int first_cpu;            /* Worker i is pinned to first_cpu + i,
+                                   * -1 for none. */
+        const char *stats_path;   /* The statistics segment. */
+        struct ratelimit_config limit;
+        struct reasm_config reasm; /* Memory for all workers, 0 for no
+                                    * reassembly. */
+};
+
+#define PINGSERVER_MAX_WORKERS 64
+
+/* Answers ICMP echo requests until SIGINT or SIGTERM, then prints the
+ * counters. Returns 0 on success.
+ */
+extern int pingserver(const struct pingserver_config *config);
 
 #endif
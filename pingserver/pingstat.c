@@ -0,0 +1,246 @@
+/* This program shows the statistics of a running pingserver, read from
+ * the memory mapped segment the workers count into (see stats.c).
+ *
+ * Every interval the counters and processing time histograms of all
+ * workers are copied out of the segment, and the difference to the copy
+ * before is printed as rates and percentiles of that interval. The
+ * segment is only ever read, so the server neither knows nor cares how
+ * often it is looked at.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "stats.h"
+
+#define DEFAULT_INTERVAL 1.0
+#define NS_PER_SEC 1e9
+#define HEADER_EVERY 20
+
+/* The totals of a worker, or of all, over an interval. */
+struct rates
+{
+        double frames;
+        double replies;
+        double filtered;
+        double limited;
+        double failed;
+        double dropped;
+        struct histogram processing;
+};
+
+static void print_syntax(void)
+{
+        printf("SYNTAX:  pingstat [-i interval] [-c count] [-w] "
+               "[-S stats-path]\n\n");
+        printf("  -i  Seconds between lines (default %.0f).\n",
+               DEFAULT_INTERVAL);
+        printf("  -c  Stop after this many lines.\n");
+        printf("  -w  A line for every worker too.\n");
+        printf("  -S  The statistics segment of the server (default %s).\n",
+               STATS_DEFAULT_PATH);
+}
+
+static uint64_t failures(const struct stats_worker *stats)
+{
+        return stats->too_large + stats->ring.tx_full + stats->ring.tx_errors;
+}
+
+/* Returns the frames that were neither requests nor fragments of one. */
+static uint64_t others(const struct stats_worker *stats)
+{
+        return stats->frames - stats->reasm.fragments -
+                (stats->requests - stats->fragmented_requests);
+}
+
+/* Sets rates to what a worker did between then and now. */
+static void get_interval(struct rates *rates, const struct stats_worker *now,
+                         const struct stats_worker *then)
+{
+        rates->frames = now->frames - then->frames;
+        rates->replies = now->replies - then->replies;
+        rates->filtered = others(now) - others(then);
+        rates->limited = (now->limits.source_drops + now->limits.cap_drops) -
+                (then->limits.source_drops + then->limits.cap_drops);
+        rates->failed = failures(now) - failures(then);
+        rates->dropped = now->ring.drops - then->ring.drops;
+        rates->processing = now->processing;
+        histogram_subtract(&rates->processing, &then->processing);
+}
+
+static void print_header(const struct stats_segment *segment)
+{
+        printf("pingserver %d, %u workers%s.\n", segment->pid,
+               segment->num_workers,
+               segment->verify ? ", verifying checksums" : "");
+        printf("%-6s %10s %10s %10s %10s %10s %10s %8s %8s %8s\n", "",
+               "frames/s", "replies/s", "filtered/s", "limited/s",
+               "failed/s", "dropped/s", "p50 ns", "p99 ns", "max ns");
+}
+
+static void print_rates(const char *label, const struct rates *rates,
+                        double seconds)
+{
+        printf("%-6s %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %8llu "
+               "%8llu %8llu\n", label, rates->frames / seconds,
+               rates->replies / seconds, rates->filtered / seconds,
+               rates->limited / seconds, rates->failed / seconds,
+               rates->dropped / seconds,
+               (unsigned long long)histogram_percentile(&rates->processing,
+                                                        50.0),
+               (unsigned long long)histogram_percentile(&rates->processing,
+                                                        99.0),
+               (unsigned long long)rates->processing.max);
+}
+
+static void reset_rates(struct rates *rates)
+{
+        rates->frames = 0;
+        rates->replies = 0;
+        rates->filtered = 0;
+        rates->limited = 0;
+        rates->failed = 0;
+        rates->dropped = 0;
+        histogram_init(&rates->processing, STATS_HISTOGRAM_PRECISION);
+}
+
+static void copy_workers(struct stats_worker *copy,
+                         const struct stats_segment *segment)
+{
+        memcpy(copy, segment->workers,
+               segment->num_workers * sizeof(*copy));
+}
+
+static int is_server_alive(const struct stats_segment *segment)
+{
+        return kill(segment->pid, 0) == 0 || errno == EPERM;
+}
+
+int main(int argc, char **argv)
+{
+        const char *path = STATS_DEFAULT_PATH;
+        const struct stats_segment *segment;
+        struct stats_worker *then;
+        struct stats_worker *now;
+        struct stats_worker *swap;
+        static struct rates total;
+        static struct rates worker;
+        struct timespec interval;
+        double interval_sec = DEFAULT_INTERVAL;
+        double seconds;
+        uint64_t then_ns;
+        uint64_t now_ns;
+        unsigned long count = 0;
+        unsigned long line;
+        unsigned int i;
+        int per_worker = 0;
+        char label[16];
+        int opt;
+
+        while ((opt = getopt(argc, argv, "i:c:wS:")) != -1)
+        {
+                switch (opt)
+                {
+                case 'i':
+                        interval_sec = atof(optarg);
+                        if (interval_sec <= 0)
+                        {
+                                print_syntax();
+                                return 1;
+                        }
+                        break;
+                case 'c':
+                        count = strtoul(optarg, NULL, 0);
+                        break;
+                case 'w':
+                        per_worker = 1;
+                        break;
+                case 'S':
+                        path = optarg;
+                        break;
+                default:
+                        print_syntax();
+                        return 1;
+                }
+        }
+
+        if (optind != argc)
+        {
+                print_syntax();
+                return 1;
+        }
+
+        segment = stats_open(path);
+        if (segment == NULL)
+        {
+                return __LINE__;
+        }
+        then = malloc(segment->num_workers * sizeof(*then));
+        now = malloc(segment->num_workers * sizeof(*now));
+        if (then == NULL || now == NULL)
+        {
+                perror("malloc");
+                return __LINE__;
+        }
+
+        interval.tv_sec = interval_sec;
+        interval.tv_nsec = (interval_sec - interval.tv_sec) * NS_PER_SEC;
+        copy_workers(then, segment);
+        then_ns = stats_now_ns();
+
+        for (line = 0; count == 0 || line < count; line++)
+        {
+                nanosleep(&interval, NULL);
+                if (!is_server_alive(segment))
+                {
+                        printf("pingserver %d has stopped.\n", segment->pid);
+                        break;
+                }
+
+                copy_workers(now, segment);
+                now_ns = stats_now_ns();
+                seconds = (now_ns - then_ns) / NS_PER_SEC;
+
+                if (line % HEADER_EVERY == 0)
+                {
+                        print_header(segment);
+                }
+                reset_rates(&total);
+                for (i = 0; i < segment->num_workers; i++)
+                {
+                        get_interval(&worker, &now[i], &then[i]);
+                        if (per_worker)
+                        {
+                                snprintf(label, sizeof(label), "w%u", i);
+                                print_rates(label, &worker, seconds);
+                        }
+                        total.frames += worker.frames;
+                        total.replies += worker.replies;
+                        total.filtered += worker.filtered;
+                        total.limited += worker.limited;
+                        total.failed += worker.failed;
+                        total.dropped += worker.dropped;
+                        histogram_merge(&total.processing,
+                                        &worker.processing);
+                }
+                print_rates("total", &total, seconds);
+                fflush(stdout);
+
+                swap = then;
+                then = now;
+                now = swap;
+                then_ns = now_ns;
+        }
+
+        free(then);
+        free(now);
+        stats_close(segment, NULL);
+
+        return 0;
+}
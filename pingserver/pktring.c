@@ -0,0 +1,461 @@
+/* This file implements memory mapped TPACKET_V3 receive and transmit
+ * rings on one AF_PACKET socket.
+ *
+ * The kernel writes the frames into a ring of blocks shared with user
+ * space, several frames back to back per block. A block is handed over
+ * when it is full or when the timeout has passed since its first frame,
+ * by setting TP_STATUS_USER in its descriptor. User space then walks the
+ * frames in place, without a system call or a copy per frame, and gives
+ * the whole block back by setting TP_STATUS_KERNEL. Only an empty ring
+ * needs a poll() to wait.
+ *
+ * When every block is held by user space the kernel drops the frames,
+ * and counts the drops in PACKET_STATISTICS.
+ *
+ * The transmit ring is an array of fixed size frame slots after the
+ * receive blocks in the same mapping. A frame is written straight into a
+ * free slot and marked TP_STATUS_SEND_REQUEST. One sendto() then has the
+ * kernel send every marked slot and mark it free again, without a system
+ * call per frame. The destination of a flush is one interface, so frames
+ * for another interface flush the queued ones first. The ring bypasses
+ * the queueing discipline, as a ping reply needs no traffic shaping.
+ * With PACKET_LOSS the kernel frees a slot it cannot send and goes on
+ * with the next. Without it the kernel would stop at that slot, marked
+ * TP_STATUS_WRONG_FORMAT, and send nothing behind it until our writing
+ * came round the whole ring to it again.
+ *
+ * The socket is opened for no protocol at all, and only bound to every
+ * protocol once the ring and the filter are in place, so that no frame
+ * gets past the filter in between.
+ *
+ * Several rings can join one PACKET_FANOUT group, after which the kernel
+ * hands every frame to only one of them: by flow hash, by the CPU that
+ * received it, or to the first ring that is not full (rollover).
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "pktring.h"
+
+#define FRAME_SIZE 2048 /* Only a hint with TPACKET_V3. */
+#define TX_FRAMES_PER_BLOCK 32
+#define TX_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct pktring
+{
+        int fd;
+        int wake_fd;
+        unsigned char *map;
+        size_t map_size;
+        unsigned int block_size;
+        unsigned int block_count;
+        unsigned int next_block;
+
+        /* Transmit ring. */
+        unsigned char *tx_map;
+        unsigned int tx_frame_count;
+        unsigned int tx_next;
+        unsigned int tx_queued;
+        int tx_ifindex;
+
+        struct pktring_stats stats;
+};
+
+static struct tpacket_block_desc *get_block(struct pktring *ring,
+                                            unsigned int index)
+{
+        return (struct tpacket_block_desc *)(ring->map +
+                                             index * ring->block_size);
+}
+
+static int is_power_of_two(unsigned int n)
+{
+        return n != 0 && (n & (n - 1)) == 0;
+}
+
+static int setup_tx_ring(struct pktring *ring,
+                         const struct pktring_config *config)
+{
+        struct tpacket_req3 req;
+        int one = 1;
+
+        if (config->tx_frames == 0)
+        {
+                return 0;
+        }
+
+        /* Only allowed before either ring is set up. */
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_LOSS, &one,
+                       sizeof(one)) != 0)
+        {
+                perror("setsockopt PACKET_LOSS");
+                return __LINE__;
+        }
+
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = PKTRING_TX_FRAME_SIZE * TX_FRAMES_PER_BLOCK;
+        req.tp_block_nr = (config->tx_frames + TX_FRAMES_PER_BLOCK - 1) /
+                TX_FRAMES_PER_BLOCK;
+        req.tp_frame_size = PKTRING_TX_FRAME_SIZE;
+        req.tp_frame_nr = req.tp_block_nr * TX_FRAMES_PER_BLOCK;
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &req,
+                       sizeof(req)) != 0)
+        {
+                perror("setsockopt PACKET_TX_RING");
+                return __LINE__;
+        }
+        ring->tx_frame_count = req.tp_frame_nr;
+
+        /* Without it, the ring still works. */
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one,
+                       sizeof(one)) != 0)
+        {
+                perror("setsockopt PACKET_QDISC_BYPASS");
+        }
+
+        return 0;
+}
+
+static int setup_ring(struct pktring *ring, const struct pktring_config *config)
+{
+        struct tpacket_req3 req;
+        int version = TPACKET_V3;
+
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+                       sizeof(version)) != 0)
+        {
+                perror("setsockopt PACKET_VERSION");
+                return __LINE__;
+        }
+
+        /* It sets PACKET_LOSS, which must come first. */
+        if (setup_tx_ring(ring, config) != 0)
+        {
+                return __LINE__;
+        }
+
+        memset(&req, 0, sizeof(req));
+        req.tp_block_size = config->block_size;
+        req.tp_block_nr = config->block_count;
+        req.tp_frame_size = FRAME_SIZE;
+        req.tp_frame_nr = (config->block_size / FRAME_SIZE) *
+                config->block_count;
+        req.tp_retire_blk_tov = config->timeout_ms;
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req,
+                       sizeof(req)) != 0)
+        {
+                perror("setsockopt PACKET_RX_RING");
+                return __LINE__;
+        }
+
+        /* The transmit ring follows the receive ring. */
+        ring->block_size = config->block_size;
+        ring->block_count = config->block_count;
+        ring->map_size = (size_t)config->block_size * config->block_count +
+                (size_t)ring->tx_frame_count * PKTRING_TX_FRAME_SIZE;
+        ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+        if (ring->map == MAP_FAILED)
+        {
+                ring->map = NULL;
+                perror("mmap");
+                return __LINE__;
+        }
+        ring->tx_map = ring->map +
+                (size_t)config->block_size * config->block_count;
+
+        return 0;
+}
+
+static int attach_filter(int fd, const struct sock_fprog *filter)
+{
+        if (filter != NULL &&
+            setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, filter,
+                       sizeof(*filter)) != 0)
+        {
+                perror("setsockopt SO_ATTACH_FILTER");
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+static int bind_all_interfaces(int fd)
+{
+        struct sockaddr_ll addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = htons(ETH_P_ALL);
+        addr.sll_ifindex = 0;
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+                perror("bind");
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+static int join_fanout(int fd, const struct pktring_config *config)
+{
+        int fanout;
+
+        if (config->fanout_mode == PKTRING_NO_FANOUT)
+        {
+                return 0;
+        }
+
+        /* Only a bound socket can join a group. */
+        fanout = config->fanout_id | (config->fanout_mode << 16);
+        if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                       sizeof(fanout)) != 0)
+        {
+                perror("setsockopt PACKET_FANOUT");
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+struct pktring *pktring_open(const struct pktring_config *config)
+{
+        struct pktring *ring;
+        long page_size = sysconf(_SC_PAGESIZE);
+
+        if (config->block_size < (unsigned int)page_size ||
+            !is_power_of_two(config->block_size) ||
+            config->block_count == 0)
+        {
+                fprintf(stderr, "The ring block size must be a power of "
+                        "two of at least %ld bytes.\n", page_size);
+                return NULL;
+        }
+
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL)
+        {
+                perror("calloc");
+                return NULL;
+        }
+        ring->wake_fd = config->wake_fd;
+
+        ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+        if (ring->fd < 0)
+        {
+                perror("socket");
+                free(ring);
+                return NULL;
+        }
+
+        if (setup_ring(ring, config) != 0 ||
+            attach_filter(ring->fd, config->filter) != 0 ||
+            bind_all_interfaces(ring->fd) != 0 ||
+            join_fanout(ring->fd, config) != 0)
+        {
+                pktring_close(ring);
+                return NULL;
+        }
+
+        return ring;
+}
+
+int pktring_fd(const struct pktring *ring)
+{
+        return ring->fd;
+}
+
+static unsigned int walk_block(struct tpacket_block_desc *block,
+                               pktring_frame_fn fn, void *arg)
+{
+        struct tpacket3_hdr *hdr;
+        struct sockaddr_ll *addr;
+        struct pktring_frame frame;
+        unsigned int num_frames = block->hdr.bh1.num_pkts;
+        unsigned int i;
+
+        hdr = (struct tpacket3_hdr *)((unsigned char *)block +
+                                      block->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < num_frames; i++)
+        {
+                addr = (struct sockaddr_ll *)((unsigned char *)hdr +
+                        TPACKET_ALIGN(sizeof(*hdr)));
+
+                frame.mac = (unsigned char *)hdr + hdr->tp_mac;
+                frame.net = (unsigned char *)hdr + hdr->tp_net;
+                frame.len = hdr->tp_snaplen;
+                frame.wire_len = hdr->tp_len;
+                frame.protocol = ntohs(addr->sll_protocol);
+                frame.ifindex = addr->sll_ifindex;
+                frame.pkttype = addr->sll_pkttype;
+                fn(arg, &frame);
+
+                hdr = (struct tpacket3_hdr *)((unsigned char *)hdr +
+                                              hdr->tp_next_offset);
+        }
+
+        return num_frames;
+}
+
+int pktring_poll(struct pktring *ring, int timeout_ms, pktring_frame_fn fn,
+                 void *arg)
+{
+        struct tpacket_block_desc *block;
+        struct pollfd pfds[2];
+        int num_frames = 0;
+
+        block = get_block(ring, ring->next_block);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status,
+                              __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        {
+                pfds[0].fd = ring->fd;
+                pfds[0].events = POLLIN | POLLERR;
+                pfds[0].revents = 0;
+                pfds[1].fd = ring->wake_fd;
+                pfds[1].events = POLLIN;
+                pfds[1].revents = 0;
+                if (poll(pfds, (ring->wake_fd != -1) ? 2 : 1,
+                         timeout_ms) < 0)
+                {
+                        return (errno == EINTR) ? 0 : -1;
+                }
+        }
+
+        /* Take every block that is ready, in ring order. */
+        while (__atomic_load_n(&block->hdr.bh1.block_status,
+                               __ATOMIC_ACQUIRE) & TP_STATUS_USER)
+        {
+                num_frames += walk_block(block, fn, arg);
+                __atomic_store_n(&block->hdr.bh1.block_status,
+                                 TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+                ring->next_block = (ring->next_block + 1) % ring->block_count;
+                block = get_block(ring, ring->next_block);
+        }
+
+        return num_frames;
+}
+
+static struct tpacket3_hdr *get_tx_slot(struct pktring *ring,
+                                        unsigned int index)
+{
+        return (struct tpacket3_hdr *)(ring->tx_map +
+                                       (size_t)index * PKTRING_TX_FRAME_SIZE);
+}
+
+unsigned char *pktring_tx_get(struct pktring *ring, int ifindex,
+                              unsigned int *max_len)
+{
+        struct tpacket3_hdr *slot;
+        unsigned int status;
+
+        if (ring->tx_frame_count == 0)
+        {
+                return NULL;
+        }
+
+        if (ring->tx_queued > 0 && ifindex != ring->tx_ifindex)
+        {
+                pktring_tx_flush(ring);
+        }
+
+        slot = get_tx_slot(ring, ring->tx_next);
+        status = __atomic_load_n(&slot->tp_status, __ATOMIC_ACQUIRE);
+        if (status != TP_STATUS_AVAILABLE && ring->tx_queued > 0)
+        {
+                /* Full, send what is queued and look again. */
+                pktring_tx_flush(ring);
+                status = __atomic_load_n(&slot->tp_status, __ATOMIC_ACQUIRE);
+        }
+        if (status == TP_STATUS_WRONG_FORMAT)
+        {
+                ring->stats.tx_errors++;
+        }
+        else if (status != TP_STATUS_AVAILABLE)
+        {
+                ring->stats.tx_full++;
+                return NULL;
+        }
+
+        ring->tx_ifindex = ifindex;
+        *max_len = PKTRING_TX_FRAME_SIZE - TX_DATA_OFFSET;
+
+        return (unsigned char *)slot + TX_DATA_OFFSET;
+}
+
+void pktring_tx_push(struct pktring *ring, unsigned int len)
+{
+        struct tpacket3_hdr *slot = get_tx_slot(ring, ring->tx_next);
+
+        slot->tp_len = len;
+        slot->tp_snaplen = len;
+        slot->tp_next_offset = 0;
+        __atomic_store_n(&slot->tp_status, TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
+
+        ring->tx_next = (ring->tx_next + 1) % ring->tx_frame_count;
+        ring->tx_queued++;
+        ring->stats.tx_frames++;
+}
+
+int pktring_tx_flush(struct pktring *ring)
+{
+        struct sockaddr_ll addr;
+
+        if (ring->tx_queued == 0)
+        {
+                return 0;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = 0; /* Taken from each link layer header. */
+        addr.sll_ifindex = ring->tx_ifindex;
+
+        ring->tx_queued = 0;
+        ring->stats.tx_flushes++;
+        if (sendto(ring->fd, NULL, 0, 0, (struct sockaddr *)&addr,
+                   sizeof(addr)) < 0)
+        {
+                perror("sendto");
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+void pktring_stats(struct pktring *ring, struct pktring_stats *stats)
+{
+        struct tpacket_stats_v3 kstats;
+        socklen_t len = sizeof(kstats);
+
+        if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &kstats,
+                       &len) == 0)
+        {
+                ring->stats.packets += kstats.tp_packets;
+                ring->stats.drops += kstats.tp_drops;
+                ring->stats.freezes += kstats.tp_freeze_q_cnt;
+        }
+
+        *stats = ring->stats;
+}
+
+void pktring_close(struct pktring *ring)
+{
+        if (ring->map != NULL)
+        {
+                munmap(ring->map, ring->map_size);
+        }
+        close(ring->fd);
+        free(ring);
+}
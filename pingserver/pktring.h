@@ -0,0 +1,101 @@
+#ifndef __PKTRING_H_
+#define __PKTRING_H_
+
+#include <linux/filter.h>
+#include <stdint.h>
+
+#define PKTRING_DEFAULT_BLOCK_SIZE (1 << 18)
+#define PKTRING_DEFAULT_BLOCK_COUNT 16
+#define PKTRING_DEFAULT_TIMEOUT_MS 1
+#define PKTRING_DEFAULT_TX_FRAMES 1024
+#define PKTRING_TX_FRAME_SIZE 2048
+#define PKTRING_NO_FANOUT -1
+
+struct pktring;
+
+struct pktring_config
+{
+        unsigned int block_size;  /* Bytes, a power of two of pages. */
+        unsigned int block_count;
+        unsigned int timeout_ms;  /* Hand over a block this old even if
+                                   * it is not full. */
+        const struct sock_fprog *filter; /* Attached before the first
+                                          * frame, or NULL. */
+        unsigned int tx_frames;   /* Slots in the transmit ring, 0 for
+                                   * none. */
+        int fanout_mode;          /* PACKET_FANOUT_HASH, ... to join the
+                                   * fanout group fanout_id, or
+                                   * PKTRING_NO_FANOUT. */
+        unsigned short fanout_id;
+        int wake_fd;              /* pktring_poll stops waiting when it is
+                                   * readable, or -1. */
+};
+
+/* A received frame, in place in the ring. */
+struct pktring_frame
+{
+        unsigned char *mac;       /* Link layer header. */
+        unsigned char *net;       /* Network layer header. */
+        unsigned int len;         /* Bytes from mac that were captured. */
+        unsigned int wire_len;    /* Bytes from mac on the wire. */
+        unsigned short protocol;  /* Ethertype, in host byte order. */
+        int ifindex;
+        unsigned char pkttype;    /* PACKET_HOST, PACKET_OUTGOING, ... */
+};
+
+struct pktring_stats
+{
+        unsigned long long packets;
+        unsigned long long drops;
+        unsigned long long freezes;   /* Times the ring was full. */
+        unsigned long long tx_frames;
+        unsigned long long tx_flushes;
+        unsigned long long tx_full;   /* Frames dropped on a full ring. */
+        unsigned long long tx_errors; /* Frames the kernel rejected. */
+};
+
+/* Called for every frame of a block. The frame is only valid until the
+ * callback returns.
+ */
+typedef void (*pktring_frame_fn)(void *arg, struct pktring_frame *frame);
+
+/* Opens an AF_PACKET socket for all protocols on all interfaces, with a
+ * TPACKET_V3 receive ring, and a transmit ring if asked for, mapped into
+ * memory. The sockets of one fanout group share the traffic between them.
+ * Returns NULL on failure, with the reason printed.
+ */
+extern struct pktring *pktring_open(const struct pktring_config *config);
+
+/* Returns the socket of the ring, for socket options such as filters. */
+extern int pktring_fd(const struct pktring *ring);
+
+/* Waits up to timeout_ms (-1 for ever) for a block, then hands every
+ * frame of every block that is ready to fn and gives the blocks back to
+ * the kernel. Returns the number of frames, 0 when interrupted, woken up
+ * or timed out, and -1 on error.
+ */
+extern int pktring_poll(struct pktring *ring, int timeout_ms,
+                        pktring_frame_fn fn, void *arg);
+
+/* Returns a free slot of the transmit ring for a frame to go out on
+ * ifindex, where up to *max_len bytes of frame from the link layer
+ * header on can be written. Frames queued for another interface are
+ * sent first. Returns NULL when the ring is full.
+ */
+extern unsigned char *pktring_tx_get(struct pktring *ring, int ifindex,
+                                     unsigned int *max_len);
+
+/* Queues the frame written into the slot from pktring_tx_get. */
+extern void pktring_tx_push(struct pktring *ring, unsigned int len);
+
+/* Sends every queued frame with one system call. */
+extern int pktring_tx_flush(struct pktring *ring);
+
+/* Adds up the kernel counters of the ring, which are reset as they are
+ * read.
+ */
+extern void pktring_stats(struct pktring *ring, struct pktring_stats *stats);
+
+extern void pktring_close(struct pktring *ring);
+
+#endif
@@ -0,0 +1,243 @@
+/* This file implements the rate limiter of the ping server, a token
+ * bucket for every source address and one for all sources together.
+ *
+ * A bucket of burst tokens that gains rate tokens a second is kept as
+ * the single time at which it will be full again. Taking a token moves
+ * that time on by 1/rate, and is refused when it would lie more than
+ * burst/rate ahead of now. This is the same bucket, without a division
+ * or a refill step per packet.
+ *
+ * The buckets of the sources live in a fixed size, open addressed hash
+ * table of 16 byte entries, four to a cache line, allocated once. A
+ * source is looked for in a window of MAX_PROBES entries from its hash.
+ * A bucket that is full again says no more than an empty slot, so such
+ * entries are reused. When the window holds only busy sources, the one
+ * closest to full is pushed out. A flood from many spoofed sources
+ * therefore costs the table lookups and no memory, and the cap still
+ * bounds the replies.
+ *
+ * IPv4 sources are limited by address, IPv6 sources by /64 prefix, the
+ * smallest network a host is usually given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ratelimit.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define CACHE_LINE_SIZE 64
+#define MAX_PROBES 8
+#define CAP_DEPTH_NS (NS_PER_SEC / 100) /* The cap allows 10 ms bursts. */
+#define IPV4_KEY_TAG 0xffffffff00000000ULL
+#define IPV4_SRC_OFFSET 12
+#define IPV6_SRC_OFFSET 8
+
+struct entry
+{
+        uint64_t key;             /* 0 for a slot never used. */
+        uint64_t full_ns;         /* When the bucket is full again. */
+};
+
+struct ratelimit
+{
+        struct entry *table;
+        unsigned int mask;
+        unsigned int hash_shift;
+        int limit_sources;
+        uint64_t interval_ns;     /* Per token. */
+        uint64_t depth_ns;        /* Burst tokens. */
+        int limit_all;
+        uint64_t cap_interval_ns;
+        uint64_t cap_full_ns;
+};
+
+static int is_power_of_two(unsigned int n)
+{
+        return n != 0 && (n & (n - 1)) == 0;
+}
+
+struct ratelimit *ratelimit_create(const struct ratelimit_config *config,
+                                   unsigned int num_shares)
+{
+        struct ratelimit *limiter;
+        unsigned int cap_share;
+        unsigned int bits = 0;
+        unsigned int burst;
+
+        if (config->rate > 0 && !is_power_of_two(config->entries))
+        {
+                fprintf(stderr, "The rate limit table needs a power of two "
+                        "entries.\n");
+                return NULL;
+        }
+
+        limiter = calloc(1, sizeof(*limiter));
+        if (limiter == NULL)
+        {
+                perror("calloc");
+                return NULL;
+        }
+
+        if (config->rate > 0)
+        {
+                if (posix_memalign((void **)&limiter->table, CACHE_LINE_SIZE,
+                                   config->entries * sizeof(struct entry)) != 0)
+                {
+                        perror("posix_memalign");
+                        free(limiter);
+                        return NULL;
+                }
+                memset(limiter->table, 0,
+                       config->entries * sizeof(struct entry));
+                while ((1U << bits) < config->entries)
+                {
+                        bits++;
+                }
+
+                burst = (config->burst > 0) ? config->burst : 1;
+                limiter->limit_sources = 1;
+                limiter->mask = config->entries - 1;
+                limiter->hash_shift = 64 - bits;
+                limiter->interval_ns = NS_PER_SEC / config->rate;
+                limiter->depth_ns = burst * limiter->interval_ns;
+        }
+
+        /* Every worker gets its share of the cap, so that the workers
+         * share no bucket.
+         */
+        if (config->cap > 0)
+        {
+                cap_share = config->cap / num_shares;
+                if (cap_share == 0)
+                {
+                        cap_share = 1;
+                }
+                limiter->limit_all = 1;
+                limiter->cap_interval_ns = NS_PER_SEC / cap_share;
+        }
+
+        return limiter;
+}
+
+static uint64_t get_key(const unsigned char *net, int ipv6)
+{
+        uint32_t addr;
+        uint64_t key;
+
+        if (!ipv6)
+        {
+                memcpy(&addr, net + IPV4_SRC_OFFSET, sizeof(addr));
+                return IPV4_KEY_TAG | addr;
+        }
+
+        memcpy(&key, net + IPV6_SRC_OFFSET, sizeof(key));
+
+        return (key == 0) ? 1 : key;
+}
+
+/* Returns the entry of key, making one if there is none. */
+static struct entry *find_entry(struct ratelimit *limiter, uint64_t key,
+                                uint64_t now_ns,
+                                struct ratelimit_stats *stats)
+{
+        struct entry *entry;
+        struct entry *victim = NULL;
+        unsigned int index;
+        unsigned int i;
+
+        /* Fibonacci hashing, the high bits of the product. */
+        index = (key * 0x9e3779b97f4a7c15ULL) >> limiter->hash_shift;
+        for (i = 0; i < MAX_PROBES; i++)
+        {
+                entry = &limiter->table[(index + i) & limiter->mask];
+                if (entry->key == key)
+                {
+                        return entry;
+                }
+                if (victim == NULL || entry->full_ns < victim->full_ns)
+                {
+                        victim = entry;
+                }
+        }
+
+        if (victim->key != 0 && victim->full_ns > now_ns)
+        {
+                stats->evictions++;
+        }
+        victim->key = key;
+        victim->full_ns = now_ns;
+
+        return victim;
+}
+
+/* Returns 1 if the bucket full at full_ns has a token. */
+static int has_token(uint64_t full_ns, uint64_t interval_ns,
+                     uint64_t depth_ns, uint64_t now_ns)
+{
+        uint64_t full = (full_ns > now_ns) ? full_ns : now_ns;
+
+        return full + interval_ns - now_ns <= depth_ns;
+}
+
+/* Takes a token from the bucket full at *full_ns. */
+static void take_token(uint64_t *full_ns, uint64_t interval_ns,
+                       uint64_t now_ns)
+{
+        uint64_t full = (*full_ns > now_ns) ? *full_ns : now_ns;
+
+        *full_ns = full + interval_ns;
+}
+
+enum ratelimit_verdict ratelimit_check(struct ratelimit *limiter,
+                                       const unsigned char *net, int ipv6,
+                                       uint64_t now_ns,
+                                       struct ratelimit_stats *stats)
+{
+        struct entry *entry = NULL;
+        uint64_t cap_depth_ns;
+
+        /* Both buckets are checked before either token is taken, so that
+         * a reply dropped by the cap does not use up its source's.
+         */
+        if (limiter->limit_sources)
+        {
+                entry = find_entry(limiter, get_key(net, ipv6), now_ns,
+                                   stats);
+                if (!has_token(entry->full_ns, limiter->interval_ns,
+                               limiter->depth_ns, now_ns))
+                {
+                        stats->source_drops++;
+                        return RATELIMIT_SOURCE;
+                }
+        }
+
+        if (limiter->limit_all)
+        {
+                cap_depth_ns = (limiter->cap_interval_ns > CAP_DEPTH_NS) ?
+                        limiter->cap_interval_ns : CAP_DEPTH_NS;
+                if (!has_token(limiter->cap_full_ns,
+                               limiter->cap_interval_ns, cap_depth_ns,
+                               now_ns))
+                {
+                        stats->cap_drops++;
+                        return RATELIMIT_CAP;
+                }
+                take_token(&limiter->cap_full_ns, limiter->cap_interval_ns,
+                           now_ns);
+        }
+
+        if (entry != NULL)
+        {
+                take_token(&entry->full_ns, limiter->interval_ns, now_ns);
+        }
+
+        return RATELIMIT_PASS;
+}
+
+void ratelimit_destroy(struct ratelimit *limiter)
+{
+        free(limiter->table);
+        free(limiter);
+}
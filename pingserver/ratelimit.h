@@ -0,0 +1,52 @@
+#ifndef __RATELIMIT_H_
+#define __RATELIMIT_H_
+
+#include <stdint.h>
+
+#define RATELIMIT_DEFAULT_ENTRIES (1 << 16)
+
+struct ratelimit;
+
+struct ratelimit_config
+{
+        unsigned int rate;        /* Replies a second to one source, 0 for
+                                   * no limit. */
+        unsigned int burst;       /* Replies a source may get at once. */
+        unsigned int cap;         /* Replies a second to all sources
+                                   * together, 0 for no cap. */
+        unsigned int entries;     /* Sources tracked, a power of two. */
+};
+
+enum ratelimit_verdict
+{
+        RATELIMIT_PASS,
+        RATELIMIT_SOURCE,         /* The source is over its rate. */
+        RATELIMIT_CAP             /* All sources are over the cap. */
+};
+
+struct ratelimit_stats
+{
+        unsigned long long source_drops;
+        unsigned long long cap_drops;
+        unsigned long long evictions; /* Sources pushed out of the table. */
+};
+
+/* Creates a limiter for one of num_shares workers, which gets that share
+ * of the cap. All memory is allocated here. Returns NULL on failure, with
+ * the reason printed.
+ */
+extern struct ratelimit *ratelimit_create(const struct ratelimit_config *config,
+                                          unsigned int num_shares);
+
+/* Takes a token for a reply to the source of the IPv4 or IPv6 packet at
+ * net, at now_ns, from the bucket of the source and from the cap, or
+ * from neither when one of them is empty. Counts the drops into stats.
+ */
+extern enum ratelimit_verdict ratelimit_check(struct ratelimit *limiter,
+                                              const unsigned char *net,
+                                              int ipv6, uint64_t now_ns,
+                                              struct ratelimit_stats *stats);
+
+extern void ratelimit_destroy(struct ratelimit *limiter);
+
+#endif
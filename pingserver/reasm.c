@@ -0,0 +1,648 @@
+/* This file implements the fragment reassembly of the ping server, for
+ * IPv4 and IPv6 echo requests too large for one packet.
+ *
+ * All memory is taken once, up front, within the configured ceiling: a
+ * fixed number of packet entries, a hash table over them, a pool of 1 KB
+ * chunks for the fragment data and one buffer for a whole packet. A
+ * fragment is copied into the chunks of its packet that its bytes fall
+ * into, taken from the pool as they are first needed, so that small
+ * packets hold little of the pool and a packet of 64 KB can still be put
+ * together. A flood of fragments can therefore cost the server nothing
+ * but the table it already has.
+ *
+ * The entries are kept in the order they were made, which with a single
+ * timeout is the order they expire in. Expired ones are dropped from the
+ * old end on every fragment, and when no entry or chunk is free the
+ * oldest packet is pushed out to make room.
+ *
+ * The bytes received of a packet are kept as a short sorted list of
+ * ranges, merged as they meet. A fragment that overlaps one received
+ * before drops the whole packet (RFC 5722), as does a last fragment that
+ * disagrees with the length known, or a packet that grows past 64 KB.
+ *
+ * The packet is put back together with the IP header of its first
+ * fragment. The extension headers of an IPv6 fragment before its
+ * fragment header are left out, as they are of every reply.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cksum.h"
+#include "echo.h"
+#include "reasm.h"
+
+#define NS_PER_MS 1000000ULL
+#define CHUNK_SIZE 1024
+#define MAX_CHUNKS ((ECHO_MAX_PACKET_LEN + CHUNK_SIZE - 1) / CHUNK_SIZE)
+#define CHUNKS_PER_ENTRY 8        /* Room in the pool per entry. */
+#define MAX_RANGES 32
+#define MAX_IP_HDR_LEN 60
+#define NONE 0xffffffffU
+
+struct range
+{
+        uint32_t start;
+        uint32_t end;
+};
+
+struct entry
+{
+        unsigned char addrs[32];  /* Source, then destination. */
+        uint32_t id;
+        int ipv6;
+        uint64_t expires_ns;
+        uint32_t next;            /* In the hash chain or the free list. */
+        uint32_t older;
+        uint32_t newer;
+        uint32_t total_len;       /* Of the data, 0 until the last
+                                   * fragment. */
+        uint32_t max_fragment;
+        uint32_t hdr_len;         /* Of the first fragment, 0 until it
+                                   * came. */
+        uint32_t link_len;
+        uint8_t next_hdr;         /* Of an IPv6 first fragment. */
+        uint32_t num_ranges;
+        struct range ranges[MAX_RANGES];
+        uint32_t chunks[MAX_CHUNKS];
+        unsigned char hdr[ECHO_MAX_LINK_LEN + MAX_IP_HDR_LEN];
+};
+
+/* What identifies the packet of a fragment, and where its data goes. */
+struct fragment
+{
+        unsigned char addrs[32];
+        uint32_t id;
+        uint32_t start;
+        uint32_t end;
+        int more;
+        const unsigned char *data;
+        unsigned int len;         /* Of the IP packet. */
+};
+
+struct reasm
+{
+        struct entry *entries;
+        uint32_t *buckets;
+        unsigned int hash_shift;
+        uint32_t free_entries;
+        uint32_t oldest;
+        uint32_t newest;
+        unsigned char *pool;
+        uint32_t *free_chunks;
+        unsigned int num_free_chunks;
+        uint64_t timeout_ns;
+        unsigned char *out;       /* The last packet put together. */
+};
+
+struct reasm *reasm_create(const struct reasm_config *config)
+{
+        struct reasm *table;
+        size_t per_entry = sizeof(struct entry) + 2 * sizeof(uint32_t) +
+                CHUNKS_PER_ENTRY * (CHUNK_SIZE + sizeof(uint32_t));
+        size_t fixed = sizeof(struct reasm) + ECHO_MAX_REPLY_LEN;
+        unsigned int num_entries;
+        unsigned int num_chunks;
+        unsigned int bits = 0;
+        unsigned int i;
+
+        if (config->memory < fixed + per_entry)
+        {
+                fprintf(stderr, "Reassembly needs at least %zu bytes.\n",
+                        fixed + per_entry);
+                return NULL;
+        }
+        num_entries = (config->memory - fixed) / per_entry;
+        num_chunks = num_entries * CHUNKS_PER_ENTRY;
+        while ((1U << bits) < num_entries)
+        {
+                bits++;
+        }
+
+        table = calloc(1, sizeof(*table));
+        if (table == NULL)
+        {
+                perror("calloc");
+                return NULL;
+        }
+        table->entries = calloc(num_entries, sizeof(struct entry));
+        table->buckets = malloc((1U << bits) * sizeof(uint32_t));
+        table->pool = malloc((size_t)num_chunks * CHUNK_SIZE);
+        table->free_chunks = malloc(num_chunks * sizeof(uint32_t));
+        table->out = malloc(ECHO_MAX_REPLY_LEN);
+        if (table->entries == NULL || table->buckets == NULL ||
+            table->pool == NULL || table->free_chunks == NULL ||
+            table->out == NULL)
+        {
+                perror("malloc");
+                reasm_destroy(table);
+                return NULL;
+        }
+
+        table->hash_shift = 64 - bits;
+        memset(table->buckets, 0xff, (1U << bits) * sizeof(uint32_t));
+        for (i = 0; i < num_entries; i++)
+        {
+                table->entries[i].next = (i + 1 < num_entries) ? i + 1 : NONE;
+        }
+        table->free_entries = 0;
+        table->oldest = NONE;
+        table->newest = NONE;
+        for (i = 0; i < num_chunks; i++)
+        {
+                table->free_chunks[i] = i;
+        }
+        table->num_free_chunks = num_chunks;
+        table->timeout_ns = config->timeout_ms * NS_PER_MS;
+
+        return table;
+}
+
+static uint32_t get_bucket(const struct reasm *table,
+                           const unsigned char *addrs, uint32_t id, int ipv6)
+{
+        uint64_t hash = id | ((uint64_t)ipv6 << 32);
+        uint64_t word;
+        unsigned int i;
+
+        for (i = 0; i < 32; i += sizeof(word))
+        {
+                memcpy(&word, addrs + i, sizeof(word));
+                hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        }
+
+        return (table->hash_shift == 64) ? 0 : hash >> table->hash_shift;
+}
+
+static uint32_t find_entry(const struct reasm *table,
+                           const struct fragment *fragment, int ipv6)
+{
+        uint32_t index = table->buckets[get_bucket(table, fragment->addrs,
+                                                   fragment->id, ipv6)];
+        const struct entry *entry;
+
+        while (index != NONE)
+        {
+                entry = &table->entries[index];
+                if (entry->id == fragment->id && entry->ipv6 == ipv6 &&
+                    memcmp(entry->addrs, fragment->addrs,
+                           sizeof(entry->addrs)) == 0)
+                {
+                        return index;
+                }
+                index = entry->next;
+        }
+
+        return NONE;
+}
+
+static void drop_entry(struct reasm *table, uint32_t index)
+{
+        struct entry *entry = &table->entries[index];
+        uint32_t *link = &table->buckets[get_bucket(table, entry->addrs,
+                                                    entry->id, entry->ipv6)];
+        unsigned int i;
+
+        while (*link != index)
+        {
+                link = &table->entries[*link].next;
+        }
+        *link = entry->next;
+
+        if (entry->older != NONE)
+        {
+                table->entries[entry->older].newer = entry->newer;
+        }
+        else
+        {
+                table->oldest = entry->newer;
+        }
+        if (entry->newer != NONE)
+        {
+                table->entries[entry->newer].older = entry->older;
+        }
+        else
+        {
+                table->newest = entry->older;
+        }
+
+        for (i = 0; i < MAX_CHUNKS; i++)
+        {
+                if (entry->chunks[i] != NONE)
+                {
+                        table->free_chunks[table->num_free_chunks++] =
+                                entry->chunks[i];
+                }
+        }
+
+        entry->next = table->free_entries;
+        table->free_entries = index;
+}
+
+/* Pushes out the oldest packet but keep. Returns 0 if there is none. */
+static int evict_entry(struct reasm *table, uint32_t keep,
+                       struct reasm_stats *stats)
+{
+        uint32_t index = table->oldest;
+
+        if (index == keep && index != NONE)
+        {
+                index = table->entries[index].newer;
+        }
+        if (index == NONE)
+        {
+                return 0;
+        }
+        drop_entry(table, index);
+        stats->evictions++;
+
+        return 1;
+}
+
+static void expire_entries(struct reasm *table, uint64_t now_ns,
+                           struct reasm_stats *stats)
+{
+        while (table->oldest != NONE &&
+               table->entries[table->oldest].expires_ns <= now_ns)
+        {
+                drop_entry(table, table->oldest);
+                stats->timeouts++;
+        }
+}
+
+static uint32_t make_entry(struct reasm *table,
+                           const struct fragment *fragment, int ipv6,
+                           unsigned int link_len, uint64_t now_ns,
+                           struct reasm_stats *stats)
+{
+        struct entry *entry;
+        uint32_t bucket;
+        uint32_t index;
+
+        if (table->free_entries == NONE)
+        {
+                evict_entry(table, NONE, stats);
+        }
+        index = table->free_entries;
+        entry = &table->entries[index];
+        table->free_entries = entry->next;
+
+        memcpy(entry->addrs, fragment->addrs, sizeof(entry->addrs));
+        entry->id = fragment->id;
+        entry->ipv6 = ipv6;
+        entry->expires_ns = now_ns + table->timeout_ns;
+        entry->total_len = 0;
+        entry->max_fragment = 0;
+        entry->hdr_len = 0;
+        entry->link_len = link_len;
+        entry->num_ranges = 0;
+        memset(entry->chunks, 0xff, sizeof(entry->chunks));
+
+        bucket = get_bucket(table, entry->addrs, entry->id, ipv6);
+        entry->next = table->buckets[bucket];
+        table->buckets[bucket] = index;
+
+        entry->older = table->newest;
+        entry->newer = NONE;
+        if (table->newest != NONE)
+        {
+                table->entries[table->newest].newer = index;
+        }
+        else
+        {
+                table->oldest = index;
+        }
+        table->newest = index;
+
+        return index;
+}
+
+/* Adds the range of a fragment to those received. Returns 0 if it
+ * overlaps one of them or there are too many.
+ */
+static int add_range(struct entry *entry, uint32_t start, uint32_t end)
+{
+        struct range *ranges = entry->ranges;
+        unsigned int num = entry->num_ranges;
+        unsigned int i;
+        int join_before;
+        int join_after;
+
+        for (i = 0; i < num && ranges[i].start < start; i++)
+        {
+        }
+        if ((i > 0 && ranges[i - 1].end > start) ||
+            (i < num && ranges[i].start < end))
+        {
+                return 0;
+        }
+
+        join_before = i > 0 && ranges[i - 1].end == start;
+        join_after = i < num && ranges[i].start == end;
+        if (join_before && join_after)
+        {
+                ranges[i - 1].end = ranges[i].end;
+                memmove(&ranges[i], &ranges[i + 1],
+                        (num - i - 1) * sizeof(*ranges));
+                entry->num_ranges--;
+        }
+        else if (join_before)
+        {
+                ranges[i - 1].end = end;
+        }
+        else if (join_after)
+        {
+                ranges[i].start = start;
+        }
+        else
+        {
+                if (num == MAX_RANGES)
+                {
+                        return 0;
+                }
+                memmove(&ranges[i + 1], &ranges[i],
+                        (num - i) * sizeof(*ranges));
+                ranges[i].start = start;
+                ranges[i].end = end;
+                entry->num_ranges++;
+        }
+
+        return 1;
+}
+
+/* Copies the data of a fragment into the chunks of its entry, taking
+ * chunks from the pool, or from older packets, as needed. Returns 0 if
+ * there is no room even so.
+ */
+static int copy_data(struct reasm *table, uint32_t index,
+                     const struct fragment *fragment,
+                     struct reasm_stats *stats)
+{
+        struct entry *entry = &table->entries[index];
+        uint32_t first = fragment->start / CHUNK_SIZE;
+        uint32_t last = (fragment->end - 1) / CHUNK_SIZE;
+        uint32_t offset = fragment->start;
+        uint32_t chunk;
+        unsigned int len;
+
+        for (chunk = first; chunk <= last; chunk++)
+        {
+                if (entry->chunks[chunk] != NONE)
+                {
+                        continue;
+                }
+                if (table->num_free_chunks == 0 &&
+                    !evict_entry(table, index, stats))
+                {
+                        return 0;
+                }
+                entry->chunks[chunk] =
+                        table->free_chunks[--table->num_free_chunks];
+        }
+
+        while (offset < fragment->end)
+        {
+                chunk = offset / CHUNK_SIZE;
+                len = CHUNK_SIZE - offset % CHUNK_SIZE;
+                if (len > fragment->end - offset)
+                {
+                        len = fragment->end - offset;
+                }
+                memcpy(table->pool +
+                       (size_t)entry->chunks[chunk] * CHUNK_SIZE +
+                       offset % CHUNK_SIZE,
+                       fragment->data + (offset - fragment->start), len);
+                offset += len;
+        }
+
+        return 1;
+}
+
+/* Fills in fragment from an IPv4 fragment. Returns 0 if it is invalid. */
+static int get_fragment4(const unsigned char *net, unsigned int hdr_len,
+                         struct fragment *fragment)
+{
+        const struct ip *ip_hdr = (const struct ip *)net;
+        uint16_t off = ntohs(ip_hdr->ip_off);
+
+        memset(fragment->addrs, 0, sizeof(fragment->addrs));
+        memcpy(fragment->addrs, &ip_hdr->ip_src, sizeof(ip_hdr->ip_src));
+        memcpy(fragment->addrs + 16, &ip_hdr->ip_dst, sizeof(ip_hdr->ip_dst));
+        fragment->id = ntohs(ip_hdr->ip_id);
+        fragment->start = (off & IP_OFFMASK) * 8;
+        fragment->end = fragment->start + ntohs(ip_hdr->ip_len) - hdr_len;
+        fragment->more = (off & IP_MF) != 0;
+        fragment->data = net + hdr_len;
+        fragment->len = ntohs(ip_hdr->ip_len);
+
+        return fragment->end + sizeof(struct ip) <= ECHO_MAX_PACKET_LEN;
+}
+
+/* The same for an IPv6 fragment, its fragment header hdr_len bytes in. */
+static int get_fragment6(const unsigned char *net, unsigned int hdr_len,
+                         struct fragment *fragment)
+{
+        const struct ip6_hdr *ip6_hdr = (const struct ip6_hdr *)net;
+        const struct ip6_frag *frag_hdr = (const struct ip6_frag *)(net +
+                                                                  hdr_len);
+        unsigned int end = sizeof(struct ip6_hdr) + ntohs(ip6_hdr->ip6_plen);
+
+        memcpy(fragment->addrs, &ip6_hdr->ip6_src, sizeof(fragment->addrs));
+        fragment->id = ntohl(frag_hdr->ip6f_ident);
+        fragment->start = ntohs(frag_hdr->ip6f_offlg & IP6F_OFF_MASK);
+        fragment->end = fragment->start + end - hdr_len - sizeof(*frag_hdr);
+        fragment->more = (frag_hdr->ip6f_offlg & IP6F_MORE_FRAG) != 0;
+        fragment->data = (const unsigned char *)(frag_hdr + 1);
+        fragment->len = end;
+
+        return fragment->end <= ECHO_MAX_PACKET_LEN;
+}
+
+/* Keeps the headers of the first fragment, without those of IPv6 that
+ * come before the fragment header.
+ */
+static void keep_header(struct entry *entry, const unsigned char *frame,
+                        unsigned int link_len, unsigned int hdr_len)
+{
+        const struct ip6_frag *frag_hdr;
+
+        if (entry->ipv6)
+        {
+                frag_hdr = (const struct ip6_frag *)(frame + link_len +
+                                                     hdr_len);
+                entry->next_hdr = frag_hdr->ip6f_nxt;
+                hdr_len = sizeof(struct ip6_hdr);
+        }
+        entry->hdr_len = link_len + hdr_len;
+        memcpy(entry->hdr, frame, entry->hdr_len);
+}
+
+/* Puts the packet of a complete entry together in the out buffer. */
+static void assemble(struct reasm *table, const struct entry *entry,
+                     struct reasm_packet *packet)
+{
+        unsigned char *out = table->out;
+        struct ip *ip_hdr = (struct ip *)(out + entry->link_len);
+        struct ip6_hdr *ip6_hdr = (struct ip6_hdr *)(out + entry->link_len);
+        uint32_t offset;
+        unsigned int len;
+
+        memcpy(out, entry->hdr, entry->hdr_len);
+        if (entry->ipv6)
+        {
+                ip6_hdr->ip6_plen = htons(entry->total_len);
+                ip6_hdr->ip6_nxt = entry->next_hdr;
+        }
+        else
+        {
+                ip_hdr->ip_len = htons(entry->hdr_len - entry->link_len +
+                                       entry->total_len);
+                ip_hdr->ip_off = 0;
+                ip_hdr->ip_sum = 0;
+                ip_hdr->ip_sum = cksum(ip_hdr, entry->hdr_len -
+                                       entry->link_len);
+        }
+
+        for (offset = 0; offset < entry->total_len; offset += len)
+        {
+                len = entry->total_len - offset;
+                if (len > CHUNK_SIZE)
+                {
+                        len = CHUNK_SIZE;
+                }
+                memcpy(out + entry->hdr_len + offset,
+                       table->pool + (size_t)entry->chunks[offset /
+                                                           CHUNK_SIZE] *
+                       CHUNK_SIZE, len);
+        }
+
+        packet->frame = out;
+        packet->len = entry->hdr_len + entry->total_len;
+        packet->max_fragment = entry->max_fragment;
+}
+
+static int is_complete(const struct entry *entry)
+{
+        return entry->total_len != 0 && entry->num_ranges == 1 &&
+                entry->ranges[0].start == 0 &&
+                entry->ranges[0].end == entry->total_len;
+}
+
+/* Takes the fragment into its entry. Returns 0 if it is at odds with
+ * those received before.
+ */
+static int take_fragment(struct reasm *table, uint32_t index,
+                         const struct fragment *fragment,
+                         struct reasm_stats *stats)
+{
+        struct entry *entry = &table->entries[index];
+
+        if (!fragment->more)
+        {
+                if ((entry->total_len != 0 &&
+                     entry->total_len != fragment->end) ||
+                    (entry->num_ranges > 0 &&
+                     entry->ranges[entry->num_ranges - 1].end >
+                     fragment->end))
+                {
+                        return 0;
+                }
+                entry->total_len = fragment->end;
+        }
+        else if (entry->total_len != 0 && fragment->end > entry->total_len)
+        {
+                return 0;
+        }
+
+        if (!add_range(entry, fragment->start, fragment->end))
+        {
+                return 0;
+        }
+        if (!copy_data(table, index, fragment, stats))
+        {
+                return 0;
+        }
+        if (entry->link_len + fragment->len > entry->max_fragment)
+        {
+                entry->max_fragment = entry->link_len + fragment->len;
+        }
+
+        return 1;
+}
+
+int reasm_add(struct reasm *table, const unsigned char *frame,
+              unsigned int link_len, int ipv6,
+              unsigned int hdr_len, uint64_t now_ns,
+              struct reasm_stats *stats, struct reasm_packet *packet)
+{
+        const unsigned char *net = frame + link_len;
+        struct fragment fragment;
+        struct entry *entry;
+        uint32_t index;
+        int valid;
+
+        stats->fragments++;
+        expire_entries(table, now_ns, stats);
+
+        valid = ipv6 ? get_fragment6(net, hdr_len, &fragment) :
+                get_fragment4(net, hdr_len, &fragment);
+        if (!valid || link_len > ECHO_MAX_LINK_LEN ||
+            fragment.end == fragment.start ||
+            (fragment.more && (fragment.end - fragment.start) % 8 != 0))
+        {
+                stats->invalid++;
+                return 0;
+        }
+
+        index = find_entry(table, &fragment, ipv6);
+        if (index == NONE)
+        {
+                index = make_entry(table, &fragment, ipv6, link_len, now_ns,
+                                   stats);
+        }
+        entry = &table->entries[index];
+
+        if (!take_fragment(table, index, &fragment, stats))
+        {
+                drop_entry(table, index);
+                stats->invalid++;
+                return 0;
+        }
+        if (fragment.start == 0)
+        {
+                keep_header(entry, frame, link_len, hdr_len);
+        }
+        if (!is_complete(entry))
+        {
+                return 0;
+        }
+
+        if (entry->hdr_len - link_len + entry->total_len >
+            (ipv6 ? sizeof(struct ip6_hdr) : 0) + ECHO_MAX_PACKET_LEN)
+        {
+                drop_entry(table, index);
+                stats->invalid++;
+                return 0;
+        }
+        assemble(table, entry, packet);
+        drop_entry(table, index);
+        stats->reassembled++;
+
+        return 1;
+}
+
+void reasm_destroy(struct reasm *table)
+{
+        free(table->entries);
+        free(table->buckets);
+        free(table->pool);
+        free(table->free_chunks);
+        free(table->out);
+        free(table);
+}
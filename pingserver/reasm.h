@@ -0,0 +1,58 @@
+#ifndef __REASM_H_
+#define __REASM_H_
+
+#include <stdint.h>
+
+#define REASM_DEFAULT_MEMORY (4 << 20)
+#define REASM_DEFAULT_TIMEOUT_MS 5000
+
+struct reasm;
+
+struct reasm_config
+{
+        unsigned int memory;      /* Bytes, all of the table included. */
+        unsigned int timeout_ms;  /* A packet not complete by then is
+                                   * dropped. */
+};
+
+struct reasm_stats
+{
+        unsigned long long fragments;
+        unsigned long long reassembled;
+        unsigned long long timeouts;  /* Packets dropped incomplete. */
+        unsigned long long evictions; /* Packets pushed out for room. */
+        unsigned long long invalid;   /* Overlapping, too long or
+                                       * inconsistent fragments. */
+};
+
+/* A packet put back together, link layer header included. It lies in a
+ * buffer of the table, valid until the next fragment is added.
+ */
+struct reasm_packet
+{
+        const unsigned char *frame;
+        unsigned int len;
+        unsigned int max_fragment; /* The largest fragment, link layer
+                                    * header included. */
+};
+
+/* Creates a table in config->memory bytes, all allocated here. Returns
+ * NULL on failure, with the reason printed.
+ */
+extern struct reasm *reasm_create(const struct reasm_config *config);
+
+/* Adds the IPv4 or IPv6 fragment in frame, after link_len bytes of link
+ * layer header, at now_ns. It must have been found a fragment by
+ * echo_parse, which also gives hdr_len: of an IPv4 fragment the length
+ * of its IP header, of an IPv6 fragment the offset of its fragment
+ * header. Returns 1 and fills in packet when the fragment completes a
+ * packet.
+ */
+extern int reasm_add(struct reasm *table, const unsigned char *frame,
+                     unsigned int link_len, int ipv6,
+                     unsigned int hdr_len, uint64_t now_ns,
+                     struct reasm_stats *stats, struct reasm_packet *packet);
+
+extern void reasm_destroy(struct reasm *table);
+
+#endif
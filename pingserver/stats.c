@@ -0,0 +1,133 @@
+/* This file implements the statistics segment of the ping server, the
+ * counters and processing time histograms of every worker in a memory
+ * mapped file, by default in /dev/shm.
+ *
+ * Every worker counts into its own part of the segment, on cache lines
+ * of its own, with plain stores and no lock or atomic read-modify-write.
+ * A reader like pingstat maps the file read only and copies what it
+ * needs, so watching the server costs the workers nothing.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+size_t stats_size(unsigned int num_workers)
+{
+        return sizeof(struct stats_segment) +
+                num_workers * sizeof(struct stats_worker);
+}
+
+uint64_t stats_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+struct stats_segment *stats_create(const char *path, unsigned int num_workers)
+{
+        struct stats_segment *segment;
+        size_t size = stats_size(num_workers);
+        unsigned int i;
+        int fd;
+
+        /* A new file, so that a reader of the old one never sees it
+         * shrink under its feet.
+         */
+        unlink(path);
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0)
+        {
+                perror(path);
+                return NULL;
+        }
+        if (ftruncate(fd, size) != 0)
+        {
+                perror("ftruncate");
+                close(fd);
+                return NULL;
+        }
+
+        segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (segment == MAP_FAILED)
+        {
+                perror("mmap");
+                return NULL;
+        }
+
+        segment->num_workers = num_workers;
+        segment->pid = getpid();
+        segment->start_ns = stats_now_ns();
+        for (i = 0; i < num_workers; i++)
+        {
+                histogram_init(&segment->workers[i].processing,
+                               STATS_HISTOGRAM_PRECISION);
+        }
+
+        /* The magic last, a reader takes the segment as ready by it. */
+        __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+        return segment;
+}
+
+const struct stats_segment *stats_open(const char *path)
+{
+        const struct stats_segment *segment;
+        struct stat st;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+                perror(path);
+                return NULL;
+        }
+        if ((size_t)st.st_size < sizeof(*segment))
+        {
+                fprintf(stderr, "%s: not a pingserver statistics "
+                        "segment.\n", path);
+                close(fd);
+                return NULL;
+        }
+
+        segment = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (segment == MAP_FAILED)
+        {
+                perror("mmap");
+                return NULL;
+        }
+
+        if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) !=
+            STATS_MAGIC ||
+            (size_t)st.st_size < stats_size(segment->num_workers))
+        {
+                fprintf(stderr, "%s: not a pingserver statistics "
+                        "segment.\n", path);
+                munmap((void *)segment, st.st_size);
+                return NULL;
+        }
+
+        return segment;
+}
+
+void stats_close(const struct stats_segment *segment, const char *path)
+{
+        munmap((void *)segment, stats_size(segment->num_workers));
+        if (path != NULL)
+        {
+                unlink(path);
+        }
+}
@@ -0,0 +1,69 @@
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "histogram.h"
+#include "pktring.h"
+#include "ratelimit.h"
+#include "reasm.h"
+
+#define STATS_MAGIC 0x70737433 /* "pst3" */
+#define STATS_DEFAULT_PATH "/dev/shm/pingserver.stats"
+#define STATS_HISTOGRAM_PRECISION 5
+#define STATS_CACHE_LINE_SIZE 64
+
+/* The counters of one worker. Only the worker writes them, and readers
+ * take them without a lock, so a reader may see a histogram that is one
+ * frame ahead of its counters.
+ */
+struct stats_worker
+{
+        unsigned long long frames;        /* Taken from the ring. */
+        unsigned long long requests;      /* Echo requests among them. */
+        unsigned long long replies;
+        unsigned long long too_large;
+        unsigned long long bad_cksums;
+        unsigned long long cksum_mismatches;
+        unsigned long long fragmented_requests; /* Reassembled ones. */
+        unsigned long long fragmented_replies;
+        int32_t cpu;
+        uint32_t reserved;
+        struct ratelimit_stats limits;
+        struct reasm_stats reasm;
+        struct pktring_stats ring; /* Brought up to date now and then. */
+        struct histogram processing; /* Nanoseconds per frame. */
+} __attribute__((aligned(STATS_CACHE_LINE_SIZE)));
+
+/* The segment, a memory mapped file that pingstat reads while the server
+ * is running.
+ */
+struct stats_segment
+{
+        uint32_t magic;
+        uint32_t num_workers;
+        int32_t pid;
+        uint32_t verify;
+        uint64_t start_ns;        /* CLOCK_MONOTONIC. */
+        struct stats_worker workers[];
+};
+
+/* Creates the segment at path for num_workers workers, replacing any old
+ * one. Returns NULL on failure, with the reason printed.
+ */
+extern struct stats_segment *stats_create(const char *path,
+                                          unsigned int num_workers);
+
+/* Maps the segment at path read only, for a reader. */
+extern const struct stats_segment *stats_open(const char *path);
+
+extern size_t stats_size(unsigned int num_workers);
+
+/* Unmaps the segment, and with path not NULL removes it. */
+extern void stats_close(const struct stats_segment *segment,
+                        const char *path);
+
+extern uint64_t stats_now_ns(void);
+
+#endif
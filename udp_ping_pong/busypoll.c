@@ -0,0 +1,77 @@
+/* This file implements the helpers for the busy-poll mode of the echo
+ * server and client.
+ *
+ * A blocking receive puts the thread to sleep, and the wakeup when the
+ * datagram arrives costs a trip through the scheduler on every round
+ * trip. In busy-poll mode the receive is instead retried on the
+ * non-blocking socket for a spin budget, and only when that is spent the
+ * thread blocks as usual. The spin costs a CPU, so the thread should be
+ * pinned to a core of its own.
+ *
+ * Busy polling in the kernel (SO_BUSY_POLL) goes one step further and
+ * has an empty receive poll the device queue directly instead of waiting
+ * for the interrupt. It only works for sockets fed by a NAPI device
+ * queue, not loopback, and raising it above net.core.busy_read takes
+ * CAP_NET_ADMIN.
+ */
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "busypoll.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define CLOCK_EVERY 16 /* Spins between looks at the clock. */
+
+int busypoll_enable(int sfd, unsigned int usecs)
+{
+        int value = usecs;
+        int one = 1;
+
+        if (setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &value,
+                       sizeof(value)) != 0)
+        {
+                perror("setsockopt SO_BUSY_POLL");
+                return __LINE__;
+        }
+
+#ifdef SO_PREFER_BUSY_POLL
+        /* Keeps the device interrupts off while the socket is polled. */
+        if (setsockopt(sfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+                       sizeof(one)) != 0)
+        {
+                perror("setsockopt SO_PREFER_BUSY_POLL");
+                return __LINE__;
+        }
+#else
+        (void)one;
+#endif
+
+        return 0;
+}
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void busypoll_start(struct busypoll_spin *spin, uint64_t budget_ns)
+{
+        spin->deadline = now_ns() + budget_ns;
+        spin->iterations = 0;
+}
+
+int busypoll_expired(struct busypoll_spin *spin)
+{
+        if (++spin->iterations % CLOCK_EVERY != 0)
+        {
+                return 0;
+        }
+
+        return now_ns() >= spin->deadline;
+}
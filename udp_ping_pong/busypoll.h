@@ -0,0 +1,30 @@
+#ifndef __BUSYPOLL_H_
+#define __BUSYPOLL_H_
+
+#include <stdint.h>
+
+#define BUSYPOLL_MAX_USECS 1000000
+
+/* A spin on a non-blocking socket that gives up after a budget. */
+struct busypoll_spin
+{
+        uint64_t deadline;
+        unsigned int iterations;
+};
+
+/* Asks the kernel to busy poll the device queue of sfd for up to usecs
+ * when a receive finds the socket empty, with SO_BUSY_POLL and, where
+ * the headers have it, SO_PREFER_BUSY_POLL. Returns 0 on success,
+ * __LINE__ if the kernel refused.
+ */
+extern int busypoll_enable(int sfd, unsigned int usecs);
+
+/* Starts a spin of budget_ns nanoseconds. */
+extern void busypoll_start(struct busypoll_spin *spin, uint64_t budget_ns);
+
+/* Returns 1 once the budget is spent. Only looks at the clock every few
+ * calls, so it is cheap to call after every empty receive.
+ */
+extern int busypoll_expired(struct busypoll_spin *spin);
+
+#endif
@@ -1,12 +1,25 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
 #include <netdb.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
+#include "busypoll.h"
+#include "gso.h"
+#include "histogram.h"
+#include "loadgen.h"
+
 #define BUF_SIZE 500
+#define GSO_REPLY_TIMEOUT_MS 1000
+#define DEFAULT_OUTSTANDING 32
+#define DEFAULT_DURATION 10.0
+#define DEFAULT_TIMEOUT 1.0
+#define MAX_SOCKETS 1024
 
 /* This example looks for address info of a specified host:port that
  * is of type datagram, and tries to open a socket to this, and
@@ -17,6 +30,17 @@
  * When a socket has been opened, the specified message is sent to
  * this using write and read.
  *
+ * With the -g option the message is instead sent as a train of datagrams
+ * in one call with UDP_SEGMENT, and the echoes are received with UDP_GRO
+ * so that the kernel may hand them over coalesced (see gso.c).
+ *
+ * With the -L option the client is a load generator instead (see
+ * loadgen.c), and reports the achieved rate, loss, reordering and round
+ * trip time percentiles.
+ *
+ * With the -p option the replies are busy polled: the receive is retried
+ * without blocking for up to the given number of microseconds before
+ * the client blocks (see busypoll.c). Pin the client with -a.
  */
 static int
 get_server_addr_info(const char *server, const char *port,
@@ -71,7 +95,31 @@ static int get_connected_socket(struct addrinfo *addrinfo, int *result)
         return 0;
 }
 
-static int echo_client(int sfd, const char *msg)
+/* Receives like recv, but in busy-poll mode spins for up to spin_us
+ * before it blocks.
+ */
+static ssize_t receive(int sfd, char *buf, size_t len, unsigned int spin_us)
+{
+        struct busypoll_spin spin;
+        ssize_t nreceived;
+
+        if (spin_us > 0)
+        {
+                busypoll_start(&spin, spin_us * 1000ULL);
+                do
+                {
+                        nreceived = recv(sfd, buf, len, MSG_DONTWAIT);
+                        if (nreceived >= 0 || errno != EAGAIN)
+                        {
+                                return nreceived;
+                        }
+                } while (!busypoll_expired(&spin));
+        }
+
+        return recv(sfd, buf, len, 0);
+}
+
+static int echo_client(int sfd, const char *msg, unsigned int spin_us)
 {
         char buf[BUF_SIZE];
         size_t len;
@@ -87,7 +135,7 @@ static int echo_client(int sfd, const char *msg)
                 return __LINE__;
         }
 
-        nreceived = recv(sfd, buf, BUF_SIZE, 0);
+        nreceived = receive(sfd, buf, BUF_SIZE, spin_us);
         if (nreceived == -1)
         {
                 perror("read");
@@ -99,6 +147,183 @@ static int echo_client(int sfd, const char *msg)
         return 0;
 }
 
+static int echo_client_gso(int sfd, const char *msg, int num_segments)
+{
+        static char buf[GSO_BUF_SIZE];
+        char control[GSO_CONTROL_SIZE];
+        struct pollfd pollfd;
+        struct msghdr hdr;
+        struct iovec iov;
+        size_t len;
+        ssize_t status;
+        unsigned int received = 0;
+        unsigned int recv_calls = 0;
+        int i;
+
+        len = strlen(msg) + 1;
+        if (len * num_segments > sizeof(buf))
+        {
+                fprintf(stderr, "%d segments of %ld bytes do not fit in "
+                        "%ld bytes.\n", num_segments, (long)len,
+                        (long)sizeof(buf));
+                return __LINE__;
+        }
+
+        /* The payload is the message repeated, one per segment. */
+        for (i = 0; i < num_segments; i++)
+        {
+                memcpy(buf + i * len, msg, len);
+        }
+
+        iov.iov_base = buf;
+        iov.iov_len = len * num_segments;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        gso_set_segment_size(&hdr, len);
+
+        printf("Sending %d segments of %ld bytes: \"%s\"\n", num_segments,
+               (long)len, msg);
+        status = sendmsg(sfd, &hdr, 0);
+        if (status != (ssize_t)iov.iov_len)
+        {
+                perror("sendmsg");
+                return __LINE__;
+        }
+
+        /* Collect the echoes, lost segments end the wait after a while. */
+        pollfd.fd = sfd;
+        pollfd.events = POLLIN;
+        while (received < (unsigned int)num_segments &&
+               poll(&pollfd, 1, GSO_REPLY_TIMEOUT_MS) == 1)
+        {
+                iov.iov_len = sizeof(buf);
+                hdr.msg_controllen = sizeof(control);
+                status = recvmsg(sfd, &hdr, 0);
+                if (status == -1)
+                {
+                        perror("recvmsg");
+                        return __LINE__;
+                }
+                recv_calls++;
+                received += gso_num_segments(status,
+                                             gso_get_segment_size(&hdr));
+        }
+
+        printf("Received %u of %d segments in %u calls: \"%s\"\n", received,
+               num_segments, recv_calls, buf);
+
+        return (received == (unsigned int)num_segments) ? 0 : __LINE__;
+}
+
+static void print_usage(const char *name)
+{
+        fprintf(stderr, "Usage: %s [-g segments] [-p usecs] [-a cpu] "
+                "host port msg\n", name);
+        fprintf(stderr, "       %s -L [-r rate] [-w outstanding] [-l size] "
+                "[-d seconds]\n"
+                "          [-n sockets] [-t timeout] [-P precision] "
+                "[-o file]\n"
+                "          [-T] [-H device] [-p usecs] [-a cpu] host port\n",
+                name);
+        fprintf(stderr, "  -g  Send msg this many times in one UDP_SEGMENT "
+                "call (1-%d),\n"
+                "      and receive the echoes with UDP_GRO.\n",
+                GSO_MAX_SEGMENTS);
+        fprintf(stderr, "  -L  Load generator mode.\n");
+        fprintf(stderr, "  -r  Datagrams per second, 0 for as fast as the "
+                "outstanding limit allows.\n");
+        fprintf(stderr, "  -w  Most requests in flight, 0 for no limit "
+                "(default %d without -r).\n", DEFAULT_OUTSTANDING);
+        fprintf(stderr, "  -l  Payload bytes per datagram (%d-%d, the "
+                "largest UDP datagram).\n",
+                LOADGEN_MIN_PAYLOAD, LOADGEN_MAX_PAYLOAD);
+        fprintf(stderr, "  -d  Seconds to send for (default %.0f).\n",
+                DEFAULT_DURATION);
+        fprintf(stderr, "  -n  Source sockets, each with its own port "
+                "(1-%d).\n", MAX_SOCKETS);
+        fprintf(stderr, "  -t  Seconds before a request counts as lost "
+                "(default %.0f).\n", DEFAULT_TIMEOUT);
+        fprintf(stderr, "  -P  Bits of RTT histogram precision (%d-%d, "
+                "default %d).\n", HISTOGRAM_MIN_PRECISION,
+                HISTOGRAM_MAX_PRECISION, HISTOGRAM_DEFAULT_PRECISION);
+        fprintf(stderr, "  -o  Dump the RTT histogram to file.\n");
+        fprintf(stderr, "  -T  Also report the RTT between the kernel "
+                "timestamps of requests\n"
+                "      and echoes.\n");
+        fprintf(stderr, "  -H  And between the hardware timestamps of the "
+                "NIC behind device,\n"
+                "      implies -T.\n");
+        fprintf(stderr, "  -p  Busy poll, spin up to usecs for a reply "
+                "before blocking (1-%d).\n", BUSYPOLL_MAX_USECS);
+        fprintf(stderr, "  -a  Pin the client to this CPU.\n");
+}
+
+static void pin_to_cpu(int cpu)
+{
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        {
+                perror("sched_setaffinity");
+        }
+}
+
+static void parse_loadgen_option(int opt, const char *arg,
+                                 struct loadgen_config *config,
+                                 int *outstanding_set)
+{
+        switch (opt)
+        {
+        case 'r':
+                config->rate = strtoul(arg, NULL, 0);
+                break;
+        case 'w':
+                config->outstanding = strtoul(arg, NULL, 0);
+                *outstanding_set = 1;
+                break;
+        case 'l':
+                config->payload_size = strtoul(arg, NULL, 0);
+                break;
+        case 'd':
+                config->duration = atof(arg);
+                break;
+        case 'n':
+                config->num_sockets = strtoul(arg, NULL, 0);
+                break;
+        case 't':
+                config->timeout = atof(arg);
+                break;
+        case 'P':
+                config->precision = strtoul(arg, NULL, 0);
+                break;
+        case 'o':
+                config->dump_path = arg;
+                break;
+        case 'T':
+                config->timestamps = 1;
+                break;
+        case 'H':
+                config->timestamps = 1;
+                config->hw_device = arg;
+                break;
+        }
+}
+
+static int is_valid_loadgen_config(struct loadgen_config *config)
+{
+        return config->payload_size >= LOADGEN_MIN_PAYLOAD &&
+                config->payload_size <= LOADGEN_MAX_PAYLOAD &&
+                config->duration > 0.0 && config->timeout > 0.0 &&
+                config->num_sockets >= 1 &&
+                config->num_sockets <= MAX_SOCKETS &&
+                config->precision >= HISTOGRAM_MIN_PRECISION &&
+                config->precision <= HISTOGRAM_MAX_PRECISION;
+}
+
 int main(int argc, char *argv[])
 {
         struct addrinfo *result;
@@ -107,17 +332,95 @@ int main(int argc, char *argv[])
         const char *host;
         const char *port;
         const char *msg;
+        struct loadgen_config config;
+        int outstanding_set = 0;
+        int load_mode = 0;
+        int num_segments = 0;
+        int spin_us = 0;
+        int cpu = -1;
+        int opt;
+
+        memset(&config, 0, sizeof(config));
+        config.payload_size = 64;
+        config.duration = DEFAULT_DURATION;
+        config.num_sockets = 1;
+        config.timeout = DEFAULT_TIMEOUT;
+        config.precision = HISTOGRAM_DEFAULT_PRECISION;
+
+        while ((opt = getopt(argc, argv, "g:Lr:w:l:d:n:t:P:o:TH:p:a:")) != -1)
+        {
+                switch (opt)
+                {
+                case 'g':
+                        num_segments = atoi(optarg);
+                        if (num_segments < 1 ||
+                            num_segments > GSO_MAX_SEGMENTS)
+                        {
+                                print_usage(argv[0]);
+                                exit(__LINE__);
+                        }
+                        break;
+                case 'L':
+                        load_mode = 1;
+                        break;
+                case 'p':
+                        spin_us = atoi(optarg);
+                        if (spin_us < 1 || spin_us > BUSYPOLL_MAX_USECS)
+                        {
+                                print_usage(argv[0]);
+                                exit(__LINE__);
+                        }
+                        break;
+                case 'a':
+                        cpu = atoi(optarg);
+                        if (cpu < 0)
+                        {
+                                print_usage(argv[0]);
+                                exit(__LINE__);
+                        }
+                        break;
+                case 'r':
+                case 'w':
+                case 'l':
+                case 'd':
+                case 'n':
+                case 't':
+                case 'P':
+                case 'o':
+                case 'T':
+                case 'H':
+                        parse_loadgen_option(opt, optarg, &config,
+                                             &outstanding_set);
+                        break;
+                default:
+                        print_usage(argv[0]);
+                        exit(__LINE__);
+                }
+        }
+
+        /* Unlimited rate needs a window, or it floods. */
+        if (config.rate == 0 && !outstanding_set)
+        {
+                config.outstanding = DEFAULT_OUTSTANDING;
+        }
 
-        if (argc < 3)
+        if (argc - optind != (load_mode ? 2 : 3) ||
+            (load_mode && !is_valid_loadgen_config(&config)))
         {
-                fprintf(stderr, "Usage: %s host port msg\n", argv[0]);
+                print_usage(argv[0]);
                 exit(__LINE__);
         }
 
-        host = argv[1];
-        port = argv[2];
-        msg = argv[3];
-        
+        host = argv[optind];
+        port = argv[optind + 1];
+        msg = argv[optind + 2];
+        config.spin_us = spin_us;
+
+        if (cpu >= 0)
+        {
+                pin_to_cpu(cpu);
+        }
+
         /* Get address information on specified host and port. */
         status = get_server_addr_info(host, port, &result);
         if (status != 0)
@@ -125,6 +428,13 @@ int main(int argc, char *argv[])
                 exit(status);
         }
 
+        if (load_mode)
+        {
+                status = loadgen_run(result, &config);
+                freeaddrinfo(result);
+                return status;
+        }
+
         /* Go through each addrinfo and try to open a socket an
          * connect to it. Either use the first one or exit.
          */
@@ -134,11 +444,27 @@ int main(int argc, char *argv[])
                 exit(status);
         }
         freeaddrinfo(result);
+        if (spin_us > 0)
+        {
+                busypoll_enable(sfd, spin_us);
+        }
 
         /* Send specified message as a separat datagram and read
          * the response from the server.
          */
-        status = echo_client(sfd, msg);
+        if (num_segments > 0)
+        {
+                status = gso_enable_gro(sfd);
+                if (status != 0)
+                {
+                        exit(status);
+                }
+                status = echo_client_gso(sfd, msg, num_segments);
+        }
+        else
+        {
+                status = echo_client(sfd, msg, spin_us);
+        }
         if (status != 0)
         {
                 exit(status);
@@ -0,0 +1,73 @@
+/* This file implements the helpers for UDP generic segmentation offload
+ * (UDP_SEGMENT) and generic receive offload (UDP_GRO).
+ * With GRO the kernel hands over a train of datagrams from the same flow
+ * as one large buffer, and tells the segment size in a cmsg. With GSO
+ * one large buffer and a segment size in a cmsg are sent as a train of
+ * datagrams. An echo of a GRO buffer with GSO, using the same segment
+ * size, sends back exactly the datagrams that were received.
+ */
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "gso.h"
+
+int gso_enable_gro(int sfd)
+{
+        int one = 1;
+
+        if (setsockopt(sfd, SOL_UDP, UDP_GRO, &one, sizeof(one)) != 0)
+        {
+                perror("setsockopt UDP_GRO");
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+int gso_get_segment_size(struct msghdr *msg)
+{
+        struct cmsghdr *cmsg;
+        int segment_size;
+
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(msg, cmsg))
+        {
+                if (cmsg->cmsg_level == SOL_UDP &&
+                    cmsg->cmsg_type == UDP_GRO)
+                {
+                        memcpy(&segment_size, CMSG_DATA(cmsg),
+                               sizeof(segment_size));
+                        return segment_size;
+                }
+        }
+
+        return 0;
+}
+
+void gso_set_segment_size(struct msghdr *msg, int segment_size)
+{
+        uint16_t size = segment_size;
+        struct cmsghdr *cmsg;
+
+        msg->msg_controllen = CMSG_SPACE(sizeof(size));
+        cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+        memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+}
+
+unsigned int gso_num_segments(size_t len, int segment_size)
+{
+        if (segment_size <= 0 || len <= (size_t)segment_size)
+        {
+                return 1;
+        }
+
+        return (len + segment_size - 1) / segment_size;
+}
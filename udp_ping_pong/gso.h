@@ -0,0 +1,32 @@
+#ifndef __GSO_H_
+#define __GSO_H_
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* Largest datagram the kernel hands over after GRO, or takes for GSO. */
+#define GSO_BUF_SIZE 65535
+
+/* Most segments one UDP_SEGMENT send may be split into. */
+#define GSO_MAX_SEGMENTS 64
+
+/* Room for the UDP_GRO cmsg on receive, or the UDP_SEGMENT cmsg on send. */
+#define GSO_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+/* Turns on UDP_GRO, returns 0 on success. */
+extern int gso_enable_gro(int sfd);
+
+/* Returns the segment size of a GRO coalesced datagram, or 0 when the
+ * datagram was received as it was sent.
+ */
+extern int gso_get_segment_size(struct msghdr *msg);
+
+/* Makes a send of msg split its payload into datagrams of segment_size
+ * bytes. The msg_control buffer must hold GSO_CONTROL_SIZE bytes.
+ */
+extern void gso_set_segment_size(struct msghdr *msg, int segment_size);
+
+/* Returns how many datagrams a payload of len bytes consists of. */
+extern unsigned int gso_num_segments(size_t len, int segment_size);
+
+#endif
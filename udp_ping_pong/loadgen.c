@@ -0,0 +1,633 @@
+/* This file implements the load generator mode of the echo client.
+ *
+ * Requests are sent open-loop: at the target rate whether replies come
+ * back or not, limited only by the number of requests allowed in flight.
+ * Without a target rate the client sends as fast as the in-flight limit
+ * allows, which makes it a closed-loop generator with that many
+ * outstanding requests.
+ *
+ * Every datagram starts with a sequence number and the time it was sent,
+ * so the round trip time is computed from the echo alone. The requests
+ * in flight are tracked in a ring of slots indexed by sequence number,
+ * which finds the request of a reply without any search, and lets the
+ * oldest requests time out as lost in order.
+ *
+ * Every round trip time goes into a log-linear histogram (histogram.c),
+ * which can be dumped to a file to compare runs.
+ *
+ * With a spin budget the generator busy polls: it keeps retrying the
+ * receives for that long before it waits in ppoll (see busypoll.c).
+ *
+ * The requests are spread round robin over several connected sockets.
+ * Each socket has a source port of its own, so receive side scaling on
+ * the server hashes them to different queues.
+ *
+ * With timestamps (tstamp.c) the kernel, and the NIC if asked and able,
+ * stamps every request as it leaves and every echo as it comes in, and
+ * their differences go into histograms of their own next to the one
+ * from clock_gettime(). The transmit timestamps come back on the error
+ * queue of each socket, numbered from 0 in the order of its sends: send
+ * k of socket i carried sequence number i + k * num_sockets.
+ */
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "busypoll.h"
+#include "histogram.h"
+#include "loadgen.h"
+#include "tstamp.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_US 1000ULL
+#define SEND_BURST 32
+#define MIN_FLIGHT_SLOTS 4096
+#define MAX_FLIGHT_SLOTS (1 << 20)
+#define SPIN_NS 50000 /* Closer than this to the next send, do not sleep. */
+
+struct payload_hdr
+{
+        uint64_t seq;
+        uint64_t send_ns;
+};
+
+struct flight_slot
+{
+        uint64_t seq;
+        uint64_t send_ns;
+        int in_flight;
+        struct tstamp tx;
+        struct tstamp rx;
+};
+
+struct loadgen
+{
+        const struct loadgen_config *config;
+        uint64_t timeout_ns;
+        int *sfds;
+        struct pollfd *pollfds;
+        char *send_buf;
+        char *recv_buf;
+
+        /* Requests in flight, indexed by sequence number. */
+        struct flight_slot *slots;
+        uint64_t slot_mask;
+        uint64_t next_seq;
+        uint64_t oldest_seq;
+        unsigned int in_flight;
+        /* Per socket, the highest sequence number answered plus one, 0
+         * before the first reply. The sockets are drained one after the
+         * other, so order only means something within one of them.
+         */
+        uint64_t *highest_seq;
+
+        /* Results. */
+        unsigned long long sent;
+        unsigned long long received;
+        unsigned long long lost;
+        unsigned long long reordered;
+        unsigned long long late;
+        unsigned long long send_errors;
+        unsigned long long spin_timeouts;
+        struct histogram rtt;
+        struct histogram kernel_rtt;
+        struct histogram hardware_rtt;
+};
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t round_up_pow2(uint64_t n)
+{
+        uint64_t pow2 = 1;
+
+        while (pow2 < n)
+        {
+                pow2 <<= 1;
+        }
+
+        return pow2;
+}
+
+static int open_sockets(struct loadgen *lg, const struct addrinfo *addrinfo)
+{
+        unsigned int i;
+        int sfd;
+
+        for (i = 0; i < lg->config->num_sockets; i++)
+        {
+                sfd = socket(addrinfo->ai_family,
+                             addrinfo->ai_socktype | SOCK_NONBLOCK,
+                             addrinfo->ai_protocol);
+                if (sfd == -1)
+                {
+                        perror("socket");
+                        return __LINE__;
+                }
+
+                /* Connecting picks the source port of the flow. */
+                if (connect(sfd, addrinfo->ai_addr, addrinfo->ai_addrlen) != 0)
+                {
+                        perror("connect");
+                        return __LINE__;
+                }
+
+                if (lg->config->spin_us > 0)
+                {
+                        busypoll_enable(sfd, lg->config->spin_us);
+                }
+                if (lg->config->timestamps &&
+                    tstamp_enable(sfd, lg->config->hw_device) != 0)
+                {
+                        return __LINE__;
+                }
+
+                lg->sfds[i] = sfd;
+                lg->pollfds[i].fd = sfd;
+                lg->pollfds[i].events = POLLIN;
+        }
+
+        return 0;
+}
+
+static int init_loadgen(struct loadgen *lg, const struct loadgen_config *config)
+{
+        uint64_t num_slots = MIN_FLIGHT_SLOTS;
+
+        memset(lg, 0, sizeof(*lg));
+        lg->config = config;
+        lg->timeout_ns = config->timeout * NS_PER_SEC;
+        if (histogram_init(&lg->rtt, config->precision) != 0 ||
+            histogram_init(&lg->kernel_rtt, config->precision) != 0 ||
+            histogram_init(&lg->hardware_rtt, config->precision) != 0)
+        {
+                fprintf(stderr, "Histogram precision must be %d-%d.\n",
+                        HISTOGRAM_MIN_PRECISION, HISTOGRAM_MAX_PRECISION);
+                return __LINE__;
+        }
+
+        /* Room for the window, and for the replies that arrive behind an
+         * older request that has not yet timed out.
+         */
+        if (config->outstanding * 4ULL > num_slots)
+        {
+                num_slots = config->outstanding * 4ULL;
+        }
+        if (config->rate * config->timeout > num_slots)
+        {
+                num_slots = config->rate * config->timeout;
+        }
+        if (num_slots > MAX_FLIGHT_SLOTS)
+        {
+                num_slots = MAX_FLIGHT_SLOTS;
+        }
+        num_slots = round_up_pow2(num_slots);
+        lg->slot_mask = num_slots - 1;
+
+        lg->slots = calloc(num_slots, sizeof(*lg->slots));
+        lg->sfds = calloc(config->num_sockets, sizeof(*lg->sfds));
+        lg->pollfds = calloc(config->num_sockets, sizeof(*lg->pollfds));
+        lg->highest_seq = calloc(config->num_sockets,
+                                 sizeof(*lg->highest_seq));
+        lg->send_buf = calloc(1, config->payload_size);
+        lg->recv_buf = calloc(1, config->payload_size);
+        if (lg->slots == NULL || lg->sfds == NULL || lg->pollfds == NULL ||
+            lg->highest_seq == NULL ||
+            lg->send_buf == NULL || lg->recv_buf == NULL)
+        {
+                fprintf(stderr, "Failed to allocate the load generator.\n");
+                return __LINE__;
+        }
+
+        return 0;
+}
+
+static void expire_oldest(struct loadgen *lg)
+{
+        struct flight_slot *slot = &lg->slots[lg->oldest_seq & lg->slot_mask];
+
+        if (slot->in_flight)
+        {
+                slot->in_flight = 0;
+                lg->in_flight--;
+                lg->lost++;
+        }
+        lg->oldest_seq++;
+}
+
+/* Moves past the answered requests, and counts the ones that have been
+ * waiting longer than the timeout as lost.
+ */
+static void expire(struct loadgen *lg, uint64_t now)
+{
+        struct flight_slot *slot;
+
+        while (lg->oldest_seq != lg->next_seq)
+        {
+                slot = &lg->slots[lg->oldest_seq & lg->slot_mask];
+                if (slot->in_flight && now - slot->send_ns < lg->timeout_ns)
+                {
+                        break;
+                }
+                expire_oldest(lg);
+        }
+}
+
+static int can_send(const struct loadgen *lg)
+{
+        return lg->config->outstanding == 0 ||
+                lg->in_flight < lg->config->outstanding;
+}
+
+static void send_request(struct loadgen *lg, uint64_t now)
+{
+        struct payload_hdr hdr;
+        struct flight_slot *slot;
+        int sfd;
+
+        /* A full ring makes room by giving up on the oldest request. */
+        if (lg->next_seq - lg->oldest_seq > lg->slot_mask)
+        {
+                expire_oldest(lg);
+        }
+
+        hdr.seq = lg->next_seq;
+        hdr.send_ns = now;
+        memcpy(lg->send_buf, &hdr, sizeof(hdr));
+
+        sfd = lg->sfds[lg->next_seq % lg->config->num_sockets];
+        if (send(sfd, lg->send_buf, lg->config->payload_size, 0) == -1)
+        {
+                lg->send_errors++;
+                return;
+        }
+
+        slot = &lg->slots[lg->next_seq & lg->slot_mask];
+        slot->seq = lg->next_seq;
+        slot->send_ns = now;
+        slot->in_flight = 1;
+        memset(&slot->tx, 0, sizeof(slot->tx));
+        memset(&slot->rx, 0, sizeof(slot->rx));
+        lg->in_flight++;
+        lg->sent++;
+        lg->next_seq++;
+}
+
+/* Counts the kernel and hardware round trip times of a request once
+ * both of their timestamps are in, whichever came last.
+ */
+static void record_tstamp_rtt(struct loadgen *lg, struct flight_slot *slot)
+{
+        if (slot->tx.software != 0 && slot->rx.software != 0)
+        {
+                histogram_record(&lg->kernel_rtt,
+                                 slot->rx.software - slot->tx.software);
+                slot->tx.software = 0;
+                slot->rx.software = 0;
+        }
+        if (slot->tx.hardware != 0 && slot->rx.hardware != 0)
+        {
+                histogram_record(&lg->hardware_rtt,
+                                 slot->rx.hardware - slot->tx.hardware);
+                slot->tx.hardware = 0;
+                slot->rx.hardware = 0;
+        }
+}
+
+static void handle_reply(struct loadgen *lg, size_t len,
+                         const struct tstamp *ts, uint64_t now)
+{
+        struct payload_hdr hdr;
+        struct flight_slot *slot;
+        uint64_t *highest;
+
+        if (len < sizeof(hdr))
+        {
+                return;
+        }
+        memcpy(&hdr, lg->recv_buf, sizeof(hdr));
+
+        slot = &lg->slots[hdr.seq & lg->slot_mask];
+        if (!slot->in_flight || slot->seq != hdr.seq)
+        {
+                /* Already timed out, or a duplicate. */
+                lg->late++;
+                return;
+        }
+        slot->in_flight = 0;
+        lg->in_flight--;
+        lg->received++;
+
+        /* The request went out on socket seq % num_sockets. */
+        highest = &lg->highest_seq[hdr.seq % lg->config->num_sockets];
+        if (hdr.seq + 1 < *highest)
+        {
+                lg->reordered++;
+        }
+        else
+        {
+                *highest = hdr.seq + 1;
+        }
+
+        histogram_record(&lg->rtt, now - hdr.send_ns);
+        slot->rx = *ts;
+        record_tstamp_rtt(lg, slot);
+}
+
+/* Takes the transmit timestamps of socket i off its error queue into the
+ * slots of their requests, those not taken over by later ones yet.
+ */
+static void receive_tx_timestamps(struct loadgen *lg, unsigned int i)
+{
+        struct flight_slot *slot;
+        struct tstamp ts;
+        uint64_t seq;
+        uint32_t key;
+
+        while (tstamp_read_tx(lg->sfds[i], &key, &ts))
+        {
+                seq = i + (uint64_t)key * lg->config->num_sockets;
+                slot = &lg->slots[seq & lg->slot_mask];
+                if (slot->seq != seq)
+                {
+                        continue;
+                }
+                if (ts.software != 0)
+                {
+                        slot->tx.software = ts.software;
+                }
+                if (ts.hardware != 0)
+                {
+                        slot->tx.hardware = ts.hardware;
+                }
+                record_tstamp_rtt(lg, slot);
+        }
+}
+
+/* Receives a reply on sfd like recv, with its timestamps in ts. */
+static ssize_t receive_reply(struct loadgen *lg, int sfd, struct tstamp *ts)
+{
+        char control[TSTAMP_CONTROL_SIZE];
+        struct msghdr msg;
+        struct iovec iov;
+        ssize_t len;
+
+        if (!lg->config->timestamps)
+        {
+                ts->software = 0;
+                ts->hardware = 0;
+                return recv(sfd, lg->recv_buf, lg->config->payload_size, 0);
+        }
+
+        iov.iov_base = lg->recv_buf;
+        iov.iov_len = lg->config->payload_size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        len = recvmsg(sfd, &msg, 0);
+        if (len >= 0)
+        {
+                tstamp_parse(&msg, ts);
+        }
+
+        return len;
+}
+
+/* Returns the number of replies received. */
+static unsigned int receive_replies(struct loadgen *lg)
+{
+        unsigned int count = 0;
+        struct tstamp ts;
+        unsigned int i;
+        ssize_t len;
+
+        for (i = 0; i < lg->config->num_sockets; i++)
+        {
+                if (lg->config->timestamps)
+                {
+                        receive_tx_timestamps(lg, i);
+                }
+                while ((len = receive_reply(lg, lg->sfds[i], &ts)) >= 0)
+                {
+                        handle_reply(lg, len, &ts, now_ns());
+                        count++;
+                }
+        }
+
+        return count;
+}
+
+static void wait_for_replies(struct loadgen *lg, uint64_t wait_ns)
+{
+        struct timespec ts;
+
+        ts.tv_sec = wait_ns / NS_PER_SEC;
+        ts.tv_nsec = wait_ns % NS_PER_SEC;
+        ppoll(lg->pollfds, lg->config->num_sockets, &ts, NULL);
+}
+
+static void run(struct loadgen *lg)
+{
+        const struct loadgen_config *config = lg->config;
+        uint64_t interval_ns = 0;
+        uint64_t start = now_ns();
+        uint64_t end = start + config->duration * NS_PER_SEC;
+        uint64_t next_send = start;
+        struct busypoll_spin spin;
+        int spinning = 0;
+        uint64_t wait_ns;
+        uint64_t now;
+        unsigned int burst;
+        unsigned int received;
+
+        if (config->rate > 0)
+        {
+                interval_ns = NS_PER_SEC / config->rate;
+        }
+
+        while ((now = now_ns()) < end)
+        {
+                /* Open loop, the schedule does not wait for replies. A
+                 * late start is caught up in bursts.
+                 */
+                for (burst = 0; burst < SEND_BURST && can_send(lg) &&
+                             (interval_ns == 0 || now >= next_send); burst++)
+                {
+                        send_request(lg, now);
+                        next_send += interval_ns;
+                }
+
+                received = receive_replies(lg);
+                expire(lg, now);
+                if (burst > 0 || received > 0)
+                {
+                        spinning = 0;
+                        continue;
+                }
+
+                /* Busy poll the sockets until the budget is spent. */
+                if (config->spin_us > 0)
+                {
+                        if (!spinning)
+                        {
+                                busypoll_start(&spin,
+                                               config->spin_us * NS_PER_US);
+                                spinning = 1;
+                        }
+                        if (!busypoll_expired(&spin))
+                        {
+                                continue;
+                        }
+                        spinning = 0;
+                        lg->spin_timeouts++;
+                }
+
+                wait_ns = NS_PER_SEC / 1000;
+                if (interval_ns > 0 && can_send(lg))
+                {
+                        wait_ns = (next_send > now) ? next_send - now : 0;
+                }
+                if (wait_ns >= SPIN_NS)
+                {
+                        wait_for_replies(lg, wait_ns - SPIN_NS);
+                }
+        }
+
+        /* Give the last requests the timeout to come back. */
+        end = now + lg->timeout_ns;
+        while (lg->in_flight > 0 && (now = now_ns()) < end)
+        {
+                if (receive_replies(lg) == 0)
+                {
+                        wait_for_replies(lg, end - now);
+                }
+        }
+        while (lg->oldest_seq != lg->next_seq)
+        {
+                expire_oldest(lg);
+        }
+}
+
+static void print_report(const struct loadgen *lg)
+{
+        const struct loadgen_config *config = lg->config;
+        double duration = config->duration;
+
+        printf("Sent %llu datagrams of %u bytes over %u sockets in %.2f s, "
+               "%.0f packets/s", lg->sent, config->payload_size,
+               config->num_sockets, duration, lg->sent / duration);
+        if (config->rate > 0)
+        {
+                printf(" (target %lu)", config->rate);
+        }
+        printf(".\n");
+        printf("Received %llu, %.0f packets/s.\n", lg->received,
+               lg->received / duration);
+        printf("Lost %llu (%.3f%%), reordered %llu, late or duplicate %llu, "
+               "send errors %llu.\n", lg->lost,
+               (lg->sent == 0) ? 0.0 : 100.0 * lg->lost / lg->sent,
+               lg->reordered, lg->late, lg->send_errors);
+        if (config->spin_us > 0)
+        {
+                printf("Busy-poll spins that spent the budget and "
+                       "blocked: %llu.\n", lg->spin_timeouts);
+        }
+
+        if (lg->received == 0)
+        {
+                return;
+        }
+
+        printf("RTT min %.1f us, avg %.1f us.\n",
+               lg->rtt.min / (double)NS_PER_US,
+               histogram_mean(&lg->rtt) / NS_PER_US);
+        histogram_print_summary(&lg->rtt, "RTT", stdout);
+        if (lg->kernel_rtt.total > 0)
+        {
+                histogram_print_summary(&lg->kernel_rtt, "Kernel RTT",
+                                        stdout);
+        }
+        if (lg->hardware_rtt.total > 0)
+        {
+                histogram_print_summary(&lg->hardware_rtt, "Hardware RTT",
+                                        stdout);
+        }
+}
+
+static int dump_histogram(const struct loadgen *lg, const char *path)
+{
+        FILE *out;
+
+        out = fopen(path, "w");
+        if (out == NULL)
+        {
+                perror(path);
+                return __LINE__;
+        }
+        histogram_dump(&lg->rtt, out);
+        fclose(out);
+
+        return 0;
+}
+
+int loadgen_run(const struct addrinfo *addrinfo,
+                const struct loadgen_config *config)
+{
+        struct loadgen *lg;
+        unsigned int i;
+        int status;
+
+        /* Far too large for the stack with its histogram. */
+        lg = malloc(sizeof(*lg));
+        if (lg == NULL)
+        {
+                fprintf(stderr, "Failed to allocate the load generator.\n");
+                return __LINE__;
+        }
+
+        status = init_loadgen(lg, config);
+        if (status == 0)
+        {
+                status = open_sockets(lg, addrinfo);
+        }
+        if (status == 0)
+        {
+                run(lg);
+                print_report(lg);
+                if (config->dump_path != NULL)
+                {
+                        status = dump_histogram(lg, config->dump_path);
+                }
+        }
+
+        for (i = 0; i < config->num_sockets; i++)
+        {
+                if (lg->sfds != NULL && lg->sfds[i] > 0)
+                {
+                        close(lg->sfds[i]);
+                }
+        }
+        free(lg->slots);
+        free(lg->sfds);
+        free(lg->pollfds);
+        free(lg->highest_seq);
+        free(lg->send_buf);
+        free(lg->recv_buf);
+        free(lg);
+
+        return status;
+}
@@ -0,0 +1,33 @@
+#ifndef __LOADGEN_H_
+#define __LOADGEN_H_
+
+#include <netdb.h>
+
+struct loadgen_config
+{
+        unsigned long rate;        /* Datagrams per second, 0 unlimited. */
+        unsigned int outstanding;  /* Most requests in flight, 0 no limit. */
+        unsigned int payload_size; /* Bytes per datagram. */
+        double duration;           /* Seconds of sending. */
+        unsigned int num_sockets;  /* Source sockets, one port each. */
+        double timeout;            /* Seconds before a request is lost. */
+        unsigned int precision;    /* Bits of the RTT histogram buckets. */
+        const char *dump_path;     /* Where to dump the histogram, or NULL. */
+        unsigned int spin_us;      /* Busy-poll spin budget, 0 to block. */
+        int timestamps;            /* RTT from kernel timestamps too. */
+        const char *hw_device;     /* NIC for hardware timestamps, or
+                                    * NULL. */
+};
+
+/* Smallest payload, room for the sequence number and send timestamp. */
+#define LOADGEN_MIN_PAYLOAD 16
+/* Largest, one UDP datagram in an IPv4 packet without GSO. */
+#define LOADGEN_MAX_PAYLOAD (65535 - 20 - 8)
+
+/* Runs the load generator against the echo server at addrinfo and prints
+ * the report. Returns 0 on success.
+ */
+extern int loadgen_run(const struct addrinfo *addrinfo,
+                       const struct loadgen_config *config);
+
+#endif
@@ -0,0 +1,331 @@
+/* This file implements the per-packet peer logging of the echo server.
+ * Resolving and printing the peer of every datagram from the echo loop
+ * costs far more than echoing it, getnameinfo may even block on a
+ * reverse DNS lookup. Instead the echo loop only copies the peer address
+ * into a ring, and a logging thread does the rest.
+ *
+ *   - Every producer (worker thread) has a single-producer single-consumer
+ *     ring of its own, so recording a peer is a copy and a release store.
+ *     A full ring drops the entry, the echo loop never waits for the log.
+ *   - The logging thread formats addresses numerically, without any name
+ *     lookup, and keeps the formatted names in a small direct-mapped
+ *     cache keyed by the address, so a busy peer is formatted once.
+ *   - With sampling only every Nth datagram of a producer is recorded.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "peerlog.h"
+
+#define CACHE_LINE_SIZE 64
+#define NAME_CACHE_SIZE 256 /* Must be a power of two. */
+#define PEER_NAME_LEN 64
+#define IDLE_SLEEP_NS 1000000
+
+struct peer_key
+{
+        unsigned short family;
+        unsigned short port;
+        unsigned int scope_id;
+        unsigned char addr[16];
+};
+
+struct log_ring
+{
+        /* Producer side. */
+        _Atomic unsigned int tail __attribute__((aligned(CACHE_LINE_SIZE)));
+        unsigned int head_cache;
+        unsigned int sample_count;
+        unsigned long long dropped;
+
+        /* Consumer side. */
+        _Atomic unsigned int head __attribute__((aligned(CACHE_LINE_SIZE)));
+
+        unsigned int mask __attribute__((aligned(CACHE_LINE_SIZE)));
+        struct peer_key *entries;
+};
+
+struct name_entry
+{
+        struct peer_key key;
+        int valid;
+        char name[PEER_NAME_LEN];
+};
+
+struct peerlog
+{
+        struct log_ring *rings;
+        int num_rings;
+        unsigned int sample_every;
+        FILE *out;
+        pthread_t thread;
+        atomic_int stop;
+        struct name_entry cache[NAME_CACHE_SIZE];
+};
+
+static void make_key(const struct sockaddr *addr, struct peer_key *key)
+{
+        memset(key, 0, sizeof(*key));
+        key->family = addr->sa_family;
+        if (addr->sa_family == AF_INET)
+        {
+                const struct sockaddr_in *in = (const void *)addr;
+
+                key->port = in->sin_port;
+                memcpy(key->addr, &in->sin_addr, sizeof(in->sin_addr));
+        }
+        else if (addr->sa_family == AF_INET6)
+        {
+                const struct sockaddr_in6 *in6 = (const void *)addr;
+
+                key->port = in6->sin6_port;
+                key->scope_id = in6->sin6_scope_id;
+                memcpy(key->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        }
+}
+
+static void format_key(const struct peer_key *key, char *buf, size_t len)
+{
+        char host[INET6_ADDRSTRLEN];
+
+        if (key->family == AF_INET)
+        {
+                inet_ntop(AF_INET, key->addr, host, sizeof(host));
+                snprintf(buf, len, "%s:%u", host, ntohs(key->port));
+        }
+        else if (key->family == AF_INET6)
+        {
+                inet_ntop(AF_INET6, key->addr, host, sizeof(host));
+                snprintf(buf, len, "[%s]:%u", host, ntohs(key->port));
+        }
+        else
+        {
+                snprintf(buf, len, "<family %u>", key->family);
+        }
+}
+
+void peerlog_format(const struct sockaddr *addr, char *buf, size_t len)
+{
+        struct peer_key key;
+
+        make_key(addr, &key);
+        format_key(&key, buf, len);
+}
+
+static unsigned int hash_key(const struct peer_key *key)
+{
+        const unsigned char *p = (const unsigned char *)key;
+        unsigned int hash = 2166136261u; /* FNV-1a. */
+        size_t i;
+
+        for (i = 0; i < sizeof(*key); i++)
+        {
+                hash = (hash ^ p[i]) * 16777619u;
+        }
+
+        return hash;
+}
+
+static const char *lookup_name(struct peerlog *log,
+                               const struct peer_key *key)
+{
+        struct name_entry *entry;
+
+        entry = &log->cache[hash_key(key) & (NAME_CACHE_SIZE - 1)];
+        if (!entry->valid || memcmp(&entry->key, key, sizeof(*key)) != 0)
+        {
+                entry->key = *key;
+                entry->valid = 1;
+                format_key(key, entry->name, sizeof(entry->name));
+        }
+
+        return entry->name;
+}
+
+void peerlog_record(struct peerlog *log, int ring_index,
+                    const struct sockaddr *addr, socklen_t addr_len)
+{
+        struct log_ring *ring = &log->rings[ring_index];
+        unsigned int tail;
+
+        (void)addr_len;
+
+        if (log->sample_every > 1)
+        {
+                if (++ring->sample_count < log->sample_every)
+                {
+                        return;
+                }
+                ring->sample_count = 0;
+        }
+
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (tail - ring->head_cache > ring->mask)
+        {
+                /* Looks full, see how far the logging thread has got. */
+                ring->head_cache = atomic_load_explicit(&ring->head,
+                                                        memory_order_acquire);
+                if (tail - ring->head_cache > ring->mask)
+                {
+                        ring->dropped++;
+                        return;
+                }
+        }
+
+        make_key(addr, &ring->entries[tail & ring->mask]);
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static unsigned int drain_ring(struct peerlog *log, struct log_ring *ring)
+{
+        unsigned int head;
+        unsigned int tail;
+        unsigned int count;
+
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (count = 0; head != tail; head++, count++)
+        {
+                fprintf(log->out, "Received from %s.\n",
+                        lookup_name(log, &ring->entries[head & ring->mask]));
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        return count;
+}
+
+static void *logger_main(void *arg)
+{
+        struct peerlog *log = arg;
+        struct timespec idle = { 0, IDLE_SLEEP_NS };
+        unsigned int count;
+        int stopping;
+        int i;
+
+        for (;;)
+        {
+                stopping = atomic_load(&log->stop);
+                count = 0;
+                for (i = 0; i < log->num_rings; i++)
+                {
+                        count += drain_ring(log, &log->rings[i]);
+                }
+
+                /* Stop only once a pass after the stop request found the
+                 * rings empty.
+                 */
+                if (count == 0)
+                {
+                        if (stopping)
+                        {
+                                break;
+                        }
+                        fflush(log->out);
+                        nanosleep(&idle, NULL);
+                }
+        }
+
+        fflush(log->out);
+
+        return NULL;
+}
+
+static unsigned int round_up_pow2(unsigned int n)
+{
+        unsigned int pow2 = 1;
+
+        while (pow2 < n)
+        {
+                pow2 <<= 1;
+        }
+
+        return pow2;
+}
+
+/* Frees log with the entries of its first num_rings rings. */
+static void free_peerlog(struct peerlog *log, int num_rings)
+{
+        int i;
+
+        for (i = 0; i < num_rings; i++)
+        {
+                free(log->rings[i].entries);
+        }
+        free(log->rings);
+        free(log);
+}
+
+struct peerlog *peerlog_create(int num_rings, unsigned int ring_size,
+                               unsigned int sample_every, FILE *out)
+{
+        struct peerlog *log;
+        int i;
+        int status;
+
+        log = calloc(1, sizeof(*log));
+        if (log == NULL)
+        {
+                return NULL;
+        }
+
+        ring_size = round_up_pow2(ring_size);
+        status = posix_memalign((void **)&log->rings, CACHE_LINE_SIZE,
+                                num_rings * sizeof(*log->rings));
+        if (status != 0)
+        {
+                free(log);
+                return NULL;
+        }
+        memset(log->rings, 0, num_rings * sizeof(*log->rings));
+
+        for (i = 0; i < num_rings; i++)
+        {
+                log->rings[i].mask = ring_size - 1;
+                log->rings[i].entries = calloc(ring_size,
+                                               sizeof(struct peer_key));
+                if (log->rings[i].entries == NULL)
+                {
+                        free_peerlog(log, i);
+                        return NULL;
+                }
+        }
+
+        log->num_rings = num_rings;
+        log->sample_every = sample_every;
+        log->out = out;
+        atomic_init(&log->stop, 0);
+
+        status = pthread_create(&log->thread, NULL, logger_main, log);
+        if (status != 0)
+        {
+                fprintf(stderr, "pthread_create: %s.\n", strerror(status));
+                free_peerlog(log, num_rings);
+                return NULL;
+        }
+
+        return log;
+}
+
+unsigned long long peerlog_destroy(struct peerlog *log)
+{
+        unsigned long long dropped = 0;
+        int i;
+
+        atomic_store(&log->stop, 1);
+        pthread_join(log->thread, NULL);
+
+        for (i = 0; i < log->num_rings; i++)
+        {
+                dropped += log->rings[i].dropped;
+        }
+        free_peerlog(log, log->num_rings);
+
+        return dropped;
+}
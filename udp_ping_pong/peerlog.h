@@ -0,0 +1,33 @@
+#ifndef __PEERLOG_H_
+#define __PEERLOG_H_
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+struct peerlog;
+
+/* Creates a logger with one ring per producer thread and starts the
+ * thread that drains the rings into out. With sample_every N only every
+ * Nth datagram of a producer is logged.
+ */
+extern struct peerlog *peerlog_create(int num_rings, unsigned int ring_size,
+                                      unsigned int sample_every, FILE *out);
+
+/* Hot path, only to be called by the one producer of the ring. Never
+ * blocks, a full ring drops the entry and counts it.
+ */
+extern void peerlog_record(struct peerlog *log, int ring,
+                           const struct sockaddr *addr, socklen_t addr_len);
+
+/* Formats addr as numeric host and port, like "127.0.0.1:7" or
+ * "[::1]:7". Never does a name lookup.
+ */
+extern void peerlog_format(const struct sockaddr *addr, char *buf,
+                           size_t len);
+
+/* Stops the logging thread after it has drained the rings. Returns the
+ * number of entries dropped on full rings.
+ */
+extern unsigned long long peerlog_destroy(struct peerlog *log);
+
+#endif
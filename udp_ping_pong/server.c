@@ -1,18 +1,43 @@
 #include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+
+#include "busypoll.h"
+#include "gso.h"
+#include "peerlog.h"
+#include "uring_echo.h"
 
 #define BUF_SIZE 500
+#define MAX_BATCH_SIZE 1024
+#define MAX_WORKERS 256
+#define CACHE_LINE_SIZE 64
+#define MAX_PORTS 32
+#define MAX_SOCKETS 64
+#define MAX_EVENTS 64
+#define LOG_RING_SIZE 4096
+
+/* Options for opening a bound socket. */
+#define BIND_REUSEPORT 0x1
+#define BIND_NONBLOCK  0x2
+#define BIND_V6ONLY    0x4
+#define BIND_GRO       0x8
 
 /* This program implements an echo server.
  * The function getaddrinfo is used in conjunction with the specified
  * port to be able to create a localhost datagram socket and bind to it.
- * Using this socket UDP-messages are received with recvfrom, and
- * echoed back using send.
+ * Using this socket UDP-messages are received with recvmsg, and
+ * echoed back using sendmsg.
  *
  * Standard functions used (and what for):
  *   getaddrinfo    - Get address info, in this case only datagram
@@ -20,12 +45,154 @@
  *   socket         - To create a socket on one of the results from
  *                    getaddrinfo.
  *   bind           - To be able to receive and send from the opened socket.
- *   recvfrom       - Blocking receive from the socket from a peer.
+ *   recvmsg        - Blocking receive from the socket from a peer.
  *                    This function also provides enough information on
  *                    the sender to be able to send back received data.
- *   getnameinfo    - Get name of peer and port and print this.
- *   send           - Used to send back received data to peer.
+ *   peerlog        - Hand the peer address to the logging thread in
+ *                    peerlog.c, which prints it numerically. Use -s to
+ *                    log only a sample of the datagrams, -q for none.
+ *   sendmsg        - Used to send back received data to peer.
+ *
+ * With the -b option the server instead works in batched mode:
+ *   recvmmsg       - Drain up to batch-size datagrams in one call. The
+ *                    mmsghdr, iovec and peer address slots are allocated
+ *                    once at startup and reused for every call.
+ *   sendmmsg       - Echo every datagram of the batch in one call.
+ *
+ * With the -j option the server starts several worker threads. Each
+ * worker binds its own socket to the same port with SO_REUSEPORT, so the
+ * kernel spreads the flows over the workers. A worker only touches its
+ * own socket, buffers and counters, nothing is shared on the hot path.
+ * With -a the workers are pinned to consecutive CPUs.
+ *
+ * With the -e option, or when several ports are given, the server binds
+ * every addrinfo result of every port instead of only the first one, so
+ * IPv4 and IPv6 are served side by side. The non-blocking sockets are
+ * put in one epoll set per worker, and each readiness event drains its
+ * socket until the receive call would block.
+ *
+ * With the -g option the sockets use UDP_GRO, so the kernel may coalesce
+ * a train of datagrams of a flow into one buffer of up to 64 KB. The
+ * segment size comes in a cmsg, and the buffer is echoed in one call
+ * with the same segment size in a UDP_SEGMENT cmsg, so the peer gets
+ * back the same datagrams it sent (see gso.c).
+ *
+ * With the -u option the workers use the io_uring engine in uring_echo.c
+ * instead, with multishot receives into a ring of provided buffers. When
+ * the kernel lacks the needed io_uring support the worker falls back to
+ * the receive and send calls above.
+ *
+ * With the -p option the workers busy poll: an empty receive is retried
+ * on the non-blocking socket for up to the given number of microseconds
+ * before the worker blocks, which saves the scheduler wakeup on the
+ * round trip at the cost of a CPU. The sockets also get SO_BUSY_POLL and
+ * SO_PREFER_BUSY_POLL (see busypoll.c). Best combined with -a. In epoll
+ * mode the worker spins on epoll_wait() instead, and drains the ready
+ * sockets without spinning.
+ *
+ * On SIGINT or SIGTERM the server prints how many packets it handled per
+ * receive and send call, which shows how well the batching amortizes the
+ * syscall overhead.
+ */
+
+struct echo_stats
+{
+        unsigned long long packets;
+        unsigned long long recv_calls;
+        unsigned long long send_calls;
+        unsigned long long wait_calls;
+        unsigned long long enter_calls;
+        unsigned long long send_drops;
+        unsigned long long spins;
+        unsigned long long spin_timeouts;
+};
+
+struct echo_batch
+{
+        unsigned int size;
+        struct mmsghdr *msgs;
+        struct iovec *iovecs;
+        struct sockaddr_storage *peer_addrs;
+        char *bufs;
+        size_t buf_size;
+        char *controls;
+        unsigned int *segments;
+};
+
+/* Each worker sits on its own cache lines so that the counters of one
+ * worker never share a line with those of another.
  */
+struct worker
+{
+        pthread_t thread;
+        int id;
+        int cpu;
+        int sfds[MAX_SOCKETS];
+        int num_sfds;
+        int epfd;
+        int batch_size;
+        int use_uring;
+        int gro;
+        int wake_fd;
+        unsigned int spin_us;
+        char *buf;
+        size_t buf_size;
+        struct peerlog *log;
+        struct echo_batch batch;
+        struct echo_stats stats;
+        struct uring_echo_counters uring_counters;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static volatile sig_atomic_t stop;
+
+static double per_call(unsigned long long packets, unsigned long long calls)
+{
+        return (calls == 0) ? 0.0 : (double)packets / (double)calls;
+}
+
+static void add_stats(struct echo_stats *sum, const struct echo_stats *s)
+{
+        sum->packets += s->packets;
+        sum->recv_calls += s->recv_calls;
+        sum->send_calls += s->send_calls;
+        sum->wait_calls += s->wait_calls;
+        sum->enter_calls += s->enter_calls;
+        sum->send_drops += s->send_drops;
+        sum->spins += s->spins;
+        sum->spin_timeouts += s->spin_timeouts;
+}
+
+static void print_stats(const struct echo_stats *s)
+{
+        printf("Echoed %llu packets.\n", s->packets);
+        if (s->recv_calls > 0)
+        {
+                printf("  %llu receive calls, %.2f packets/call.\n",
+                       s->recv_calls, per_call(s->packets, s->recv_calls));
+                printf("  %llu send calls, %.2f packets/call.\n",
+                       s->send_calls, per_call(s->packets, s->send_calls));
+        }
+        if (s->wait_calls > 0)
+        {
+                printf("  %llu epoll_wait calls, %.2f packets/call.\n",
+                       s->wait_calls, per_call(s->packets, s->wait_calls));
+        }
+        if (s->enter_calls > 0)
+        {
+                printf("  %llu io_uring_enter calls, %.2f packets/call.\n",
+                       s->enter_calls, per_call(s->packets, s->enter_calls));
+        }
+        if (s->send_drops > 0)
+        {
+                printf("  %llu echoes dropped on a full send buffer.\n",
+                       s->send_drops);
+        }
+        if (s->spins > 0)
+        {
+                printf("  %llu empty busy-poll spins, %llu spent the budget "
+                       "and blocked.\n", s->spins, s->spin_timeouts);
+        }
+}
 
 static int get_addrinfo_on_port(struct addrinfo **result, const char *port)
 {
@@ -56,119 +223,908 @@ static int get_addrinfo_on_port(struct addrinfo **result, const char *port)
         return 0;
 }
 
-static int get_bound_socket(struct addrinfo *addrinfo, int *result)
+static int open_bound_socket(const struct addrinfo *addrinfo, int options)
+{
+        int one = 1;
+        int type = addrinfo->ai_socktype;
+        int sfd;
+
+        if (options & BIND_NONBLOCK)
+        {
+                type |= SOCK_NONBLOCK;
+        }
+
+        sfd = socket(addrinfo->ai_family, type, addrinfo->ai_protocol);
+        if (sfd == -1)
+        {
+                return -1;
+        }
+
+        if ((options & BIND_REUSEPORT) &&
+            setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one,
+                       sizeof(one)) != 0)
+        {
+                perror("setsockopt SO_REUSEPORT");
+                close(sfd);
+                return -1;
+        }
+
+        /* Keep the IPv6 wildcard socket off the IPv4 port, the IPv4
+         * addrinfo gets a socket of its own.
+         */
+        if ((options & BIND_V6ONLY) && addrinfo->ai_family == AF_INET6 &&
+            setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &one,
+                       sizeof(one)) != 0)
+        {
+                perror("setsockopt IPV6_V6ONLY");
+                close(sfd);
+                return -1;
+        }
+
+        /* Without GRO the echo is still correct, only slower. */
+        if (options & BIND_GRO)
+        {
+                gso_enable_gro(sfd);
+        }
+
+        if (bind(sfd, addrinfo->ai_addr, addrinfo->ai_addrlen) != 0)
+        {
+                close(sfd);
+                return -1;
+        }
+
+        return sfd;
+}
+
+static int get_bound_socket(struct addrinfo *addrinfo, int options,
+                            int *result)
 {
         struct addrinfo *curr;
         int sfd;
 
         for (curr = addrinfo; curr != NULL; curr = curr->ai_next)
         {
-                sfd = socket(curr->ai_family, curr->ai_socktype,
-                                curr->ai_protocol);
-                if (sfd == -1)
+                sfd = open_bound_socket(curr, options);
+                if (sfd != -1)
                 {
-                        continue;
+                        *result = sfd;
+                        return 0;
+                }
+        }
+
+        return __LINE__;
+}
+
+static int get_bound_sockets(struct addrinfo *addrinfo, int options,
+                             struct worker *worker)
+{
+        struct addrinfo *curr;
+        int num_bound = 0;
+        int sfd;
+
+        for (curr = addrinfo; curr != NULL; curr = curr->ai_next)
+        {
+                if (worker->num_sfds == MAX_SOCKETS)
+                {
+                        fprintf(stderr, "More than %d sockets.\n",
+                                MAX_SOCKETS);
+                        return __LINE__;
                 }
 
-                if (bind(sfd, curr->ai_addr, curr->ai_addrlen) == 0)
+                sfd = open_bound_socket(curr, options);
+                if (sfd == -1)
                 {
-                        *result = sfd;
-                        return 0;
+                        perror("bind");
+                        continue;
                 }
 
-                close(sfd);
+                worker->sfds[worker->num_sfds++] = sfd;
+                num_bound++;
         }
 
-        return __LINE__;
+        return (num_bound == 0) ? __LINE__ : 0;
 }
 
-static void print_name_info(struct sockaddr_storage peer_addr,
-                            socklen_t peer_addr_len)
+static void log_peer(struct worker *worker, const struct sockaddr *addr,
+                     socklen_t addr_len)
 {
-        char host[NI_MAXHOST];
-        char service[NI_MAXSERV];
-        int status;
-        
-        status = getnameinfo((struct sockaddr *) &peer_addr, peer_addr_len,
-                             host, NI_MAXHOST, service, NI_MAXSERV,
-                             NI_NUMERICSERV);
-        if (status != 0)
+        if (worker->log != NULL)
         {
-                fprintf(stderr, "getnameinfo: %s.\n", gai_strerror(status));
+                peerlog_record(worker->log, worker->id, addr, addr_len);
         }
-                
-        printf("Received from %s:%s.\n", host, service);
 }
 
-static int echo_server(int sfd)
+/* In busy-poll mode, retries the receive without blocking until a
+ * datagram arrives or the spin budget is spent, then blocks as usual.
+ * With MSG_DONTWAIT in flags, from a drain of a ready socket, it returns
+ * at once, the spinning is done on epoll_wait() instead.
+ */
+static ssize_t receive_msg(struct worker *worker, int sfd,
+                           struct msghdr *msg, int flags)
+{
+        struct busypoll_spin spin;
+        ssize_t nread;
+
+        if (worker->spin_us > 0 && !(flags & MSG_DONTWAIT))
+        {
+                busypoll_start(&spin, worker->spin_us * 1000ULL);
+                do
+                {
+                        nread = recvmsg(sfd, msg, MSG_DONTWAIT);
+                        if (nread >= 0 || errno != EAGAIN)
+                        {
+                                return nread;
+                        }
+                        worker->stats.spins++;
+                } while (!stop && !busypoll_expired(&spin));
+                worker->stats.spin_timeouts++;
+        }
+
+        return recvmsg(sfd, msg, flags);
+}
+
+static int receive_mmsg(struct worker *worker, int sfd, int flags)
+{
+        struct echo_batch *batch = &worker->batch;
+        struct busypoll_spin spin;
+        int nread;
+
+        if (worker->spin_us > 0 && !(flags & MSG_DONTWAIT))
+        {
+                busypoll_start(&spin, worker->spin_us * 1000ULL);
+                do
+                {
+                        nread = recvmmsg(sfd, batch->msgs, batch->size,
+                                         MSG_DONTWAIT, NULL);
+                        if (nread >= 0 || errno != EAGAIN)
+                        {
+                                return nread;
+                        }
+                        worker->stats.spins++;
+                } while (!stop && !busypoll_expired(&spin));
+                worker->stats.spin_timeouts++;
+        }
+
+        return recvmmsg(sfd, batch->msgs, batch->size,
+                        MSG_WAITFORONE | flags, NULL);
+}
+
+/* Returns the number of echoed datagrams, zero when the socket had
+ * nothing to receive. The flags are those of the receive.
+ */
+static int echo_server(struct worker *worker, int sfd, int flags)
 {
         struct sockaddr_storage peer_addr;
-        char buf[BUF_SIZE];
-        socklen_t peer_addr_len = sizeof(struct sockaddr_storage);
+        char control[GSO_CONTROL_SIZE];
+        struct msghdr msg;
+        struct iovec iov;
         ssize_t nread;
-        int status;
+        ssize_t status;
+        int segment_size;
+
+        iov.iov_base = worker->buf;
+        iov.iov_len = worker->buf_size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &peer_addr;
+        msg.msg_namelen = sizeof(peer_addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
 
         /* Receive from socket. */
-        nread = recvfrom(sfd, buf, BUF_SIZE, 0, (struct sockaddr *)&peer_addr,
-                         &peer_addr_len);
-        if (nread == -1)
+        nread = receive_msg(worker, sfd, &msg, flags);
+        worker->stats.recv_calls++;
+        if (nread == -1 || stop)
         {
                 return 0; /* Received nothing. */
         }
 
         /* Print information about the sending peer. */
-        print_name_info(peer_addr, peer_addr_len);
- 
+        log_peer(worker, (struct sockaddr *)&peer_addr, msg.msg_namelen);
+
+        /* A GRO buffer goes back as the same train of datagrams. */
+        segment_size = gso_get_segment_size(&msg);
+        iov.iov_len = nread;
+        msg.msg_controllen = 0;
+        if (gso_num_segments(nread, segment_size) > 1)
+        {
+                gso_set_segment_size(&msg, segment_size);
+        }
+
         /* Send back the information to the peer. */
-        status = sendto(sfd, buf, nread, 0, (struct sockaddr*)&peer_addr,
-                        peer_addr_len);
+        status = sendmsg(sfd, &msg, 0);
+        worker->stats.send_calls++;
+        if (status == -1 && (errno == EAGAIN || errno == ENOBUFS))
+        {
+                worker->stats.send_drops++;
+                return 1;
+        }
         if (status != nread)
         {
-                fprintf(stderr, "sendto: %s.\n", gai_strerror(status));
+                perror("sendmsg");
                 exit(__LINE__);
         }
+        worker->stats.packets += gso_num_segments(nread, segment_size);
+
+        return 1;
+}
+
+static int alloc_echo_batch(struct echo_batch *batch, unsigned int size,
+                            size_t buf_size)
+{
+        unsigned int i;
+
+        batch->size = size;
+        batch->buf_size = buf_size;
+        batch->msgs = calloc(size, sizeof(*batch->msgs));
+        batch->iovecs = calloc(size, sizeof(*batch->iovecs));
+        batch->peer_addrs = calloc(size, sizeof(*batch->peer_addrs));
+        batch->bufs = calloc(size, buf_size);
+        batch->controls = calloc(size, GSO_CONTROL_SIZE);
+        batch->segments = calloc(size, sizeof(*batch->segments));
+        if (batch->msgs == NULL || batch->iovecs == NULL ||
+            batch->peer_addrs == NULL || batch->bufs == NULL ||
+            batch->controls == NULL || batch->segments == NULL)
+        {
+                fprintf(stderr, "Failed to allocate batch of %u.\n", size);
+                return __LINE__;
+        }
+
+        /* Every slot points at its own buffer and peer address for good,
+         * only the lengths have to be reset between calls.
+         */
+        for (i = 0; i < size; i++)
+        {
+                struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+
+                batch->iovecs[i].iov_base = batch->bufs + i * buf_size;
+                hdr->msg_iov = &batch->iovecs[i];
+                hdr->msg_iovlen = 1;
+                hdr->msg_name = &batch->peer_addrs[i];
+                hdr->msg_control = batch->controls + i * GSO_CONTROL_SIZE;
+        }
 
         return 0;
 }
 
-int main(int argc, char *argv[])
+/* Returns the number of echoed datagrams, less than the batch size when
+ * the socket has been drained. The flags are those of the receive.
+ */
+static int echo_server_batch(struct worker *worker, int sfd, int flags)
 {
-        struct addrinfo *result;
-        int sfd;
+        struct echo_batch *batch = &worker->batch;
+        unsigned int i;
+        int segment_size;
+        int nread;
+        int nsent;
         int status;
-        char *port;
 
-        if (argc != 2)
+        for (i = 0; i < batch->size; i++)
         {
-                fprintf(stderr, "Usage: %s port\n", argv[0]);
-                exit(__LINE__);
+                batch->iovecs[i].iov_len = batch->buf_size;
+                batch->msgs[i].msg_hdr.msg_namelen =
+                        sizeof(struct sockaddr_storage);
+                batch->msgs[i].msg_hdr.msg_controllen = GSO_CONTROL_SIZE;
         }
 
-        /* Get address info on the specified port on localhost. */
-        port = argv[1];
-        status = get_addrinfo_on_port(&result, port);
-        if (status != 0)
+        /* Block for the first datagram, then take whatever else is
+         * already queued, up to the batch size.
+         */
+        nread = receive_mmsg(worker, sfd, flags);
+        worker->stats.recv_calls++;
+        if (nread == -1 || stop)
+        {
+                return 0; /* Received nothing. */
+        }
+
+        for (i = 0; i < (unsigned int)nread; i++)
+        {
+                struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+
+                /* Print information about the sending peer. */
+                log_peer(worker, (struct sockaddr *)&batch->peer_addrs[i],
+                         hdr->msg_namelen);
+
+                /* Send back exactly what was received, a GRO buffer as
+                 * the same train of datagrams.
+                 */
+                segment_size = gso_get_segment_size(hdr);
+                batch->iovecs[i].iov_len = batch->msgs[i].msg_len;
+                batch->segments[i] = gso_num_segments(batch->msgs[i].msg_len,
+                                                      segment_size);
+                hdr->msg_controllen = 0;
+                if (batch->segments[i] > 1)
+                {
+                        gso_set_segment_size(hdr, segment_size);
+                }
+        }
+
+        for (nsent = 0; nsent < nread; nsent += status)
+        {
+                status = sendmmsg(sfd, batch->msgs + nsent, nread - nsent, 0);
+                worker->stats.send_calls++;
+                if (status == -1)
+                {
+                        if (errno == EINTR)
+                        {
+                                status = 0;
+                                continue;
+                        }
+                        if (errno == EAGAIN || errno == ENOBUFS)
+                        {
+                                worker->stats.send_drops += nread - nsent;
+                                nread = nsent;
+                                break;
+                        }
+                        perror("sendmmsg");
+                        exit(__LINE__);
+                }
+        }
+        for (i = 0; i < (unsigned int)nread; i++)
         {
-                exit(status);
+                worker->stats.packets += batch->segments[i];
         }
 
-        /* Get a bound socket to one of the addrinfo:s. */
-        status = get_bound_socket(result, &sfd);
+        return nread;
+}
+
+static int echo_socket(struct worker *worker, int sfd, int flags)
+{
+        if (worker->batch_size > 0)
+        {
+                return echo_server_batch(worker, sfd, flags);
+        }
+
+        return echo_server(worker, sfd, flags);
+}
+
+/* Echo from a ready socket until it would block. The last receive finds
+ * it empty and must not spin, the other ready sockets are waiting.
+ */
+static void drain_socket(struct worker *worker, int sfd)
+{
+        int max = (worker->batch_size > 0) ? worker->batch_size : 1;
+
+        while (!stop && echo_socket(worker, sfd, MSG_DONTWAIT) == max)
+        {
+        }
+}
+
+static void echo_server_epoll(struct worker *worker)
+{
+        struct epoll_event events[MAX_EVENTS];
+        struct busypoll_spin spin;
+        int nevents = 0;
+        int i;
+
+        /* Busy polling spins on the ready list before it blocks. */
+        if (worker->spin_us > 0)
+        {
+                busypoll_start(&spin, worker->spin_us * 1000ULL);
+                while ((nevents = epoll_wait(worker->epfd, events,
+                                             MAX_EVENTS, 0)) == 0 &&
+                       !stop && !busypoll_expired(&spin))
+                {
+                        worker->stats.spins++;
+                }
+                if (nevents == 0)
+                {
+                        worker->stats.spin_timeouts++;
+                }
+        }
+        if (nevents == 0)
+        {
+                nevents = epoll_wait(worker->epfd, events, MAX_EVENTS, -1);
+        }
+        worker->stats.wait_calls++;
+        for (i = 0; i < nevents; i++)
+        {
+                drain_socket(worker, events[i].data.fd);
+        }
+}
+
+static int add_sockets_to_epoll(struct worker *worker)
+{
+        struct epoll_event event;
+        int i;
+
+        worker->epfd = epoll_create1(0);
+        if (worker->epfd == -1)
+        {
+                perror("epoll_create1");
+                return __LINE__;
+        }
+
+        for (i = 0; i < worker->num_sfds; i++)
+        {
+                memset(&event, 0, sizeof(event));
+                event.events = EPOLLIN;
+                event.data.fd = worker->sfds[i];
+                if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->sfds[i],
+                              &event) != 0)
+                {
+                        perror("epoll_ctl");
+                        return __LINE__;
+                }
+        }
+
+        return 0;
+}
+
+static void pin_worker(struct worker *worker)
+{
+        cpu_set_t cpus;
+        int status;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        status = pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
         if (status != 0)
         {
-                exit(status);
+                fprintf(stderr, "Worker %d: failed to pin to CPU %d: %s.\n",
+                        worker->id, worker->cpu, strerror(status));
         }
-        freeaddrinfo(result);
+}
+
+static void log_uring_peer(void *arg, const struct sockaddr *addr,
+                           socklen_t addr_len)
+{
+        log_peer(arg, addr, addr_len);
+}
+
+static void echo_server_uring(struct worker *worker)
+{
+        struct uring_echo *uring;
+        int status;
 
-        /* We have now successfully opened a datagram socket, and
-         * bind to it, and can start receiving from it.
+        /* The ring is created by the thread that uses it, which lets the
+         * kernel skip the locking for several submitters.
          */
-        for (;;)
+        uring = uring_echo_create(worker->sfds, worker->num_sfds,
+                                  worker->wake_fd, worker->buf_size,
+                                  worker->gro, log_uring_peer, worker);
+        if (uring == NULL)
+        {
+                fprintf(stderr, "Worker %d: io_uring unavailable (%s), "
+                        "using the %s path.\n", worker->id, strerror(errno),
+                        (worker->epfd != -1) ? "epoll" : "blocking");
+                return;
+        }
+
+        while (!stop)
+        {
+                status = uring_echo_serve(uring, &worker->uring_counters);
+                if (status == -1)
+                {
+                        fprintf(stderr, "Worker %d: io_uring multishot "
+                                "receive unsupported, using the %s path.\n",
+                                worker->id,
+                                (worker->epfd != -1) ? "epoll" : "blocking");
+                        break;
+                }
+                if (status != 0)
+                {
+                        exit(status);
+                }
+        }
+
+        uring_echo_destroy(uring);
+}
+
+static void *worker_main(void *arg)
+{
+        struct worker *worker = arg;
+
+        if (worker->cpu >= 0)
+        {
+                pin_worker(worker);
+        }
+
+        if (worker->use_uring)
+        {
+                echo_server_uring(worker);
+        }
+
+        while (!stop)
+        {
+                if (worker->epfd != -1)
+                {
+                        echo_server_epoll(worker);
+                }
+                else
+                {
+                        echo_socket(worker, worker->sfds[0], 0);
+                }
+        }
+
+        return NULL;
+}
+
+static void wait_for_stop_signal(void)
+{
+        sigset_t signals;
+        int signum;
+
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigwait(&signals, &signum);
+}
+
+static void block_stop_signals(void)
+{
+        sigset_t signals;
+
+        /* Only the main thread takes the stop signals, the workers and
+         * the logging thread inherit this mask, the workers are woken up
+         * through their sockets.
+         */
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+static struct worker *create_workers(struct addrinfo **addrinfos,
+                                     int num_ports, int use_epoll,
+                                     int use_uring, int num_workers,
+                                     int batch_size, int first_cpu,
+                                     int gro, unsigned int spin_us,
+                                     struct peerlog *log)
+{
+        struct worker *workers;
+        int options = 0;
+        int i;
+        int j;
+        int status;
+
+        if (num_workers > 1)
+        {
+                options |= BIND_REUSEPORT;
+        }
+        if (use_epoll)
+        {
+                options |= BIND_NONBLOCK | BIND_V6ONLY;
+        }
+        if (gro)
+        {
+                options |= BIND_GRO;
+        }
+
+        status = posix_memalign((void **)&workers, CACHE_LINE_SIZE,
+                                num_workers * sizeof(*workers));
+        if (status != 0)
+        {
+                fprintf(stderr, "Failed to allocate %d workers.\n",
+                        num_workers);
+                exit(__LINE__);
+        }
+        memset(workers, 0, num_workers * sizeof(*workers));
+
+        for (i = 0; i < num_workers; i++)
+        {
+                struct worker *worker = &workers[i];
+
+                worker->id = i;
+                worker->cpu = (first_cpu < 0) ? -1 : first_cpu + i;
+                worker->batch_size = batch_size;
+                worker->use_uring = use_uring;
+                worker->log = log;
+                worker->gro = gro;
+                worker->spin_us = spin_us;
+                worker->buf_size = gro ? GSO_BUF_SIZE : BUF_SIZE;
+                worker->buf = malloc(worker->buf_size);
+                worker->wake_fd = -1;
+                if (worker->buf == NULL)
+                {
+                        fprintf(stderr, "Failed to allocate buffer.\n");
+                        exit(__LINE__);
+                }
+                worker->epfd = -1;
+
+                /* Shutting down the sockets does not wake up io_uring. */
+                if (use_uring)
+                {
+                        worker->wake_fd = eventfd(0, 0);
+                        if (worker->wake_fd == -1)
+                        {
+                                perror("eventfd");
+                                exit(__LINE__);
+                        }
+                }
+
+                if (use_epoll)
+                {
+                        /* Get a bound socket to every addrinfo of every
+                         * port, and wait on all of them at once.
+                         */
+                        for (j = 0; j < num_ports; j++)
+                        {
+                                status = get_bound_sockets(addrinfos[j],
+                                                           options, worker);
+                                if (status != 0)
+                                {
+                                        exit(status);
+                                }
+                        }
+
+                        status = add_sockets_to_epoll(worker);
+                        if (status != 0)
+                        {
+                                exit(status);
+                        }
+                }
+                else
+                {
+                        /* Get a bound socket to one of the addrinfo:s. */
+                        status = get_bound_socket(addrinfos[0], options,
+                                                  &worker->sfds[0]);
+                        if (status != 0)
+                        {
+                                exit(status);
+                        }
+                        worker->num_sfds = 1;
+                }
+
+                /* Without kernel busy polling the spin still helps. */
+                for (j = 0; j < worker->num_sfds && spin_us > 0; j++)
+                {
+                        busypoll_enable(worker->sfds[j], spin_us);
+                }
+
+                if (batch_size > 0)
+                {
+                        status = alloc_echo_batch(&worker->batch, batch_size,
+                                                  worker->buf_size);
+                        if (status != 0)
+                        {
+                                exit(status);
+                        }
+                }
+        }
+
+        return workers;
+}
+
+static void print_usage(const char *name)
+{
+        fprintf(stderr, "Usage: %s [-b batch-size] [-j workers] "
+                "[-a first-cpu] [-e] [-u] [-g] [-p usecs]\n"
+                "       [-s sample | -q] port [port...]\n", name);
+        fprintf(stderr, "  -b  Receive and echo up to batch-size datagrams "
+                "per call (1-%d).\n", MAX_BATCH_SIZE);
+        fprintf(stderr, "  -j  Serve the port from this many SO_REUSEPORT "
+                "workers (1-%d).\n", MAX_WORKERS);
+        fprintf(stderr, "  -a  Pin worker n to CPU first-cpu + n.\n");
+        fprintf(stderr, "  -e  Bind every address of every port and serve "
+                "them from an epoll loop,\n"
+                "      implied when more than one port is given.\n");
+        fprintf(stderr, "  -u  Use the io_uring engine when the kernel "
+                "supports it.\n");
+        fprintf(stderr, "  -g  Receive with UDP_GRO and echo coalesced "
+                "buffers with UDP_SEGMENT.\n");
+        fprintf(stderr, "  -p  Busy poll, spin up to usecs on an empty "
+                "socket before blocking (1-%d),\n"
+                "      not with -u.\n", BUSYPOLL_MAX_USECS);
+        fprintf(stderr, "  -s  Log the peer of only every sample:th "
+                "datagram.\n");
+        fprintf(stderr, "  -q  Do not log the peers at all.\n");
+}
+
+int main(int argc, char *argv[])
+{
+        struct addrinfo *results[MAX_PORTS];
+        struct echo_stats total;
+        struct worker *workers;
+        struct peerlog *log = NULL;
+        unsigned long long log_dropped = 0;
+        int sample_every = 1;
+        int batch_size = 0;
+        int num_workers = 1;
+        int first_cpu = -1;
+        int use_epoll = 0;
+        int use_uring = 0;
+        int gro = 0;
+        int spin_us = 0;
+        int num_ports;
+        int opt;
+        int i;
+        int j;
+        int status;
+
+        while ((opt = getopt(argc, argv, "b:j:a:eugp:s:q")) != -1)
+        {
+                switch (opt)
+                {
+                case 'b':
+                        batch_size = atoi(optarg);
+                        if (batch_size < 1 || batch_size > MAX_BATCH_SIZE)
+                        {
+                                print_usage(argv[0]);
+                                exit(__LINE__);
+                        }
+                        break;
+                case 'j':
+                        num_workers = atoi(optarg);
+                        if (num_workers < 1 || num_workers > MAX_WORKERS)
+                        {
+                                print_usage(argv[0]);
+                                exit(__LINE__);
+                        }
+                        break;
+                case 'a':
+                        first_cpu = atoi(optarg);
+                        if (first_cpu < 0)
+                        {
+                                print_usage(argv[0]);
+                                exit(__LINE__);
+                        }
+                        break;
+                case 'e':
+                        use_epoll = 1;
+                        break;
+                case 'u':
+                        use_uring = 1;
+                        break;
+                case 'g':
+                        gro = 1;
+                        break;
+                case 'p':
+                        spin_us = atoi(optarg);
+                        if (spin_us < 1 || spin_us > BUSYPOLL_MAX_USECS)
+                        {
+                                print_usage(argv[0]);
+                                exit(__LINE__);
+                        }
+                        break;
+                case 's':
+                        sample_every = atoi(optarg);
+                        if (sample_every < 1)
+                        {
+                                print_usage(argv[0]);
+                                exit(__LINE__);
+                        }
+                        break;
+                case 'q':
+                        sample_every = 0;
+                        break;
+                default:
+                        print_usage(argv[0]);
+                        exit(__LINE__);
+                }
+        }
+
+        num_ports = argc - optind;
+        if (num_ports < 1 || num_ports > MAX_PORTS)
+        {
+                print_usage(argv[0]);
+                exit(__LINE__);
+        }
+        if (num_ports > 1)
         {
-                status = echo_server(sfd);
+                use_epoll = 1;
+        }
+        if (use_uring && spin_us > 0)
+        {
+                print_usage(argv[0]);
+                exit(__LINE__);
+        }
+
+        /* Get address info on the specified ports on localhost. */
+        for (i = 0; i < num_ports; i++)
+        {
+                status = get_addrinfo_on_port(&results[i], argv[optind + i]);
                 if (status != 0)
                 {
                         exit(status);
                 }
         }
+
+        /* Blocked before the first thread starts, the logging thread
+         * included, so that every thread inherits the mask.
+         */
+        block_stop_signals();
+
+        /* One log ring per worker, drained by the logging thread. */
+        if (sample_every > 0)
+        {
+                log = peerlog_create(num_workers, LOG_RING_SIZE, sample_every,
+                                     stdout);
+                if (log == NULL)
+                {
+                        fprintf(stderr, "Failed to start the peer log.\n");
+                        exit(__LINE__);
+                }
+        }
+
+        /* Every worker gets datagram sockets of its own bound to
+         * the ports.
+         */
+        workers = create_workers(results, num_ports, use_epoll, use_uring,
+                                 num_workers, batch_size, first_cpu, gro,
+                                 spin_us, log);
+        for (i = 0; i < num_ports; i++)
+        {
+                freeaddrinfo(results[i]);
+        }
+
+        /* We have now successfully opened the datagram sockets, and
+         * bind to them, and can start receiving from them.
+         */
+        for (i = 0; i < num_workers; i++)
+        {
+                status = pthread_create(&workers[i].thread, NULL, worker_main,
+                                        &workers[i]);
+                if (status != 0)
+                {
+                        fprintf(stderr, "pthread_create: %s.\n",
+                                strerror(status));
+                        exit(__LINE__);
+                }
+        }
+
+        wait_for_stop_signal();
+        stop = 1;
+
+        /* A shutdown wakes up a worker blocked in a receive call even
+         * though the datagram socket is not connected.
+         */
+        for (i = 0; i < num_workers; i++)
+        {
+                for (j = 0; j < workers[i].num_sfds; j++)
+                {
+                        shutdown(workers[i].sfds[j], SHUT_RDWR);
+                }
+                if (workers[i].wake_fd != -1)
+                {
+                        eventfd_write(workers[i].wake_fd, 1);
+                }
+        }
+
+        for (i = 0; i < num_workers; i++)
+        {
+                pthread_join(workers[i].thread, NULL);
+        }
+        if (log != NULL)
+        {
+                log_dropped = peerlog_destroy(log);
+        }
+
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < num_workers; i++)
+        {
+                workers[i].stats.packets += workers[i].uring_counters.packets;
+                workers[i].stats.enter_calls +=
+                        workers[i].uring_counters.enter_calls;
+                workers[i].stats.send_drops +=
+                        workers[i].uring_counters.send_drops;
+                if (num_workers > 1)
+                {
+                        printf("Worker %d: ", i);
+                        print_stats(&workers[i].stats);
+                }
+                add_stats(&total, &workers[i].stats);
+                for (j = 0; j < workers[i].num_sfds; j++)
+                {
+                        close(workers[i].sfds[j]);
+                }
+                if (workers[i].epfd != -1)
+                {
+                        close(workers[i].epfd);
+                }
+                if (workers[i].wake_fd != -1)
+                {
+                        close(workers[i].wake_fd);
+                }
+        }
+
+        print_stats(&total);
+        if (log_dropped > 0)
+        {
+                printf("  %llu peer log entries dropped on a full ring.\n",
+                       log_dropped);
+        }
+
+        return 0;
 }
@@ -0,0 +1,663 @@
+/* This file implements an io_uring engine for the echo server.
+ * The io_uring interface is used directly through its system calls,
+ * there is no dependency on liburing.
+ *
+ * Every socket gets one multishot recvmsg request. The request picks its
+ * buffers from a ring of provided buffers that is registered with the
+ * kernel, so one request keeps receiving datagrams until the buffers run
+ * out. Each received datagram is echoed with a sendmsg request straight
+ * from the buffer it was received into, and the buffer is handed back to
+ * the kernel when the send completes. Returning a buffer is a plain store
+ * into the buffer ring, no system call is needed for it.
+ *
+ * All sendmsg requests queued while handling one round of completions
+ * are submitted by the same io_uring_enter call that waits for the next
+ * round, so under load a single system call carries many packets.
+ *
+ * A shutdown of a socket does not complete its multishot receive, so the
+ * caller passes a wake descriptor that is polled through the ring as
+ * well. When it becomes readable uring_echo_serve returns.
+ *
+ * Buffer layout of a received datagram, as written by the kernel:
+ *   struct io_uring_recvmsg_out
+ *   peer address     - msg_namelen bytes of the recvmsg request.
+ *   control          - msg_controllen bytes, the UDP_GRO cmsg if any.
+ *   payload          - The rest of the completion.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "gso.h"
+#include "uring_echo.h"
+
+#ifdef IORING_RECV_MULTISHOT
+
+#define RING_ENTRIES 512
+#define NUM_BUFS 256 /* Must be a power of two. */
+#define BUF_GROUP 0
+
+#define OP_RECV 1ULL
+#define OP_SEND 2ULL
+#define OP_WAKE 3ULL
+#define USER_DATA(op, index) (((op) << 32) | (index))
+#define USER_DATA_OP(data) ((data) >> 32)
+#define USER_DATA_INDEX(data) ((unsigned int)((data) & 0xffffffffULL))
+
+struct send_slot
+{
+        struct msghdr msg;
+        struct iovec iov;
+        char control[GSO_CONTROL_SIZE];
+        unsigned int segments;
+        int sfd;
+};
+
+struct uring_echo
+{
+        int ring_fd;
+
+        /* Submission queue. */
+        void *sq_ring;
+        size_t sq_ring_size;
+        unsigned int *sq_head;
+        unsigned int *sq_tail;
+        unsigned int sq_mask;
+        unsigned int sq_entries;
+        unsigned int *sq_array;
+        unsigned int sq_local_tail;
+        unsigned int sq_pending;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        /* Completion queue. */
+        void *cq_ring;
+        size_t cq_ring_size;
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int cq_mask;
+        struct io_uring_cqe *cqes;
+
+        /* Provided buffers. */
+        struct io_uring_buf_ring *buf_ring;
+        size_t buf_ring_size;
+        unsigned short buf_tail;
+        char *bufs;
+        size_t buf_size;
+        struct send_slot send_slots[NUM_BUFS];
+
+        /* Sockets, one multishot receive each. */
+        int *sfds;
+        int num_sfds;
+        struct msghdr *recv_msgs;
+        int received;
+        int wake_fd;
+
+        uring_echo_peer_fn peer_fn;
+        void *peer_arg;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+        return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+                          unsigned int min_complete, unsigned int flags)
+{
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+                             unsigned int nr_args)
+{
+        return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int setup_ring(struct uring_echo *ue)
+{
+        struct io_uring_params p;
+        void *ring;
+
+        /* The newer setup flags only reduce the kernel's work, try
+         * without them on kernels that do not know them.
+         */
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                IORING_SETUP_SINGLE_ISSUER;
+        ue->ring_fd = io_uring_setup(RING_ENTRIES, &p);
+        if (ue->ring_fd == -1 && errno == EINVAL)
+        {
+                memset(&p, 0, sizeof(p));
+                ue->ring_fd = io_uring_setup(RING_ENTRIES, &p);
+        }
+        if (ue->ring_fd == -1)
+        {
+                return -1;
+        }
+
+        ue->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        ue->cq_ring_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+        {
+                if (ue->cq_ring_size > ue->sq_ring_size)
+                {
+                        ue->sq_ring_size = ue->cq_ring_size;
+                }
+                ue->cq_ring_size = 0;
+        }
+
+        ring = mmap(NULL, ue->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ue->ring_fd, IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED)
+        {
+                return -1;
+        }
+        ue->sq_ring = ring;
+
+        if (ue->cq_ring_size == 0)
+        {
+                ue->cq_ring = ue->sq_ring;
+        }
+        else
+        {
+                ring = mmap(NULL, ue->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ue->ring_fd,
+                            IORING_OFF_CQ_RING);
+                if (ring == MAP_FAILED)
+                {
+                        return -1;
+                }
+                ue->cq_ring = ring;
+        }
+
+        ue->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring = mmap(NULL, ue->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ue->ring_fd, IORING_OFF_SQES);
+        if (ring == MAP_FAILED)
+        {
+                return -1;
+        }
+        ue->sqes = ring;
+
+        ue->sq_head = (unsigned int *)((char *)ue->sq_ring + p.sq_off.head);
+        ue->sq_tail = (unsigned int *)((char *)ue->sq_ring + p.sq_off.tail);
+        ue->sq_mask = *(unsigned int *)((char *)ue->sq_ring +
+                                        p.sq_off.ring_mask);
+        ue->sq_array = (unsigned int *)((char *)ue->sq_ring + p.sq_off.array);
+        ue->sq_entries = p.sq_entries;
+        ue->sq_local_tail = *ue->sq_tail;
+
+        ue->cq_head = (unsigned int *)((char *)ue->cq_ring + p.cq_off.head);
+        ue->cq_tail = (unsigned int *)((char *)ue->cq_ring + p.cq_off.tail);
+        ue->cq_mask = *(unsigned int *)((char *)ue->cq_ring +
+                                        p.cq_off.ring_mask);
+        ue->cqes = (struct io_uring_cqe *)((char *)ue->cq_ring +
+                                           p.cq_off.cqes);
+
+        return 0;
+}
+
+static void recycle_buf(struct uring_echo *ue, unsigned int bid)
+{
+        struct io_uring_buf *buf;
+
+        buf = &ue->buf_ring->bufs[ue->buf_tail & (NUM_BUFS - 1)];
+        buf->addr = (unsigned long)(ue->bufs + bid * ue->buf_size);
+        buf->len = ue->buf_size;
+        buf->bid = bid;
+        ue->buf_tail++;
+}
+
+static void publish_bufs(struct uring_echo *ue)
+{
+        __atomic_store_n(&ue->buf_ring->tail, ue->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int setup_bufs(struct uring_echo *ue)
+{
+        struct io_uring_buf_reg reg;
+        void *ring;
+        unsigned int i;
+
+        ue->bufs = calloc(NUM_BUFS, ue->buf_size);
+        if (ue->bufs == NULL)
+        {
+                return -1;
+        }
+
+        /* The buffer ring has to be page aligned. */
+        ue->buf_ring_size = NUM_BUFS * sizeof(struct io_uring_buf);
+        ring = mmap(NULL, ue->buf_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+        {
+                return -1;
+        }
+        ue->buf_ring = ring;
+
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (unsigned long)ue->buf_ring;
+        reg.ring_entries = NUM_BUFS;
+        reg.bgid = BUF_GROUP;
+        if (io_uring_register(ue->ring_fd, IORING_REGISTER_PBUF_RING, &reg,
+                              1) != 0)
+        {
+                return -1;
+        }
+
+        for (i = 0; i < NUM_BUFS; i++)
+        {
+                recycle_buf(ue, i);
+        }
+        publish_bufs(ue);
+
+        return 0;
+}
+
+static int submit(struct uring_echo *ue, unsigned int min_complete,
+                  struct uring_echo_counters *counters)
+{
+        unsigned int flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+        int status;
+
+        __atomic_store_n(ue->sq_tail, ue->sq_local_tail, __ATOMIC_RELEASE);
+        do
+        {
+                status = io_uring_enter(ue->ring_fd, ue->sq_pending,
+                                        min_complete, flags);
+                counters->enter_calls++;
+        } while (status == -1 && errno == EINTR);
+        if (status == -1)
+        {
+                perror("io_uring_enter");
+                return __LINE__;
+        }
+
+        ue->sq_pending = 0;
+
+        return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_echo *ue,
+                                    struct uring_echo_counters *counters)
+{
+        struct io_uring_sqe *sqe;
+        unsigned int index;
+        unsigned int head;
+
+        head = __atomic_load_n(ue->sq_head, __ATOMIC_ACQUIRE);
+        if (ue->sq_local_tail - head == ue->sq_entries)
+        {
+                /* Full, hand the queued requests to the kernel. */
+                if (submit(ue, 0, counters) != 0)
+                {
+                        return NULL;
+                }
+        }
+
+        index = ue->sq_local_tail & ue->sq_mask;
+        ue->sq_array[index] = index;
+        ue->sq_local_tail++;
+        ue->sq_pending++;
+        sqe = &ue->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+
+        return sqe;
+}
+
+static int queue_recv(struct uring_echo *ue, unsigned int index,
+                      struct uring_echo_counters *counters)
+{
+        struct io_uring_sqe *sqe = get_sqe(ue, counters);
+
+        if (sqe == NULL)
+        {
+                return __LINE__;
+        }
+
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = ue->sfds[index];
+        sqe->addr = (unsigned long)&ue->recv_msgs[index];
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+        sqe->user_data = USER_DATA(OP_RECV, index);
+
+        return 0;
+}
+
+static int queue_send(struct uring_echo *ue, unsigned int bid,
+                      struct uring_echo_counters *counters)
+{
+        struct send_slot *slot = &ue->send_slots[bid];
+        struct io_uring_sqe *sqe = get_sqe(ue, counters);
+
+        if (sqe == NULL)
+        {
+                return __LINE__;
+        }
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = slot->sfd;
+        sqe->addr = (unsigned long)&slot->msg;
+        sqe->len = 1;
+        sqe->user_data = USER_DATA(OP_SEND, bid);
+
+        return 0;
+}
+
+static int queue_wake(struct uring_echo *ue,
+                      struct uring_echo_counters *counters)
+{
+        struct io_uring_sqe *sqe = get_sqe(ue, counters);
+
+        if (sqe == NULL)
+        {
+                return __LINE__;
+        }
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = ue->wake_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = USER_DATA(OP_WAKE, 0);
+
+        return 0;
+}
+
+static int handle_recv(struct uring_echo *ue, struct io_uring_cqe *cqe,
+                       struct uring_echo_counters *counters)
+{
+        unsigned int index = USER_DATA_INDEX(cqe->user_data);
+        struct msghdr *recv_msg = &ue->recv_msgs[index];
+        struct io_uring_recvmsg_out *out;
+        struct send_slot *slot;
+        struct msghdr control;
+        unsigned int bid;
+        size_t hdr_len;
+        int segment_size;
+        char *buf;
+
+        if (cqe->res < 0)
+        {
+                if (cqe->res == -EINVAL && !ue->received)
+                {
+                        /* Multishot receive is not supported. */
+                        errno = EOPNOTSUPP;
+                        return -1;
+                }
+                if (cqe->res != -ENOBUFS)
+                {
+                        fprintf(stderr, "recvmsg: %s.\n", strerror(-cqe->res));
+                        return __LINE__;
+                }
+
+                /* Out of buffers, they come back as the sends complete. */
+                return queue_recv(ue, index, counters);
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        {
+                /* The socket has been shut down. */
+                return 0;
+        }
+
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = ue->bufs + bid * ue->buf_size;
+        out = (struct io_uring_recvmsg_out *)buf;
+        hdr_len = sizeof(*out) + recv_msg->msg_namelen +
+                recv_msg->msg_controllen;
+        if ((size_t)cqe->res < hdr_len)
+        {
+                recycle_buf(ue, bid);
+                return 0;
+        }
+        ue->received = 1;
+
+        slot = &ue->send_slots[bid];
+        slot->sfd = ue->sfds[index];
+        slot->msg.msg_name = buf + sizeof(*out);
+        slot->msg.msg_namelen = (out->namelen < recv_msg->msg_namelen) ?
+                out->namelen : recv_msg->msg_namelen;
+        slot->iov.iov_base = buf + hdr_len;
+        slot->iov.iov_len = cqe->res - hdr_len;
+
+        /* A GRO buffer goes back as the same train of datagrams. */
+        memset(&control, 0, sizeof(control));
+        control.msg_control = buf + sizeof(*out) + recv_msg->msg_namelen;
+        control.msg_controllen = out->controllen;
+        segment_size = gso_get_segment_size(&control);
+        slot->segments = gso_num_segments(slot->iov.iov_len, segment_size);
+        slot->msg.msg_controllen = 0;
+        if (slot->segments > 1)
+        {
+                gso_set_segment_size(&slot->msg, segment_size);
+        }
+
+        if (ue->peer_fn != NULL)
+        {
+                ue->peer_fn(ue->peer_arg, slot->msg.msg_name,
+                            slot->msg.msg_namelen);
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+                if (queue_recv(ue, index, counters) != 0)
+                {
+                        return __LINE__;
+                }
+        }
+
+        return queue_send(ue, bid, counters);
+}
+
+static int handle_send(struct uring_echo *ue, struct io_uring_cqe *cqe,
+                       struct uring_echo_counters *counters)
+{
+        unsigned int bid = USER_DATA_INDEX(cqe->user_data);
+
+        recycle_buf(ue, bid);
+
+        if (cqe->res == -EAGAIN || cqe->res == -ENOBUFS)
+        {
+                counters->send_drops++;
+                return 0;
+        }
+        if (cqe->res < 0)
+        {
+                fprintf(stderr, "sendmsg: %s.\n", strerror(-cqe->res));
+                return __LINE__;
+        }
+
+        counters->packets += ue->send_slots[bid].segments;
+
+        return 0;
+}
+
+struct uring_echo *uring_echo_create(const int *sfds, int num_sfds,
+                                     int wake_fd, size_t buf_size, int gro,
+                                     uring_echo_peer_fn peer_fn,
+                                     void *peer_arg)
+{
+        struct uring_echo_counters counters;
+        struct uring_echo *ue;
+        int saved_errno;
+        int i;
+
+        ue = calloc(1, sizeof(*ue));
+        if (ue == NULL)
+        {
+                return NULL;
+        }
+        ue->ring_fd = -1;
+        ue->wake_fd = wake_fd;
+        ue->peer_fn = peer_fn;
+        ue->peer_arg = peer_arg;
+        ue->buf_size = sizeof(struct io_uring_recvmsg_out) +
+                sizeof(struct sockaddr_storage) + GSO_CONTROL_SIZE + buf_size;
+
+        ue->num_sfds = num_sfds;
+        ue->sfds = calloc(num_sfds, sizeof(*ue->sfds));
+        ue->recv_msgs = calloc(num_sfds, sizeof(*ue->recv_msgs));
+        if (ue->sfds == NULL || ue->recv_msgs == NULL)
+        {
+                goto fail;
+        }
+
+        if (setup_ring(ue) != 0 || setup_bufs(ue) != 0)
+        {
+                goto fail;
+        }
+
+        for (i = 0; i < NUM_BUFS; i++)
+        {
+                ue->send_slots[i].msg.msg_iov = &ue->send_slots[i].iov;
+                ue->send_slots[i].msg.msg_iovlen = 1;
+                ue->send_slots[i].msg.msg_control = ue->send_slots[i].control;
+        }
+
+        memset(&counters, 0, sizeof(counters));
+        for (i = 0; i < num_sfds; i++)
+        {
+                ue->sfds[i] = sfds[i];
+                ue->recv_msgs[i].msg_namelen = sizeof(struct sockaddr_storage);
+                ue->recv_msgs[i].msg_controllen = gro ? GSO_CONTROL_SIZE : 0;
+                if (queue_recv(ue, i, &counters) != 0)
+                {
+                        goto fail;
+                }
+        }
+
+        if (queue_wake(ue, &counters) != 0)
+        {
+                goto fail;
+        }
+
+        return ue;
+
+fail:
+        saved_errno = errno;
+        uring_echo_destroy(ue);
+        errno = saved_errno;
+
+        return NULL;
+}
+
+int uring_echo_serve(struct uring_echo *ue,
+                     struct uring_echo_counters *counters)
+{
+        struct io_uring_cqe *cqe;
+        unsigned int head;
+        unsigned int tail;
+        int status = 0;
+
+        /* Submit the echoes of the last round and wait for more. */
+        if (submit(ue, 1, counters) != 0)
+        {
+                return __LINE__;
+        }
+
+        head = *ue->cq_head;
+        tail = __atomic_load_n(ue->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && status == 0; head++)
+        {
+                cqe = &ue->cqes[head & ue->cq_mask];
+                switch (USER_DATA_OP(cqe->user_data))
+                {
+                case OP_RECV:
+                        status = handle_recv(ue, cqe, counters);
+                        break;
+                case OP_SEND:
+                        status = handle_send(ue, cqe, counters);
+                        break;
+                case OP_WAKE:
+                        break;
+                }
+        }
+        __atomic_store_n(ue->cq_head, head, __ATOMIC_RELEASE);
+        publish_bufs(ue);
+
+        return status;
+}
+
+void uring_echo_destroy(struct uring_echo *ue)
+{
+        if (ue == NULL)
+        {
+                return;
+        }
+
+        /* Closing the ring cancels the outstanding requests. */
+        if (ue->ring_fd != -1)
+        {
+                close(ue->ring_fd);
+        }
+        if (ue->sqes != NULL)
+        {
+                munmap(ue->sqes, ue->sqes_size);
+        }
+        if (ue->cq_ring != NULL && ue->cq_ring != ue->sq_ring)
+        {
+                munmap(ue->cq_ring, ue->cq_ring_size);
+        }
+        if (ue->sq_ring != NULL)
+        {
+                munmap(ue->sq_ring, ue->sq_ring_size);
+        }
+        if (ue->buf_ring != NULL)
+        {
+                munmap(ue->buf_ring, ue->buf_ring_size);
+        }
+        free(ue->bufs);
+        free(ue->recv_msgs);
+        free(ue->sfds);
+        free(ue);
+}
+
+#else /* !IORING_RECV_MULTISHOT */
+
+/* The kernel headers are too old for multishot receives. */
+struct uring_echo *uring_echo_create(const int *sfds, int num_sfds,
+                                     int wake_fd, size_t buf_size, int gro,
+                                     uring_echo_peer_fn peer_fn,
+                                     void *peer_arg)
+{
+        (void)sfds;
+        (void)num_sfds;
+        (void)wake_fd;
+        (void)buf_size;
+        (void)gro;
+        (void)peer_fn;
+        (void)peer_arg;
+        errno = ENOSYS;
+
+        return NULL;
+}
+
+int uring_echo_serve(struct uring_echo *ue,
+                     struct uring_echo_counters *counters)
+{
+        (void)ue;
+        (void)counters;
+        errno = EOPNOTSUPP;
+
+        return -1;
+}
+
+void uring_echo_destroy(struct uring_echo *ue)
+{
+        (void)ue;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __URING_ECHO_H_
+#define __URING_ECHO_H_
+
+#include <sys/socket.h>
+
+struct uring_echo;
+
+struct uring_echo_counters
+{
+        unsigned long long packets;
+        unsigned long long enter_calls;
+        unsigned long long send_drops;
+};
+
+/* Called for every received datagram with the address of its peer. */
+typedef void (*uring_echo_peer_fn)(void *arg, const struct sockaddr *addr,
+                                   socklen_t addr_len);
+
+/* Returns NULL with errno set when the kernel lacks the io_uring features
+ * the engine needs, in which case the caller should use another path.
+ * The engine stops waiting as soon as wake_fd becomes readable. With gro
+ * set the sockets are expected to have UDP_GRO turned on, and coalesced
+ * buffers are echoed with UDP_SEGMENT.
+ */
+extern struct uring_echo *uring_echo_create(const int *sfds, int num_sfds,
+                                            int wake_fd, size_t buf_size,
+                                            int gro,
+                                            uring_echo_peer_fn peer_fn,
+                                            void *peer_arg);
+
+/* Submits the pending echoes, waits for at least one completion and
+ * handles all completions. Returns 0 on success, -1 with errno set to
+ * EOPNOTSUPP when the kernel turned out not to support multishot
+ * receives, and __LINE__ on any other error.
+ */
+extern int uring_echo_serve(struct uring_echo *ue,
+                            struct uring_echo_counters *counters);
+
+extern void uring_echo_destroy(struct uring_echo *ue);
+
+#endif